@@ -0,0 +1,667 @@
+// Benchmark host dei percorsi caldi di esp_mesh.
+// Compilato due volte (IS_NODE / IS_ROOT) contro gli stub di bench/stubs:
+// per ogni scenario misura ns/op, allocazioni/op, byte allocati/op e byte
+// copiati/op (contatori prof_bytes del componente), poi confronta con
+// bench/baseline.txt. Esce con 1 se uno scenario supera la soglia.
+//
+//   mesh_bench_node --baseline bench/baseline.txt            confronto
+//   mesh_bench_node --baseline bench/baseline.txt --update   nuova baseline
+//
+// I tempi assoluti dipendono dalla macchina: in baseline finisce il rapporto
+// con un carico di calibrazione misurato accanto a ogni ripetizione, così
+// frequenza della CPU e carico della macchina pesano allo stesso modo.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "host.h"
+#include "mesh.h"
+
+// --- Allocazioni: ogni new passa di qui ---
+static uint64_t g_allocs = 0;
+static uint64_t g_alloc_bytes = 0;
+
+void *operator new(size_t n) {
+  g_allocs++;
+  g_alloc_bytes += n;
+  void *p = malloc(n ? n : 1);
+  if (p == nullptr)
+    throw std::bad_alloc();
+  return p;
+}
+void *operator new[](size_t n) { return operator new(n); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+namespace esphome {
+namespace esp_mesh {
+
+#ifdef IS_ROOT
+#define BENCH_ROLE "root"
+#else
+#define BENCH_ROLE "node"
+#endif
+
+#define BENCH_REPEATS 7        // Si tiene il rapporto mediano tra le ripetizioni
+#define BENCH_CALIB_ITERS 200  // Giri del carico di calibrazione per ripetizione
+#define BENCH_NODES 16         // Nodi che parlano con il Root
+#define BENCH_ENTITIES 8       // Entità per nodo
+
+struct BenchResult {
+  std::string name;
+  double ns = 0;
+  double rel = 0;            // ns/op diviso la calibrazione
+  double allocs = 0;
+  double alloc_bytes = 0;
+  double copied = 0;
+};
+
+static const uint8_t ROOT_MAC[6] = {0x24, 0x0A, 0xC4, 0x00, 0x00, 0x01};
+static const uint8_t ROOT_DST[6] = {0, 0, 0, 0, 0, 0};  // Root virtuale
+
+static void node_mac(uint8_t *mac, uint8_t n) {
+  static const uint8_t base[6] = {0x30, 0xAE, 0xA4, 0x10, 0x00, 0x00};
+  memcpy(mac, base, 6);
+  mac[5] = n;
+}
+
+static uint32_t entity_hash(uint8_t node, uint8_t e) { return 0x5EED0000u + node * 0x100u + e; }
+
+// Carico di riferimento: dipende dalla macchina come il codice misurato
+static double calibrate(int iters) {
+  std::vector<uint32_t> v(256);
+  volatile uint32_t sink = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < iters; i++) {
+    uint32_t x = i + 1;
+    for (auto &e : v) {
+      x = x * 1664525u + 1013904223u;
+      e = x >> 8;
+    }
+    std::sort(v.begin(), v.end());
+    sink = sink + v[i % v.size()];
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(t1 - t0).count() / iters;
+}
+
+struct MeshBench {
+  EspMesh m;
+#ifdef IS_ROOT
+  mqtt::MQTTClient mqtt;
+#endif
+  uint32_t lcg = 12345;
+
+  uint32_t next() { return this->lcg = this->lcg * 1103515245u + 12345u; }
+
+  void setup() {
+    this->m.set_mesh_id("bench-mesh");
+    this->m.set_pmk("0123456789abcdef");
+    this->m.set_profile(true);
+#ifdef IS_ROOT
+    this->m.set_mqtt(&this->mqtt);
+#endif
+    this->m.setup();
+#ifdef IS_NODE
+    // Agganciato al Root, a un hop, orologio sincronizzato
+    std::vector<uint8_t> a = this->announce(ROOT_MAC, 0, 0, ROOT_MAC);
+    this->m.on_packet(ROOT_MAC, a.data(), a.size(), -55);
+    // Entità locali già confermate: 4 sensori I16, 1 F32, 1 switch, 1 testo a dizionario
+    this->m.entities_attached_ = true;
+    this->m.index_acked_.assign(BENCH_ENTITIES, true);
+    for (uint8_t i = 0; i < BENCH_ENTITIES; i++) {
+      uint32_t hash = entity_hash(0, i);
+      this->m.entity_index_[hash] = i;
+      CodecState &st = this->m.codecs_[hash];
+      st.type_id = i < 5 ? 'S' : (i < 7 ? 'W' : 'T');
+      st.codec = i < 4 ? CODEC_I16 : (i < 7 ? CODEC_F32 : CODEC_DICT);
+      st.decimals = i < 4 ? 1 : 0;
+    }
+#endif
+  }
+
+  void complete_tx() {
+    // La radio conferma ogni frame prima del successivo, come in aria
+    for (int i = 0; i < 4 && this->m.tx_busy_; i++)
+      this->m.on_sent(host::last_dst, true);
+  }
+
+  std::vector<uint8_t> frame(uint8_t type, const uint8_t *src, const uint8_t *dst, uint8_t flags, uint16_t seq,
+                             const uint8_t *payload, size_t len) {
+    MeshHeader h{};
+    h.type = type;
+    h.net_id = this->m.net_id_hash_;
+    memcpy(h.src, src, 6);
+    memcpy(h.dst, dst, 6);
+    h.ttl = MESH_DEFAULT_TTL;
+    h.flags = flags;
+    h.seq = seq;
+    std::vector<uint8_t> f(sizeof(h) + len);
+    memcpy(f.data(), &h, sizeof(h));
+    if (len)
+      memcpy(f.data() + sizeof(h), payload, len);
+    return f;
+  }
+
+  std::vector<uint8_t> announce(const uint8_t *src, uint8_t hop, uint16_t cost, const uint8_t *parent) {
+    static const uint8_t bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    AnnouncePayload a{};
+    a.hop = hop;
+    memcpy(a.root_id, ROOT_MAC, 6);
+    a.root_load = 10;
+    a.path_cost = cost;
+    memcpy(a.parent, parent, 6);
+    a.mesh_time = host::now_ms;
+    a.reg_epoch = 0;
+    std::vector<uint8_t> f = this->frame(PKT_ANNOUNCE, src, bcast, PRIO_CONTROL, 0,
+                                         reinterpret_cast<const uint8_t *>(&a), sizeof(a));
+    reinterpret_cast<MeshHeader *>(f.data())->ttl = 1;
+    return f;
+  }
+
+  uint64_t copied() {
+    uint64_t n = 0;
+    for (auto &c : this->m.prof_)
+      n += c.bytes;
+    return n;
+  }
+
+  template<typename F> BenchResult run(const std::string &name, uint32_t ops, F op) {
+    BenchResult r;
+    r.name = std::string(BENCH_ROLE) + "/" + name;
+    for (uint32_t i = 0; i < ops / 4; i++)
+      op(i);  // Tabelle e code a regime
+    r.ns = 1e30;
+    std::vector<double> rel;
+    for (int rep = 0; rep < BENCH_REPEATS; rep++) {
+      // Calibrazione a cavallo della misura: stesse condizioni della CPU
+      double calib = calibrate(BENCH_CALIB_ITERS / 2);
+      uint64_t a0 = g_allocs, b0 = g_alloc_bytes, c0 = this->copied();
+      auto t0 = std::chrono::steady_clock::now();
+      for (uint32_t i = 0; i < ops; i++)
+        op(i);
+      auto t1 = std::chrono::steady_clock::now();
+      calib = (calib + calibrate(BENCH_CALIB_ITERS / 2)) / 2;
+      double ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / ops;
+      r.ns = std::min(r.ns, ns);
+      rel.push_back(ns / calib);
+      r.allocs = double(g_allocs - a0) / ops;
+      r.alloc_bytes = double(g_alloc_bytes - b0) / ops;
+      r.copied = double(this->copied() - c0) / ops;
+    }
+    // Mediana: robusta sia alle ripetizioni disturbate sia a quelle fortunate
+    std::nth_element(rel.begin(), rel.begin() + rel.size() / 2, rel.end());
+    r.rel = rel[rel.size() / 2];
+    return r;
+  }
+
+  // --- Scenari comuni ---
+  BenchResult bench_djb2() {
+    static const char *const ids[] = {"home-mesh", "garden", "esp-mesh-network-02", "b", "living_room_sensors"};
+    std::vector<std::string> s(ids, ids + 5);
+    volatile uint32_t sink = 0;
+    return this->run("djb2_hash", 200000, [&](uint32_t i) { sink = sink + this->m.djb2_hash(s[i % s.size()]); });
+  }
+
+  BenchResult bench_peer_slot() {
+    // 4 vicini attivi (colpi nella tabella) e ogni tanto uno nuovo (sfratto LRU)
+    return this->run("ensure_peer_slot", 50000, [&](uint32_t i) {
+      uint8_t mac[6];
+      node_mac(mac, (i % 5 == 4) ? 40 + (i / 5) % 8 : 1 + i % 4);
+      this->m.ensure_peer_slot(mac);
+    });
+  }
+
+#ifdef IS_NODE
+  // Annunci: uno del parent ogni quattro di vicini (figli, fratelli, più lontani)
+  BenchResult bench_announce() {
+    std::vector<std::vector<uint8_t>> frames;
+    std::vector<std::pair<uint8_t, int8_t>> from;
+    for (uint8_t n = 1; n <= 6; n++) {
+      uint8_t mac[6];
+      node_mac(mac, n);
+      bool child = n <= 2;
+      frames.push_back(this->announce(mac, child ? 2 : 1, child ? 40 : 30, child ? this->m.my_mac_ : ROOT_MAC));
+      from.emplace_back(n, static_cast<int8_t>(-60 - 3 * n));
+    }
+    std::vector<uint8_t> parent = this->announce(ROOT_MAC, 0, 0, ROOT_MAC);
+    auto *pa = reinterpret_cast<AnnouncePayload *>(parent.data() + sizeof(MeshHeader));
+    return this->run("on_packet/announce", 50000, [&](uint32_t i) {
+      host::now_ms += 10;
+      if (i % 5 == 0) {
+        pa->mesh_time = host::now_ms;
+        this->m.on_packet(ROOT_MAC, parent.data(), parent.size(), -55);
+        return;
+      }
+      size_t k = i % frames.size();
+      uint8_t mac[6];
+      node_mac(mac, from[k].first);
+      this->m.on_packet(mac, frames[k].data(), frames[k].size(), from[k].second);
+    });
+  }
+
+  // Repeater: dati dei figli verso il Root (aggregati) e unicast del Root verso di loro
+  BenchResult bench_forward() {
+    std::vector<std::vector<uint8_t>> up, down;
+    uint8_t child[6];
+    node_mac(child, 1);
+    for (uint8_t n = 0; n < 8; n++) {
+      uint8_t src[6];
+      node_mac(src, 100 + n);
+      uint8_t rec[6] = {static_cast<uint8_t>(n % 4), 0x2A, 0x01, 0, 0, 0};
+      up.push_back(this->frame(PKT_DATA, src, ROOT_DST, PRIO_STATE | MESH_FLAG_INDEX, 0, rec, 3 + n % 3));
+      AckPayload ack{static_cast<uint16_t>(n), 0xFFFFFFFF};
+      down.push_back(this->frame(PKT_ACK, ROOT_MAC, src, PRIO_CONTROL, 0, reinterpret_cast<const uint8_t *>(&ack),
+                                 sizeof(ack)));
+    }
+    return this->run("on_packet/forward", 50000, [&](uint32_t i) {
+      if (i % 5 < 3) {
+        auto &f = up[i % up.size()];
+        this->m.on_packet(child, f.data(), f.size(), -62);
+      } else {
+        auto &f = down[i % down.size()];
+        this->m.on_packet(ROOT_MAC, f.data(), f.size(), -55);
+      }
+      if (i % 4 == 3)
+        this->m.flush_agg();
+      this->complete_tx();
+    });
+  }
+
+  BenchResult bench_route() {
+    uint8_t payload[120];
+    memset(payload, 0x5A, sizeof(payload));
+    static const uint8_t sizes[] = {4, 12, 40, 120};
+    return this->run("route_packet", 50000, [&](uint32_t i) {
+      MeshHeader h;
+      this->m.fill_header(h, PKT_DATA, ROOT_DST, MESH_DEFAULT_TTL, PRIO_STATE);
+      this->m.route_packet(&h, payload, sizes[i % 4]);
+      this->complete_tx();
+    });
+  }
+
+  // Comandi di gruppo firmati dal Root: verifica HMAC, finestra anti-replay
+  // e consegna. Ogni frame ha un contatore nuovo, quindi si preparano tutti.
+  BenchResult bench_group() {
+    const uint32_t ops = 10000;
+    uint8_t dst[6] = {MESH_GROUP_PREFIX, 0, 0, 0, 0, 1};
+    this->m.groups_ = 1;
+    std::vector<std::vector<uint8_t>> frames;
+    for (uint32_t i = 0; i < ops / 4 + ops * BENCH_REPEATS; i++) {
+      CmdPayload c{'L', CMD_SET, 0.4f, 0};
+      std::vector<uint8_t> pl(reinterpret_cast<uint8_t *>(&c), reinterpret_cast<uint8_t *>(&c) + sizeof(c));
+      MeshHeader h{};
+      h.type = PKT_CMD;
+      h.net_id = this->m.net_id_hash_;
+      memcpy(h.src, ROOT_MAC, 6);
+      memcpy(h.dst, dst, 6);
+      h.ttl = MESH_DEFAULT_TTL;
+      h.flags = PRIO_CONTROL;
+      h.seq = static_cast<uint16_t>(i);
+      this->m.auth_sign(h, pl);
+      frames.push_back(this->frame(PKT_CMD, ROOT_MAC, dst, PRIO_CONTROL, h.seq, pl.data(), pl.size()));
+    }
+    this->m.pending_cmds_.reserve(64);
+    size_t next = 0, accepted = 0;
+    BenchResult r = this->run("on_packet/group", ops, [&](uint32_t i) {
+      auto &f = frames[next++];
+      this->m.on_packet(ROOT_MAC, f.data(), f.size(), -55);
+      accepted += this->m.pending_cmds_.size();
+      this->m.pending_cmds_.clear();
+    });
+    if (accepted != frames.size()) {
+      fprintf(stderr, "on_packet/group: %zu of %zu signed commands accepted\n", accepted, frames.size());
+      exit(1);
+    }
+    return r;
+  }
+
+  // Stati delle entità verso il Root: codec negoziato + rotta + coda TX
+  BenchResult bench_codec() {
+    static const char *const texts[] = {"idle", "heating", "idle", "error: sensor timeout"};
+    return this->run("send_to_root/codec", 50000, [&](uint32_t i) {
+      uint8_t idx = i % BENCH_ENTITIES;
+      uint8_t rec[4 + 32];
+      uint32_t hash = entity_hash(0, idx);
+      memcpy(rec, &hash, 4);
+      size_t len = 4;
+      if (idx < 5) {
+        float v = 21.5f + (this->next() % 40) / 10.0f;
+        memcpy(rec + 4, &v, 4);
+        len += 4;
+      } else if (idx < 7) {
+        rec[4] = i & 1;
+        len += 1;
+      } else {
+        const char *t = texts[(i / BENCH_ENTITIES) % 4];
+        memcpy(rec + 4, t, strlen(t));
+        len += strlen(t);
+      }
+      this->m.send_to_root(PKT_DATA, rec, len, PRIO_STATE);
+      this->complete_tx();
+    });
+  }
+#endif
+
+#ifdef IS_ROOT
+  std::vector<uint8_t> registration(uint8_t node, uint8_t e) {
+    RegPayload p{};
+    p.entity_hash = entity_hash(node, e);
+    p.type_id = e < 5 ? 'S' : (e < 7 ? 'W' : 'E');
+    p.index = e;
+    p.codec = e < 4 ? CODEC_I16 : (e < 7 ? CODEC_F32 : CODEC_DICT);
+    p.decimals = e < 4 ? 1 : 0;
+    std::vector<uint8_t> f(reinterpret_cast<uint8_t *>(&p), reinterpret_cast<uint8_t *>(&p) + sizeof(p));
+    std::string strs = e < 5 ? std::string("Temperature ") + char('A' + e) + '\0' + "°C" + '\0' + "temperature" + '\0'
+                             : (e < 7 ? std::string("Relay ") + char('A' + e) + '\0' + '\0' + '\0'
+                                      : std::string("Mode") + '\0' + '\0' + '\0' + "auto" + '\0' + "eco" + '\0' +
+                                            "comfort" + '\0');
+    f.insert(f.end(), strs.begin(), strs.end());
+    return f;
+  }
+
+  void register_all() {
+    for (uint8_t n = 0; n < BENCH_NODES; n++) {
+      uint8_t mac[6];
+      node_mac(mac, 100 + n);
+      for (uint8_t e = 0; e < BENCH_ENTITIES; e++) {
+        std::vector<uint8_t> r = this->registration(n, e);
+        this->m.handle_reg(mac, r.data(), r.size());
+      }
+    }
+    this->complete_tx();
+  }
+
+  // Record di stato come li manda un nodo: indice + codec, a volte affidabili.
+  // Preparati prima della misura: le allocazioni del benchmark non contano.
+  std::vector<std::vector<uint8_t>> data_frames() {
+    std::vector<std::vector<uint8_t>> frames;
+    for (uint32_t i = 0; i < BENCH_NODES * BENCH_ENTITIES * 4; i++)
+      frames.push_back(this->data_frame(i));
+    return frames;
+  }
+
+  std::vector<uint8_t> data_frame(uint32_t i) {
+    uint8_t n = i % BENCH_NODES;
+    uint8_t e = (i / BENCH_NODES) % BENCH_ENTITIES;
+    uint8_t src[6];
+    node_mac(src, 100 + n);
+    uint8_t rec[8];
+    size_t len;
+    uint8_t flags = PRIO_STATE | MESH_FLAG_INDEX;
+    rec[0] = e;
+    if (e < 4) {
+      int16_t w = 215 + this->next() % 40;
+      memcpy(rec + 1, &w, 2);
+      len = 3;
+      if (e == 0)
+        flags |= MESH_FLAG_ACK_REQ;
+    } else if (e < 5) {
+      float v = 1013.2f;
+      memcpy(rec + 1, &v, 4);
+      len = 5;
+    } else if (e < 7) {
+      rec[1] = i & 1;
+      len = 2;
+    } else {
+      rec[1] = i % 3;  // Codice delle opzioni statiche
+      len = 2;
+    }
+    return this->frame(PKT_DATA, src, ROOT_DST, flags, static_cast<uint16_t>(i), rec, len);
+  }
+
+  BenchResult bench_announce() {
+    std::vector<std::vector<uint8_t>> frames;
+    for (uint8_t n = 0; n < 6; n++) {
+      uint8_t mac[6];
+      node_mac(mac, 100 + n);
+      frames.push_back(this->announce(mac, 1, 20, ROOT_MAC));
+    }
+    return this->run("on_packet/announce", 50000, [&](uint32_t i) {
+      auto &f = frames[i % frames.size()];
+      this->m.on_packet(f.data() + 5, f.data(), f.size(), -60);
+    });
+  }
+
+  // Consegna al Root: decodifica, ACK dei frame affidabili, coda MQTT
+  BenchResult bench_deliver() {
+    this->register_all();
+    auto frames = this->data_frames();
+    return this->run("on_packet/deliver", 50000, [&](uint32_t i) {
+      auto &f = frames[i % frames.size()];
+      this->m.on_packet(f.data() + 5, f.data(), f.size(), -60);
+      this->complete_tx();
+      if (i % 16 == 15) {
+        host::now_ms += 1000;
+        this->m.drain_publish_queue(host::now_ms);
+      }
+    });
+  }
+
+  BenchResult bench_handle_data() {
+    this->register_all();
+    auto frames = this->data_frames();
+    return this->run("handle_data", 50000, [&](uint32_t i) {
+      auto &f = frames[i % frames.size()];
+      auto *h = reinterpret_cast<const MeshHeader *>(f.data());
+      this->m.handle_data(h, f.data() + sizeof(MeshHeader), f.size() - sizeof(MeshHeader), 0);
+      if (i % 16 == 15) {
+        host::now_ms += 1000;
+        this->m.drain_publish_queue(host::now_ms);
+      }
+    });
+  }
+
+  // Ri-registrazioni (nuova epoca): entità già note, discovery rigenerata
+  BenchResult bench_handle_reg() {
+    std::vector<std::vector<uint8_t>> regs;
+    for (uint8_t n = 0; n < BENCH_NODES; n++) {
+      for (uint8_t e = 0; e < BENCH_ENTITIES; e++)
+        regs.push_back(this->registration(n, e));
+    }
+    return this->run("handle_reg", 20000, [&](uint32_t i) {
+      uint8_t mac[6];
+      uint32_t k = i % regs.size();
+      node_mac(mac, 100 + k / BENCH_ENTITIES);
+      this->m.handle_reg(mac, regs[k].data(), regs[k].size());
+      this->complete_tx();
+      if (i % 16 == 15) {
+        host::now_ms += 1000;
+        this->m.drain_publish_queue(host::now_ms);
+      }
+    });
+  }
+
+  BenchResult bench_route() {
+    // Rotte verso i nodi imparate dai loro dati, come in esercizio
+    this->register_all();
+    for (auto &f : this->data_frames()) {
+      this->m.on_packet(f.data() + 5, f.data(), f.size(), -60);
+      this->complete_tx();
+    }
+    uint8_t payload[40];
+    memset(payload, 0xA5, sizeof(payload));
+    static const uint8_t sizes[] = {6, 6, 12, 40};
+    return this->run("route_packet", 50000, [&](uint32_t i) {
+      uint8_t dst[6];
+      node_mac(dst, 100 + i % BENCH_NODES);
+      MeshHeader h;
+      this->m.fill_header(h, PKT_ACK, dst, MESH_DEFAULT_TTL, PRIO_CONTROL);
+      this->m.route_packet(&h, payload, sizes[i % 4]);
+      this->complete_tx();
+    });
+  }
+#endif
+};
+
+struct BaselineEntry {
+  double rel, allocs, alloc_bytes, copied;
+};
+
+static std::map<std::string, BaselineEntry> load_baseline(const std::string &path) {
+  std::map<std::string, BaselineEntry> b;
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::istringstream ss(line);
+    std::string name;
+    BaselineEntry e;
+    if (ss >> name >> e.rel >> e.allocs >> e.alloc_bytes >> e.copied)
+      b[name] = e;
+  }
+  return b;
+}
+
+static bool save_baseline(const std::string &path, std::map<std::string, BaselineEntry> &b) {
+  std::ofstream out(path);
+  if (!out)
+    return false;
+  out << "# esp_mesh host benchmark baseline: see \"Benchmark Host\" in README.md\n"
+      << "# scenario  ns/op-relative-to-calibration  allocs/op  alloc-bytes/op  copied-bytes/op\n";
+  char buf[160];
+  for (auto &kv : b) {
+    snprintf(buf, sizeof(buf), "%-28s %9.5f %8.2f %10.1f %10.1f\n", kv.first.c_str(), kv.second.rel,
+             kv.second.allocs, kv.second.alloc_bytes, kv.second.copied);
+    out << buf;
+  }
+  return true;
+}
+
+// Oltre la soglia: tempo relativo di più di time_tol, memoria di più di mem_tol
+// (i conteggi sono deterministici, il margine assorbe le differenze di libstdc++)
+static bool regressed(double now, double base, double tol, double slack) { return now > base * (1 + tol) + slack; }
+
+}  // namespace esp_mesh
+}  // namespace esphome
+
+using namespace esphome::esp_mesh;
+
+int main(int argc, char **argv) {
+  std::string baseline;
+  bool update = false;
+  double time_tol = 0.5;
+  double mem_tol = 0.1;
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    if (a == "--baseline" && i + 1 < argc) {
+      baseline = argv[++i];
+    } else if (a == "--update") {
+      update = true;
+    } else if (a == "--time-threshold" && i + 1 < argc) {
+      time_tol = atof(argv[++i]);
+    } else if (a == "--mem-threshold" && i + 1 < argc) {
+      mem_tol = atof(argv[++i]);
+    } else {
+      fprintf(stderr, "usage: %s [--baseline FILE [--update]] [--time-threshold 0.5] [--mem-threshold 0.1]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+
+  double calib = 1e30;
+  for (int rep = 0; rep < BENCH_REPEATS; rep++)
+    calib = std::min(calib, calibrate(BENCH_CALIB_ITERS * 10));
+  std::vector<BenchResult> results;
+  {
+    MeshBench b;
+    b.setup();
+    results.push_back(b.bench_djb2());
+    results.push_back(b.bench_peer_slot());
+  }
+  {
+    MeshBench b;
+    b.setup();
+    results.push_back(b.bench_announce());
+  }
+#ifdef IS_NODE
+  {
+    MeshBench b;
+    b.setup();
+    results.push_back(b.bench_forward());
+  }
+  {
+    MeshBench b;
+    b.setup();
+    results.push_back(b.bench_route());
+  }
+  {
+    MeshBench b;
+    b.setup();
+    results.push_back(b.bench_codec());
+  }
+  {
+    MeshBench b;
+    b.setup();
+    results.push_back(b.bench_group());
+  }
+#endif
+#ifdef IS_ROOT
+  {
+    MeshBench b;
+    b.setup();
+    results.push_back(b.bench_deliver());
+  }
+  {
+    MeshBench b;
+    b.setup();
+    results.push_back(b.bench_handle_data());
+  }
+  {
+    MeshBench b;
+    b.setup();
+    results.push_back(b.bench_handle_reg());
+  }
+  {
+    MeshBench b;
+    b.setup();
+    results.push_back(b.bench_route());
+  }
+#endif
+
+  auto base = load_baseline(baseline);
+  int failures = 0;
+  printf("calibration %.0f ns\n", calib);
+  printf("%-28s %10s %9s %10s %12s %12s\n", "scenario", "ns/op", "rel", "allocs/op", "alloc B/op", "copied B/op");
+  for (auto &r : results) {
+    const char *verdict = "";
+    auto it = base.find(r.name);
+    if (update) {
+      base[r.name] = BaselineEntry{r.rel, r.allocs, r.alloc_bytes, r.copied};
+    } else if (it == base.end()) {
+      verdict = baseline.empty() ? "" : "  (no baseline)";
+    } else if (regressed(r.rel, it->second.rel, time_tol, 0) ||
+               regressed(r.allocs, it->second.allocs, mem_tol, 0.05) ||
+               regressed(r.alloc_bytes, it->second.alloc_bytes, mem_tol, 4) ||
+               regressed(r.copied, it->second.copied, mem_tol, 1)) {
+      verdict = "  REGRESSION";
+      failures++;
+    }
+    printf("%-28s %10.1f %9.5f %10.2f %12.1f %12.1f%s\n", r.name.c_str(), r.ns, r.rel, r.allocs, r.alloc_bytes,
+           r.copied, verdict);
+    if (it != base.end() && *verdict == ' ' && !update) {
+      printf("%-28s %10s %9.5f %10.2f %12.1f %12.1f  (baseline)\n", "", "", it->second.rel, it->second.allocs,
+             it->second.alloc_bytes, it->second.copied);
+    }
+  }
+  if (update) {
+    if (!save_baseline(baseline, base)) {
+      fprintf(stderr, "cannot write %s\n", baseline.c_str());
+      return 2;
+    }
+    printf("baseline written to %s\n", baseline.c_str());
+    return 0;
+  }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,244 @@
+// Implementazioni host delle API ESP-IDF / ESPHome / FreeRTOS usate da esp_mesh.
+// Deterministiche: stesso benchmark, stessi frame, stesse allocazioni.
+#include "host.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <set>
+#include <string>
+#include <vector>
+#include <esp_cpu.h>
+#include <esp_now.h>
+#include <esp_ota_ops.h>
+#include <esp_system.h>
+#include <nvs_flash.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <mbedtls/sha256.h>
+#include "esphome/core/application.h"
+#include "esphome/core/preferences.h"
+
+namespace host {
+uint32_t now_ms = 1000;
+uint32_t frames_sent = 0;
+uint64_t bytes_sent = 0;
+uint8_t last_dst[6];
+static uint32_t rng = 0x9E3779B9;
+static std::set<std::string> peers;
+}  // namespace host
+
+namespace esphome {
+
+namespace setup_priority {
+const float WIFI = 250.0f;
+const float AFTER_WIFI = 200.0f;
+const float DATA = 600.0f;
+}  // namespace setup_priority
+
+Application App;
+static ESPPreferences host_preferences;
+ESPPreferences *global_preferences = &host_preferences;
+
+uint32_t millis() { return host::now_ms; }
+uint32_t micros() { return host::now_ms * 1000u; }
+void delay(uint32_t ms) { host::now_ms += ms; }
+
+uint32_t random_uint32() {
+  // xorshift32: sequenza fissa tra un'esecuzione e l'altra
+  uint32_t x = host::rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return host::rng = x;
+}
+
+uint32_t fnv1_hash(const std::string &str) {
+  uint32_t hash = 2166136261UL;
+  for (char c : str) {
+    hash *= 16777619UL;
+    hash ^= c;
+  }
+  return hash;
+}
+
+}  // namespace esphome
+
+uint32_t esp_cpu_get_cycle_count() {
+  return static_cast<uint32_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+}
+void esp_restart() {}
+uint32_t esp_get_free_heap_size() { return 0; }
+uint32_t esp_get_minimum_free_heap_size() { return 0; }
+int nvs_flash_init() { return 0; }
+
+// --- WiFi / ESP-NOW ---
+esp_err_t esp_wifi_get_mac(wifi_interface_t, uint8_t *mac) {
+  static const uint8_t own[6] = {0x24, 0x0A, 0xC4, 0x00, 0x00, 0x01};
+  memcpy(mac, own, 6);
+  return ESP_OK;
+}
+esp_err_t esp_wifi_set_channel(uint8_t, wifi_second_chan_t) { return ESP_OK; }
+esp_err_t esp_wifi_get_channel(uint8_t *primary, wifi_second_chan_t *second) {
+  *primary = 1;
+  *second = WIFI_SECOND_CHAN_NONE;
+  return ESP_OK;
+}
+esp_err_t esp_wifi_init(const wifi_init_config_t *) { return ESP_OK; }
+esp_err_t esp_wifi_set_mode(wifi_mode_t) { return ESP_OK; }
+esp_err_t esp_wifi_start() { return ESP_OK; }
+esp_err_t esp_wifi_set_ps(wifi_ps_type_t) { return ESP_OK; }
+esp_err_t esp_netif_init() { return ESP_OK; }
+esp_err_t esp_event_loop_create_default() { return ESP_OK; }
+
+esp_err_t esp_now_init() { return ESP_OK; }
+esp_err_t esp_now_set_pmk(const uint8_t *) { return ESP_OK; }
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t) { return ESP_OK; }
+esp_err_t esp_now_register_send_cb(esp_now_send_cb_t) { return ESP_OK; }
+bool esp_now_is_peer_exist(const uint8_t *mac) {
+  return host::peers.count(std::string(reinterpret_cast<const char *>(mac), 6)) != 0;
+}
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer) {
+  if (host::peers.size() >= 20)
+    return -1;  // ESP_ERR_ESPNOW_FULL
+  host::peers.insert(std::string(reinterpret_cast<const char *>(peer->peer_addr), 6));
+  return ESP_OK;
+}
+esp_err_t esp_now_del_peer(const uint8_t *mac) {
+  host::peers.erase(std::string(reinterpret_cast<const char *>(mac), 6));
+  return ESP_OK;
+}
+esp_err_t esp_now_send(const uint8_t *mac, const uint8_t *, size_t len) {
+  host::frames_sent++;
+  host::bytes_sent += len;
+  if (mac != nullptr)
+    memcpy(host::last_dst, mac, 6);
+  return ESP_OK;
+}
+
+// --- OTA: mai usato dal benchmark ---
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *) { return nullptr; }
+esp_err_t esp_ota_begin(const esp_partition_t *, size_t, esp_ota_handle_t *) { return -1; }
+esp_err_t esp_ota_write(esp_ota_handle_t, const void *, size_t) { return -1; }
+esp_err_t esp_ota_end(esp_ota_handle_t) { return -1; }
+esp_err_t esp_ota_abort(esp_ota_handle_t) { return ESP_OK; }
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *) { return -1; }
+
+// --- FreeRTOS: code come deque di copie, nessun task ---
+namespace {
+struct HostQueue {
+  size_t length;
+  size_t item_size;
+  std::deque<std::vector<uint8_t>> items;
+};
+}  // namespace
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) { return new HostQueue{length, item_size, {}}; }
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t) {
+  auto *hq = static_cast<HostQueue *>(q);
+  if (hq->items.size() >= hq->length)
+    return pdFALSE;
+  auto *p = static_cast<const uint8_t *>(item);
+  hq->items.emplace_back(p, p + hq->item_size);
+  return pdTRUE;
+}
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t) {
+  auto *hq = static_cast<HostQueue *>(q);
+  if (hq->items.empty())
+    return pdFALSE;
+  memcpy(item, hq->items.front().data(), hq->item_size);
+  hq->items.pop_front();
+  return pdTRUE;
+}
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t, const char *, uint32_t, void *, UBaseType_t, TaskHandle_t *,
+                                   BaseType_t) {
+  return pdFALSE;
+}
+
+// --- SHA-256 (FIPS 180-4), al posto di mbedtls ---
+static const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t ror(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+static void sha256_block(mbedtls_sha256_context *ctx, const unsigned char *p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 | (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+  uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + K256[i] + w[i];
+    uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  ctx->state[0] += a;
+  ctx->state[1] += b;
+  ctx->state[2] += c;
+  ctx->state[3] += d;
+  ctx->state[4] += e;
+  ctx->state[5] += f;
+  ctx->state[6] += g;
+  ctx->state[7] += h;
+}
+
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx) { memset(ctx, 0, sizeof(*ctx)); }
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx) {}
+int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int) {
+  static const uint32_t IV[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  memcpy(ctx->state, IV, sizeof(IV));
+  ctx->total = 0;
+  return 0;
+}
+int mbedtls_sha256_update(mbedtls_sha256_context *ctx, const unsigned char *input, size_t ilen) {
+  while (ilen > 0) {
+    size_t fill = ctx->total % 64;
+    size_t n = std::min<size_t>(64 - fill, ilen);
+    memcpy(ctx->buf + fill, input, n);
+    ctx->total += n;
+    input += n;
+    ilen -= n;
+    if (ctx->total % 64 == 0)
+      sha256_block(ctx, ctx->buf);
+  }
+  return 0;
+}
+int mbedtls_sha256_finish(mbedtls_sha256_context *ctx, unsigned char output[32]) {
+  uint64_t bits = ctx->total * 8;
+  unsigned char pad = 0x80;
+  mbedtls_sha256_update(ctx, &pad, 1);
+  pad = 0;
+  while (ctx->total % 64 != 56)
+    mbedtls_sha256_update(ctx, &pad, 1);
+  unsigned char len[8];
+  for (int i = 0; i < 8; i++)
+    len[i] = bits >> (56 - 8 * i);
+  mbedtls_sha256_update(ctx, len, 8);
+  for (int i = 0; i < 8; i++) {
+    output[4 * i] = ctx->state[i] >> 24;
+    output[4 * i + 1] = ctx->state[i] >> 16;
+    output[4 * i + 2] = ctx->state[i] >> 8;
+    output[4 * i + 3] = ctx->state[i];
+  }
+  return 0;
+}
@@ -0,0 +1,13 @@
+#pragma once
+// Ambiente host del benchmark: orologio manuale, radio che conta i frame
+#include <cstddef>
+#include <cstdint>
+
+namespace host {
+
+extern uint32_t now_ms;        // millis(): avanza solo quando lo muove il benchmark
+extern uint32_t frames_sent;   // esp_now_send() andati a buon fine
+extern uint64_t bytes_sent;
+extern uint8_t last_dst[6];    // Destinatario dell'ultimo esp_now_send()
+
+}  // namespace host
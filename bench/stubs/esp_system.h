@@ -0,0 +1,5 @@
+#pragma once
+#include <cstdint>
+void esp_restart();
+uint32_t esp_get_free_heap_size();
+uint32_t esp_get_minimum_free_heap_size();
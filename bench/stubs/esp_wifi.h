@@ -0,0 +1,24 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+typedef int esp_err_t;
+#ifndef ESP_OK
+#define ESP_OK 0
+#endif
+typedef enum { WIFI_IF_STA = 0 } wifi_interface_t;
+typedef enum { WIFI_SECOND_CHAN_NONE = 0 } wifi_second_chan_t;
+typedef enum { WIFI_MODE_STA = 1 } wifi_mode_t;
+typedef enum { WIFI_PS_NONE = 0 } wifi_ps_type_t;
+typedef struct {
+  int unused;
+} wifi_init_config_t;
+#define WIFI_INIT_CONFIG_DEFAULT() {0}
+esp_err_t esp_wifi_get_mac(wifi_interface_t ifx, uint8_t *mac);
+esp_err_t esp_wifi_set_channel(uint8_t primary, wifi_second_chan_t second);
+esp_err_t esp_wifi_get_channel(uint8_t *primary, wifi_second_chan_t *second);
+esp_err_t esp_wifi_init(const wifi_init_config_t *config);
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode);
+esp_err_t esp_wifi_start();
+esp_err_t esp_wifi_set_ps(wifi_ps_type_t type);
+esp_err_t esp_netif_init();
+esp_err_t esp_event_loop_create_default();
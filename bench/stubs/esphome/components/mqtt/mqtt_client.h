@@ -0,0 +1,22 @@
+#pragma once
+// Host: broker sempre connesso, i messaggi si contano e basta
+#include "esphome/core/component.h"
+
+namespace esphome {
+namespace mqtt {
+
+using mqtt_callback_t = std::function<void(const std::string &, const std::string &)>;
+
+class MQTTClient : public Component {
+ public:
+  bool publish(const std::string &topic, const std::string &payload, uint8_t qos = 0, bool retain = false) {
+    this->published++;
+    return true;
+  }
+  void subscribe(const std::string &topic, mqtt_callback_t callback, uint8_t qos = 0) {}
+  bool is_connected() { return true; }
+  uint32_t published = 0;
+};
+
+}  // namespace mqtt
+}  // namespace esphome
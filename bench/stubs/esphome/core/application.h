@@ -0,0 +1,12 @@
+#pragma once
+#include "esphome/core/component.h"
+
+namespace esphome {
+
+class Application {
+ public:
+  void feed_wdt() {}
+};
+extern Application App;
+
+}  // namespace esphome
@@ -0,0 +1,29 @@
+#pragma once
+#include "esphome/core/helpers.h"
+
+namespace esphome {
+
+class StringRef {
+ public:
+  StringRef(const char *s = "") : s_(s) {}
+  const char *c_str() const { return this->s_; }
+  size_t size() const { return strlen(this->s_); }
+  bool empty() const { return *this->s_ == 0; }
+  operator std::string() const { return this->s_; }
+
+ private:
+  const char *s_;
+};
+
+class EntityBase {
+ public:
+  const StringRef &get_name() const { return this->name_; }
+  uint32_t get_object_id_hash() { return this->hash_; }
+  bool is_internal() const { return false; }
+
+ protected:
+  StringRef name_;
+  uint32_t hash_ = 0;
+};
+
+}  // namespace esphome
@@ -0,0 +1,39 @@
+#pragma once
+// Host: il minimo di esphome/core/helpers.h usato da esp_mesh
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <mutex>
+#include <algorithm>
+#include <functional>
+
+namespace esphome {
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+uint32_t random_uint32();
+uint32_t fnv1_hash(const std::string &str);
+using std::to_string;
+
+class Mutex {
+ public:
+  void lock() { this->m_.lock(); }
+  void unlock() { this->m_.unlock(); }
+  bool try_lock() { return this->m_.try_lock(); }
+
+ private:
+  std::mutex m_;
+};
+
+class LockGuard {
+ public:
+  LockGuard(Mutex &m) : m_(m) { m_.lock(); }
+  ~LockGuard() { m_.unlock(); }
+
+ private:
+  Mutex &m_;
+};
+
+}  // namespace esphome
@@ -0,0 +1,9 @@
+#pragma once
+// Host: gli argomenti si valutano come sul dispositivo, niente stampa
+template<typename... Args> inline void esp_mesh_bench_log(const char *tag, const char *fmt, Args... args) {}
+#define ESP_LOGE(tag, ...) esp_mesh_bench_log(tag, __VA_ARGS__)
+#define ESP_LOGW(tag, ...) esp_mesh_bench_log(tag, __VA_ARGS__)
+#define ESP_LOGI(tag, ...) esp_mesh_bench_log(tag, __VA_ARGS__)
+#define ESP_LOGD(tag, ...) esp_mesh_bench_log(tag, __VA_ARGS__)
+#define ESP_LOGV(tag, ...) esp_mesh_bench_log(tag, __VA_ARGS__)
+#define ESP_LOGCONFIG(tag, ...) esp_mesh_bench_log(tag, __VA_ARGS__)
@@ -0,0 +1,43 @@
+#pragma once
+// Host: NVS in memoria
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <vector>
+
+namespace esphome {
+
+class ESPPreferenceObject {
+ public:
+  ESPPreferenceObject(std::vector<uint8_t> *slot = nullptr) : slot_(slot) {}
+  template<typename T> bool save(const T *src) {
+    if (this->slot_ == nullptr)
+      return false;
+    this->slot_->assign(reinterpret_cast<const uint8_t *>(src), reinterpret_cast<const uint8_t *>(src) + sizeof(T));
+    return true;
+  }
+  template<typename T> bool load(T *dest) {
+    if (this->slot_ == nullptr || this->slot_->size() != sizeof(T))
+      return false;
+    memcpy(dest, this->slot_->data(), sizeof(T));
+    return true;
+  }
+
+ private:
+  std::vector<uint8_t> *slot_;
+};
+
+class ESPPreferences {
+ public:
+  template<typename T> ESPPreferenceObject make_preference(uint32_t type, bool in_flash = false) {
+    return ESPPreferenceObject(&this->store_[type]);
+  }
+  bool sync() { return true; }
+
+ private:
+  std::map<uint32_t, std::vector<uint8_t>> store_;
+};
+
+extern ESPPreferences *global_preferences;
+
+}  // namespace esphome
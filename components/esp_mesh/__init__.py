@@ -1,10 +1,86 @@
+import struct
+
 import esphome.codegen as cg
 import esphome.config_validation as cv
-from esphome.const import CONF_ID, CONF_MODE, CONF_CHANNEL
+from esphome.const import (CONF_ID, CONF_MODE, CONF_CHANNEL, CONF_NAME, CONF_UNIT_OF_MEASUREMENT,
+                           CONF_DEVICE_CLASS, CONF_ACCURACY_DECIMALS)
+from esphome.core import CORE, ID
+from esphome.helpers import sanitize, snake_case
 
 # --- BEST PRACTICES: COSTANTI E NAMESPACE ---
 CONF_MESH_ID = 'mesh_id'
 CONF_PMK = 'pmk'
+CONF_RELIABLE = 'reliable'
+CONF_PUBLISH_RATE = 'publish_rate'
+CONF_TIMESTAMPS = 'timestamps'
+CONF_TX_SLOTS = 'tx_slots'
+CONF_ROUTE_TIMEOUT = 'route_timeout'
+CONF_MULTIPATH = 'multipath'
+CONF_AGGREGATE = 'aggregate'
+CONF_TASK = 'task'
+CONF_CORE = 'core'
+CONF_PRIORITY = 'priority'
+CONF_PROFILE = 'profile'
+CONF_AVAILABILITY_TIMEOUT = 'availability_timeout'
+CONF_GROUPS = 'groups'
+CONF_ENTITIES = 'entities'
+CONF_TEST_TRAFFIC = 'test_traffic'
+CONF_INTERVAL = 'interval'
+CONF_SIZE = 'size'
+CONF_INCLUDE = 'include'
+CONF_EXCLUDE = 'exclude'
+
+# Bit della reliable mask: 0 = registrazioni, gli altri = EntityType (mesh.h)
+RELIABLE_TYPES = {
+    'registration': 0,
+    'binary_sensor': 0x01,
+    'switch': 0x02,
+    'button': 0x03,
+    'event': 0x04,
+    'sensor': 0x05,
+    'text_sensor': 0x06,
+    'fan': 0x07,
+    'cover': 0x08,
+    'climate': 0x09,
+    'light': 0x0A,
+    'number': 0x0B,
+    'select': 0x0F,
+    'text': 0x10,
+    'lock': 0x11,
+    'valve': 0x12,
+    'alarm_control_panel': 0x13,
+}
+
+# Entità esportate sulla mesh: classe C++ -> (EntityType, type_id di registrazione)
+ENTITY_CLASSES = [
+    ('binary_sensor', 'BinarySensor', 'ENTITY_TYPE_BINARY_SENSOR', 'B'),
+    ('sensor', 'Sensor', 'ENTITY_TYPE_SENSOR', 'S'),
+    ('switch_', 'Switch', 'ENTITY_TYPE_SWITCH', 'W'),
+    ('button', 'Button', 'ENTITY_TYPE_BUTTON', 'N'),
+    ('text_sensor', 'TextSensor', 'ENTITY_TYPE_TEXT_SENSOR', 'T'),
+    ('fan', 'Fan', 'ENTITY_TYPE_FAN', 'F'),
+    ('cover', 'Cover', 'ENTITY_TYPE_COVER', 'C'),
+    ('light', 'LightState', 'ENTITY_TYPE_LIGHT', 'L'),
+    ('climate', 'Climate', 'ENTITY_TYPE_CLIMATE', 'K'),
+    ('number', 'Number', 'ENTITY_TYPE_NUMBER', 'U'),
+    ('text', 'Text', 'ENTITY_TYPE_TEXT', 'X'),
+    ('select', 'Select', 'ENTITY_TYPE_SELECT', 'E'),
+    ('lock', 'Lock', 'ENTITY_TYPE_LOCK', 'O'),
+    ('valve', 'Valve', 'ENTITY_TYPE_VALVE', 'V'),
+    ('alarm_control_panel', 'AlarmControlPanel', 'ENTITY_TYPE_ALARM_CONTROL_PANEL', 'A'),
+    ('event', 'Event', 'ENTITY_TYPE_EVENT', 'Y'),
+]
+
+# ValueCodec (mesh.h) e limiti della registrazione pronta
+CODEC_F32 = 0
+CODEC_I16 = 2
+CODEC_DICT = 4
+CODEC_DELTA = 0x80
+ENTITY_INDEX_MAX = 255
+REG_PREBUILT_MAX = 200
+
+# Classi di priorità (PktPrio in mesh.h)
+PRIORITIES = {'control': 0, 'state': 1, 'bulk': 2}
 
 # Definiamo il namespace C++
 mesh_ns = cg.esphome_ns.namespace('esp_mesh')
@@ -23,12 +99,147 @@ CONFIG_SCHEMA = cv.All(
         cv.Required(CONF_MODE): cv.enum({'ROOT': 0, 'NODE': 1}),
         cv.Required(CONF_MESH_ID): cv.string,
         cv.Required(CONF_PMK): cv.All(cv.string, cv.Length(min=16, max=16)),
+        # Tipi confermati end-to-end dal Root; il resto resta fire-and-forget
+        cv.Optional(CONF_RELIABLE, default=['registration', 'binary_sensor', 'lock', 'alarm_control_panel']):
+            cv.ensure_list(cv.one_of(*RELIABLE_TYPES, lower=True)),
+        # Solo ROOT: messaggi MQTT al secondo svuotati dalla coda di pubblicazione
+        cv.Optional(CONF_PUBLISH_RATE, default=20): cv.int_range(min=1, max=1000),
+        # Solo ROOT: silenzio oltre il quale il nodo viene pingato (0 = niente availability)
+        cv.Optional(CONF_AVAILABILITY_TIMEOUT, default='90s'): cv.positive_time_period_milliseconds,
+        # Solo NODE: timestamp d'origine (orologio di mesh) su ogni dato
+        cv.Optional(CONF_TIMESTAMPS, default=False): cv.boolean,
+        # Slot degli annunci sull'orologio di mesh, per cluster densi (0 = solo jitter)
+        cv.Optional(CONF_TX_SLOTS, default=0): cv.int_range(min=0, max=64),
+        # Vita di una rotta appresa senza traffico dalla destinazione
+        cv.Optional(CONF_ROUTE_TIMEOUT, default='120s'): cv.All(
+            cv.positive_time_period_milliseconds, cv.Range(min=cv.TimePeriod(seconds=1))),
+        # Solo NODE: traffico upstream spalmato su più parent a costo pari
+        cv.Optional(CONF_MULTIPATH, default=True): cv.boolean,
+        # Solo NODE: entità esportate sulla mesh (default tutte, tranne le escluse)
+        cv.Optional(CONF_ENTITIES, default={}): cv.Schema({
+            cv.Optional(CONF_INCLUDE): cv.ensure_list(cv.use_id(cg.EntityBase)),
+            cv.Optional(CONF_EXCLUDE, default=[]): cv.ensure_list(cv.use_id(cg.EntityBase)),
+        }),
+        # Solo NODE: gruppi multicast (1-32) a cui appartiene il nodo
+        cv.Optional(CONF_GROUPS, default=[]): cv.ensure_list(cv.int_range(min=1, max=32)),
+        # Solo NODE (repeater): attesa massima per unire i dati dei figli (0 = off)
+        cv.Optional(CONF_AGGREGATE, default='20ms'): cv.All(
+            cv.positive_time_period_milliseconds, cv.Range(max=cv.TimePeriod(milliseconds=500))),
+        # Solo NODE: modalità di test, dati sintetici per misurare la capacità della mesh
+        cv.Optional(CONF_TEST_TRAFFIC): cv.Schema({
+            cv.Optional(CONF_INTERVAL, default='1s'): cv.All(
+                cv.positive_time_period_milliseconds, cv.Range(min=cv.TimePeriod(milliseconds=1))),
+            cv.Optional(CONF_SIZE, default=16): cv.int_range(min=8, max=200),
+            cv.Optional(CONF_PRIORITY, default='bulk'): cv.enum(PRIORITIES, lower=True),
+            cv.Optional(CONF_RELIABLE, default=False): cv.boolean,
+        }),
+        # Task FreeRTOS dedicato: forwarding indipendente dalla lentezza del loop
+        cv.Optional(CONF_TASK): cv.Schema({
+            cv.Optional(CONF_CORE, default=1): cv.int_range(min=0, max=1),
+            cv.Optional(CONF_PRIORITY, default=5): cv.int_range(min=1, max=24),
+        }),
+        # Misura dei percorsi caldi (ns/op, byte copiati/op) nel report periodico
+        cv.Optional(CONF_PROFILE, default=False): cv.boolean,
     }).extend(cv.COMPONENT_SCHEMA),
     
     # Questo validatore va messo FUORI dal dizionario, dentro cv.All
     cv.only_on(['esp32'])
 )
 
+def fnv1_hash(text):
+    # Come esphome::fnv1_hash, usato da EntityBase::get_object_id_hash()
+    h = 2166136261
+    for b in text.encode('utf-8'):
+        h = (h * 16777619) & 0xFFFFFFFF
+        h ^= b
+    return h
+
+
+def find_entities(node, found):
+    # Tutte le dichiarazioni di entità, anche annidate (es. le sonde di un dht)
+    if isinstance(node, dict):
+        ent_id = node.get(CONF_ID)
+        if isinstance(ent_id, ID) and hasattr(ent_id.type, 'inherits_from'):
+            for i, (ns, cls, _, _) in enumerate(ENTITY_CLASSES):
+                if ent_id.type.inherits_from(cg.esphome_ns.namespace(ns).class_(cls)):
+                    found.append((i, ent_id, node))
+                    break
+        for value in node.values():
+            find_entities(value, found)
+    elif isinstance(node, list):
+        for value in node:
+            find_entities(value, found)
+
+
+def prebuilt_registration(type_id, conf, ent_hash, reliable_mask):
+    # Stessi campi di send_registration(); None se dipendono da tratti noti
+    # solo a runtime (range di number/cover/valve/climate, opzioni delle select,
+    # modalità dei climate, tipi degli eventi)
+    name = conf.get(CONF_NAME)
+    if not name:
+        return None
+    unit = ''
+    dev_class = str(conf.get(CONF_DEVICE_CLASS, ''))
+    codec, decimals = CODEC_F32, 0
+    if type_id == 'S':
+        if CONF_ACCURACY_DECIMALS not in conf:
+            return None
+        decimals = conf[CONF_ACCURACY_DECIMALS]
+        unit = conf.get(CONF_UNIT_OF_MEASUREMENT, '')
+        if 0 <= decimals <= 2:
+            codec = CODEC_I16 | (CODEC_DELTA if reliable_mask & (1 << RELIABLE_TYPES['sensor']) else 0)
+    elif type_id in 'TX':
+        codec = CODEC_DICT
+        if type_id != 'T':
+            dev_class = ''
+    elif type_id in 'BWNFLOA':
+        if type_id != 'B':
+            dev_class = ''
+    else:
+        return None
+    reg = struct.pack('<IcBBb', ent_hash, type_id.encode(), ENTITY_INDEX_MAX, codec, decimals)
+    for text in (name, unit, dev_class):
+        reg += str(text).encode('utf-8') + b'\0'
+    return reg if len(reg) <= REG_PREBUILT_MAX else None
+
+
+async def generate_manifest(var, config, reliable_mask):
+    found = []
+    find_entities(CORE.config, found)
+    include = config[CONF_ENTITIES].get(CONF_INCLUDE)
+    include = None if include is None else {i.id for i in include}
+    exclude = {i.id for i in config[CONF_ENTITIES][CONF_EXCLUDE]}
+    # Ordine per tipo, come la vecchia introspezione di App
+    found.sort(key=lambda e: e[0])
+
+    arrays, entries, entities = [], [], []
+    for i, ent_id, conf in found:
+        if ent_id.id in exclude or (include is not None and ent_id.id not in include):
+            continue
+        _, _, type_name, type_id = ENTITY_CLASSES[i]
+        name = conf.get(CONF_NAME) or CORE.friendly_name or CORE.name
+        ent_hash = fnv1_hash(sanitize(snake_case(str(name))))
+        reg = prebuilt_registration(type_id, conf, ent_hash, reliable_mask)
+        idx = len(entries)
+        if reg is None:
+            entries.append(f'{{esphome::esp_mesh::{type_name}, {ent_hash}u, nullptr, 0}}')
+        else:
+            data = ', '.join(f'0x{b:02X}' for b in reg)
+            arrays.append(f'static const uint8_t esp_mesh_reg_{idx}[] = {{{data}}};')
+            entries.append(f'{{esphome::esp_mesh::{type_name}, {ent_hash}u, esp_mesh_reg_{idx}, {len(reg)}}}')
+        entities.append(ent_id)
+
+    for a in arrays:
+        cg.add_global(cg.RawStatement(a))
+    if entries:
+        cg.add_global(cg.RawStatement('static constexpr esphome::esp_mesh::ManifestEntry esp_mesh_manifest[] = {\n  ' +
+                                      ',\n  '.join(entries) + '\n};'))
+        cg.add(var.set_manifest(cg.RawExpression('esp_mesh_manifest'), len(entries)))
+    for idx, ent_id in enumerate(entities):
+        ent = await cg.get_variable(ent_id)
+        cg.add(var.add_entity(ent, idx))
+
+
 async def to_code(config):
     var = cg.new_Pvariable(config[CONF_ID])
     await cg.register_component(var, config)
@@ -36,6 +247,16 @@ async def to_code(config):
     cg.add(var.set_mesh_id(config[CONF_MESH_ID]))
     cg.add(var.set_pmk(config[CONF_PMK]))
 
+    reliable_mask = 0
+    for t in config[CONF_RELIABLE]:
+        reliable_mask |= 1 << RELIABLE_TYPES[t]
+    cg.add(var.set_reliable_mask(reliable_mask))
+    cg.add(var.set_tx_slots(config[CONF_TX_SLOTS]))
+    cg.add(var.set_route_timeout(config[CONF_ROUTE_TIMEOUT]))
+    cg.add(var.set_profile(config[CONF_PROFILE]))
+    if CONF_TASK in config:
+        cg.add(var.set_task(config[CONF_TASK][CONF_CORE], config[CONF_TASK][CONF_PRIORITY]))
+
     # --- LOGICA DI GENERAZIONE CODICE ---
     if config[CONF_MODE] == 0: # ROOT
         cg.add_define('IS_ROOT')
@@ -48,9 +269,24 @@ async def to_code(config):
 
         mqtt = await cg.get_variable(cg.get_variable_ids()['mqtt'])
         cg.add(var.set_mqtt(mqtt))
+        cg.add(var.set_publish_rate(config[CONF_PUBLISH_RATE]))
+        cg.add(var.set_availability_timeout(config[CONF_AVAILABILITY_TIMEOUT]))
         
     else: # NODE
         cg.add_define('IS_NODE')
+        cg.add(var.set_timestamps(config[CONF_TIMESTAMPS]))
+        cg.add(var.set_multipath(config[CONF_MULTIPATH]))
+        groups_mask = 0
+        for g in config[CONF_GROUPS]:
+            groups_mask |= 1 << (g - 1)
+        cg.add(var.set_groups(groups_mask))
+        cg.add(var.set_aggregate(config[CONF_AGGREGATE]))
+        if CONF_TEST_TRAFFIC in config:
+            test = config[CONF_TEST_TRAFFIC]
+            cg.add(var.set_test_traffic(test[CONF_INTERVAL], test[CONF_SIZE], test[CONF_PRIORITY],
+                                        test[CONF_RELIABLE]))
+        # Manifest delle entità: niente introspezione di App all'avvio
+        await generate_manifest(var, config, reliable_mask)
         # Se nel YAML del nodo c'è un canale fisso (opzionale), lo passiamo
         if CONF_CHANNEL in config:
              cg.add(var.set_channel(config[CONF_CHANNEL]))
\ No newline at end of file
@@ -3,12 +3,204 @@
 #include <esp_now.h>
 #include <esp_wifi.h>
 #include <nvs_flash.h>
+#include "esphome/core/preferences.h"
+#include <esp_system.h>
+#include <cmath>
 
 namespace esphome {
 namespace esp_mesh {
 
 static const char *const TAG = "mesh";
 static EspMesh *global_mesh = nullptr;
+static const uint8_t MESH_ROOT_DST[6] = {0, 0, 0, 0, 0, 0};  // Root virtuale
+
+static std::string mac_hex(const uint8_t *mac) {
+  char s[13];
+  sprintf(s, "%02X%02X%02X%02X%02X%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+  return s;
+}
+
+static bool parse_hex(const char *hex, uint8_t *out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    unsigned v;
+    if (sscanf(hex + 2 * i, "%2x", &v) != 1)
+      return false;
+    out[i] = v;
+  }
+  return true;
+}
+
+// --- CODEC DEI VALORI ---
+static float codec_scale(int8_t decimals) {
+  static const float POW10[] = {1.0f, 10.0f, 100.0f, 1000.0f};
+  return POW10[std::max<int8_t>(0, std::min<int8_t>(decimals, 3))];
+}
+
+// Virgola fissa int16; false se fuori scala (o NaN)
+static bool to_fixed16(float v, int8_t decimals, int32_t &out) {
+  float f = roundf(v * codec_scale(decimals));
+  if (!(f > INT16_MIN && f <= INT16_MAX))
+    return false;
+  out = static_cast<int32_t>(f);
+  return true;
+}
+
+// Half-float IEEE 754, senza subnormali (sotto 2^-14 diventa zero)
+static uint16_t f32_to_f16(float v) {
+  uint32_t x;
+  memcpy(&x, &v, 4);
+  uint16_t sign = (x >> 16) & 0x8000;
+  int32_t exp = static_cast<int32_t>((x >> 23) & 0xFF) - 127 + 15;
+  uint32_t mant = x & 0x7FFFFF;
+  if (((x >> 23) & 0xFF) == 0xFF)
+    return sign | 0x7C00 | (mant ? 0x200 : 0);  // Inf / NaN
+  if (exp >= 31)
+    return sign | 0x7C00;
+  if (exp <= 0)
+    return sign;
+  uint16_t h = sign | (exp << 10) | (mant >> 13);
+  if (mant & 0x1000)
+    h++;  // Arrotondamento: il riporto sull'esponente è corretto
+  return h;
+}
+
+static float f16_to_f32(uint16_t h) {
+  uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1F;
+  uint32_t mant = h & 0x3FF;
+  uint32_t x;
+  if (exp == 0) {
+    x = sign;
+  } else if (exp == 31) {
+    x = sign | 0x7F800000 | (mant << 13);
+  } else {
+    x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+  }
+  float v;
+  memcpy(&v, &x, 4);
+  return v;
+}
+
+// Scrive il valore in out (max 5 byte), restituisce i byte usati
+static size_t encode_value(uint8_t codec, int8_t decimals, float v, uint8_t *out) {
+  switch (codec & CODEC_MASK) {
+    case CODEC_I8: {
+      float f = roundf(v * codec_scale(decimals));
+      if (f > INT8_MIN && f <= INT8_MAX) {
+        out[0] = static_cast<uint8_t>(static_cast<int8_t>(f));
+        return 1;
+      }
+      out[0] = 0x80;  // Escape: segue il float32
+      memcpy(out + 1, &v, 4);
+      return 5;
+    }
+    case CODEC_I16: {
+      int32_t fx;
+      int16_t w = INT16_MIN;  // Escape: segue il float32
+      if (to_fixed16(v, decimals, fx))
+        w = fx;
+      memcpy(out, &w, 2);
+      if (w != INT16_MIN)
+        return 2;
+      memcpy(out + 2, &v, 4);
+      return 6;
+    }
+    case CODEC_F16: {
+      uint16_t h = f32_to_f16(v);
+      memcpy(out, &h, 2);
+      return 2;
+    }
+    default:
+      memcpy(out, &v, 4);
+      return 4;
+  }
+}
+
+// Legge il valore da in, restituisce i byte consumati (-1 se troncato)
+static int decode_value(uint8_t codec, int8_t decimals, const uint8_t *in, int len, float &v) {
+  switch (codec & CODEC_MASK) {
+    case CODEC_I8:
+      if (len < 1)
+        return -1;
+      if (in[0] != 0x80) {
+        v = static_cast<int8_t>(in[0]) / codec_scale(decimals);
+        return 1;
+      }
+      if (len < 5)
+        return -1;
+      memcpy(&v, in + 1, 4);
+      return 5;
+    case CODEC_I16: {
+      int16_t w;
+      if (len < 2)
+        return -1;
+      memcpy(&w, in, 2);
+      if (w != INT16_MIN) {
+        v = w / codec_scale(decimals);
+        return 2;
+      }
+      if (len < 6)
+        return -1;
+      memcpy(&v, in + 2, 4);
+      return 6;
+    }
+    case CODEC_F16: {
+      uint16_t h;
+      if (len < 2)
+        return -1;
+      memcpy(&h, in, 2);
+      v = f16_to_f32(h);
+      return 2;
+    }
+    default:
+      if (len < 4)
+        return -1;
+      memcpy(&v, in, 4);
+      return 4;
+  }
+}
+
+// Modalità climate di ESPHome (indice = ClimateMode) come le attende Home
+// Assistant: opzioni della registrazione sul nodo, stato e comandi sul Root
+static const char *const CLIMATE_MODE_NAMES[] = {"off", "heat_cool", "cool", "heat", "fan_only", "dry", "auto"};
+
+// Contributo di un'entità al manifest (XOR): indipendente dall'ordine
+static uint32_t manifest_part(uint32_t hash, char type_id, uint8_t codec, int8_t decimals) {
+  uint8_t b[7];
+  memcpy(b, &hash, 4);
+  b[4] = type_id;
+  b[5] = codec;
+  b[6] = decimals;
+  uint32_t h = 2166136261UL;
+  for (uint8_t c : b)
+    h = (h ^ c) * 16777619UL;
+  return h;
+}
+
+// Codec più compatto per un valore a range e passo noti (number, cover, climate)
+static uint8_t codec_for_range(float min, float max, float step, int8_t &decimals) {
+  decimals = 0;
+  if (step <= 0) {
+    decimals = 2;
+  } else {
+    while (decimals < 3) {
+      float scaled = step * codec_scale(decimals);
+      if (fabsf(scaled - roundf(scaled)) < 0.001f)
+        break;
+      decimals++;
+    }
+  }
+  float span = std::max(fabsf(min), fabsf(max));
+  float scaled = span * codec_scale(decimals);
+  if (scaled <= INT8_MAX)
+    return CODEC_I8;
+  if (scaled <= INT16_MAX)
+    return CODEC_I16;
+  // Half-float: ~11 bit di mantissa, bastano se il passo è grossolano rispetto al range
+  if (step > 0 && step >= span / 1024.0f && span < 65000.0f)
+    return CODEC_F16;
+  return CODEC_F32;
+}
 
 // --- IMPLEMENTAZIONE SETTERS ---
 void EspMesh::set_mesh_id(const std::string &id) {
@@ -24,6 +216,106 @@ void EspMesh::set_channel(uint8_t channel) {
   this->current_scan_ch_ = channel;
 }
 
+void EspMesh::set_reliable_mask(uint32_t mask) {
+  this->reliable_mask_ = mask;
+}
+
+void EspMesh::set_publish_rate(uint16_t rate) {
+  this->publish_rate_ = rate;
+}
+
+void EspMesh::set_groups(uint32_t mask) {
+#ifdef IS_NODE
+  this->groups_ = mask;
+#endif
+}
+
+void EspMesh::set_manifest(const ManifestEntry *entries, size_t count) {
+#ifdef IS_NODE
+  this->manifest_ = entries;
+  this->manifest_count_ = count;
+  this->local_entities_.reserve(count);
+#endif
+}
+
+void EspMesh::add_entity(EntityBase *entity, size_t index) {
+#ifdef IS_NODE
+  if (index >= this->manifest_count_)
+    return;
+  const ManifestEntry &m = this->manifest_[index];
+  EntityInfo info;
+  info.entity = entity;
+  info.type = m.type;
+  info.meta = &m;
+  // Hash calcolato da Python diverso da quello di ESPHome: la registrazione
+  // si costruisce a runtime, come senza manifest
+  if (m.hash != entity->get_object_id_hash()) {
+    ESP_LOGW(TAG, "Manifest hash mismatch for '%s'", entity->get_name().c_str());
+    info.meta = nullptr;
+  }
+  this->local_entities_.push_back(info);
+#endif
+}
+
+void EspMesh::set_availability_timeout(uint32_t ms) {
+#ifdef IS_ROOT
+  this->avail_timeout_ = ms;
+#endif
+}
+
+void EspMesh::set_timestamps(bool enabled) {
+  this->timestamps_ = enabled;
+}
+
+void EspMesh::set_tx_slots(uint8_t slots) {
+  this->tx_slots_ = std::min<uint8_t>(slots, MAX_TX_SLOTS);
+}
+
+void EspMesh::set_multipath(bool enabled) {
+#ifdef IS_NODE
+  this->multipath_ = enabled;
+#endif
+}
+
+void EspMesh::set_test_traffic(uint32_t interval_ms, uint8_t size, uint8_t prio, bool reliable) {
+#ifdef IS_NODE
+  this->test_interval_ms_ = interval_ms;
+  this->test_size_ = std::max<uint8_t>(size, sizeof(TestPayload));
+  this->test_flags_ = prio | (reliable ? MESH_FLAG_ACK_REQ : 0);
+#endif
+}
+
+void EspMesh::set_aggregate(uint32_t hold_ms) {
+#ifdef IS_NODE
+  this->agg_hold_ms_ = hold_ms;
+#endif
+}
+
+void EspMesh::set_task(uint8_t core, uint8_t priority) {
+  this->use_task_ = true;
+  this->task_core_ = core;
+  this->task_priority_ = priority;
+}
+
+void EspMesh::set_profile(bool enabled) {
+  this->profile_ = enabled;
+}
+
+void EspMesh::set_route_timeout(uint32_t ms) {
+  this->route_timeout_ = std::max<uint32_t>(ms, ROUTE_WHEEL_TICK_MS);
+}
+
+// Tempo di mesh in ms: sul Root coincide con millis()
+uint32_t EspMesh::mesh_time() {
+#ifdef IS_ROOT
+  return millis();
+#else
+  uint32_t now = millis();
+  int32_t elapsed = now - this->last_sync_local_;
+  return now + this->clock_offset_ + static_cast<int32_t>(this->clock_drift_ * elapsed);
+#endif
+}
+
 uint32_t EspMesh::djb2_hash(const std::string &s) {
   uint32_t h = 5381;
   for (char c : s) {
@@ -42,6 +334,16 @@ float EspMesh::get_setup_priority() const {
 
 void EspMesh::setup() {
   global_mesh = this;
+  // La ruota delle rotte parte da adesso: niente recupero dei tick dal boot
+  this->last_wheel_tick_ = millis();
+  // Contatore di firma: si riparte dal blocco riservato all'ultimo avvio,
+  // così i contatori usati prima di un riavvio non si ripetono mai
+  uint32_t reserved = 0;
+  this->auth_pref_ = global_preferences->make_preference<uint32_t>(fnv1_hash("esp_mesh_auth_tx"), true);
+  this->auth_pref_.load(&reserved);
+  this->auth_counter_ = reserved;
+  this->auth_reserved_ = reserved + AUTH_BLOCK;
+  this->auth_pref_.save(&this->auth_reserved_);
 
 #ifdef IS_NODE
   this->setup_bare_metal();
@@ -51,6 +353,16 @@ void EspMesh::setup() {
   }
   // Usiamo la variabile membro pmk_ popolata dal setter
   esp_now_set_pmk(reinterpret_cast<uint8_t *>(const_cast<char *>(this->pmk_.c_str())));
+  // Sequenza iniziale casuale: dopo un riavvio il Root riconosce il salto
+  this->tx_seq_ = random_uint32();
+  // Gruppi assegnati dal Root: prevalgono su quelli del YAML
+  uint32_t groups;
+  this->groups_pref_ = global_preferences->make_preference<uint32_t>(fnv1_hash("esp_mesh_groups"), true);
+  if (this->groups_pref_.load(&groups))
+    this->groups_ = groups;
+  this->restore_auth(this->group_auth_, "esp_mesh_auth_group");
+  this->restore_auth(this->migrate_auth_, "esp_mesh_auth_migrate");
+  this->migrate_seq_ = random_uint32();
 #endif
 
 #ifdef IS_ROOT
@@ -61,12 +373,85 @@ void EspMesh::setup() {
   }
   esp_now_set_pmk(reinterpret_cast<uint8_t *>(const_cast<char *>(this->pmk_.c_str())));
   this->hop_count_ = 0;
+  this->group_seq_ = random_uint32();  // Seq dei frame di gruppo e di migrazione, nuova a ogni avvio
+  this->restore_registry();
+  // Più Root accesi insieme non devono annunciare in fase
+  this->next_announce_ = millis() + random_uint32() % ANNOUNCE_JITTER_MS;
+
+  // Coordinamento tra più Root sullo stesso mesh_id
+  char id[13];
+  sprintf(id, "%02X%02X%02X%02X%02X%02X", this->my_mac_[0], this->my_mac_[1], this->my_mac_[2],
+          this->my_mac_[3], this->my_mac_[4], this->my_mac_[5]);
+  this->root_hex_ = id;
+  if (this->mqtt_) {
+    this->mqtt_->subscribe("mesh_gw/owner/+", [this](const std::string &topic, const std::string &payload) {
+      this->on_owner_message(topic, payload);
+    });
+    // Rollout firmware: comando e blocchi dall'uploader
+    this->mqtt_->subscribe("mesh_gw/ota/start",
+                           [this](const std::string &topic, const std::string &payload) { this->on_ota_start(payload); });
+    this->mqtt_->subscribe("mesh_gw/ota/data/+", [this](const std::string &topic, const std::string &payload) {
+      this->on_ota_data(topic, payload);
+    });
+    // Migrazione pianificata: "<canale> [anticipo_s]", prima di cambiare canale all'AP
+    this->mqtt_->subscribe("mesh_gw/channel/set",
+                           [this](const std::string &topic, const std::string &payload) { this->on_channel_set(payload); });
+    // Comandi di gruppo e assegnazione dei gruppi ai nodi
+    this->mqtt_->subscribe("mesh_gw/group/+/+", [this](const std::string &topic, const std::string &payload) {
+      this->on_group_command(topic, payload);
+    });
+    this->mqtt_->subscribe("mesh_gw/+/groups", [this](const std::string &topic, const std::string &payload) {
+      this->on_group_assign(topic, payload);
+    });
+    // Comandi per entità dalla discovery di Home Assistant
+    for (const char *t : {"mesh_gw/+/set", "mesh_gw/+/set_level", "mesh_gw/+/set_mode"}) {
+      this->mqtt_->subscribe(t, [this](const std::string &topic, const std::string &payload) {
+        this->on_entity_command(topic, payload);
+      });
+    }
+    // Registro da ricostruire (es. discovery persa dal broker): nuova epoca
+    this->mqtt_->subscribe("mesh_gw/resync",
+                           [this](const std::string &topic, const std::string &payload) { this->resync_requested_ = true; });
+  }
 #endif
 
+  // Le callback WiFi copiano RX ed esiti di invio nella coda eventi e
+  // tornano subito: lo stato della mesh si tocca solo dal task dedicato o,
+  // senza task, dal loop()
+  this->events_ = xQueueCreate(MESH_EVENT_QUEUE, sizeof(MeshEvent));
+  if (this->events_ == nullptr) {
+    this->mark_failed();
+    return;
+  }
+  if (this->use_task_ && xTaskCreatePinnedToCore(EspMesh::task_main, "mesh", MESH_TASK_STACK, this,
+                                                 this->task_priority_, nullptr, this->task_core_) != pdPASS) {
+    ESP_LOGE(TAG, "Mesh task creation failed, running from loop()");
+    this->use_task_ = false;
+  }
+
   esp_now_register_recv_cb([](const esp_now_recv_info_t *i, const uint8_t *d, int l) {
-    if (global_mesh) {
-      global_mesh->on_packet(i->src_addr, d, l, i->rx_ctrl ? i->rx_ctrl->rssi : 0);
+    if (!global_mesh || l <= 0 || l > MESH_MAX_FRAME)
+      return;
+    MeshEvent ev;
+    ev.type = MESH_EV_RX;
+    memcpy(ev.mac, i->src_addr, 6);
+    ev.rssi = i->rx_ctrl ? i->rx_ctrl->rssi : 0;
+    ev.len = l;
+    memcpy(ev.data, d, l);
+    xQueueSend(global_mesh->events_, &ev, 0);  // Coda piena: frame perso come in aria
+  });
+  esp_now_register_send_cb([](const uint8_t *mac, esp_now_send_status_t status) {
+    if (!global_mesh)
+      return;
+    MeshEvent ev;
+    ev.type = MESH_EV_SENT;
+    if (mac != nullptr) {
+      memcpy(ev.mac, mac, 6);
+    } else {
+      memset(ev.mac, 0xFF, 6);
     }
+    ev.ok = status == ESP_NOW_SEND_SUCCESS;
+    xQueueSend(global_mesh->events_, &ev, 0);
   });
   ESP_LOGI(TAG, "Mesh initialized. ID Hash: %08X", this->net_id_hash_);
 }
@@ -88,107 +473,229 @@ void EspMesh::dump_config() {
 
 void EspMesh::loop() {
   uint32_t now = millis();
-
-  // 1. ANNOUNCE PROPAGATION
-  if (this->hop_count_ != 0xFF) {
+  if (!this->use_task_) {
+    // Senza task la coda eventi si svuota qui, nello stesso contesto dei timer
+    MeshEvent ev;
+    for (int i = 0; i < MESH_EVENT_QUEUE && xQueueReceive(this->events_, &ev, 0) == pdTRUE; i++)
+      this->handle_event(ev);
+    this->run_mesh(now);
+  }
+#ifdef IS_NODE
+  // Comandi e scansioni chiesti dal contesto mesh (loop o task): le entità
+  // di ESPHome si toccano solo da qui
+  std::vector<CmdPayload> cmds;
+  bool rescan;
+  {
+    LockGuard guard(this->cmd_lock_);
+    cmds.swap(this->pending_cmds_);
+    rescan = this->rescan_pending_;
+    this->rescan_pending_ = false;
+  }
+  if (rescan) {
+    this->scan_pos_ = 0;
+    this->scan_active_ = true;
+  }
+  if (this->scan_active_ && now - this->last_reg_step_ >= REG_PACE_MS) {
+    this->last_reg_step_ = now;
+    this->scan_local_entities();
+  }
+  for (auto &c : cmds)
+    this->apply_command(c);
+  if (this->groups_dirty_) {
+    this->groups_dirty_ = false;
+    this->groups_pref_.save(&this->groups_);
+  }
+#endif
 #ifdef IS_ROOT
-    if (now - this->last_announce_ > 5000) {
-      this->last_announce_ = now;
-      // Broadcast Announce Hop 0
-      uint8_t bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
-      MeshHeader h;
-      h.type = PKT_ANNOUNCE;
-      h.net_id = this->net_id_hash_;
-      h.ttl = 1;
-      memcpy(h.src, this->my_mac_, 6);
-      memcpy(h.dst, bcast, 6);
-      uint8_t hop = 0;
+  // Il client MQTT vive nel loop principale, anche con il task dedicato
+  this->drain_publish_queue(now);
+  this->save_registry();
+#endif
+  this->save_auth(false);
+}
 
-      uint8_t buf[sizeof(MeshHeader) + 1];
-      memcpy(buf, &h, sizeof(MeshHeader));
-      buf[sizeof(MeshHeader)] = hop;
-      this->send_raw(bcast, buf, sizeof(buf));
+// Riavvio pianificato (OTA, reboot): le finestre anti-replay non aspettano AUTH_SAVE_MS
+void EspMesh::on_shutdown() { this->save_auth(true); }
+
+// --- TASK DEDICATO ---
+// Blocca sulla coda eventi: RX e TX-complete vengono gestiti appena arrivano,
+// i timer al più ogni MESH_TASK_TICK_MS, indipendentemente dal loop principale.
+void EspMesh::task_main(void *arg) {
+  auto *self = static_cast<EspMesh *>(arg);
+  MeshEvent ev;
+  for (;;) {
+    if (xQueueReceive(self->events_, &ev, pdMS_TO_TICKS(MESH_TASK_TICK_MS)) == pdTRUE)
+      self->handle_event(ev);
+    uint32_t now = millis();
+    if (now - self->last_housekeeping_ >= MESH_TASK_TICK_MS) {
+      self->last_housekeeping_ = now;
+      self->run_mesh(now);
     }
+  }
+}
+
+void EspMesh::handle_event(MeshEvent &ev) {
+  switch (ev.type) {
+    case MESH_EV_RX:
+      this->on_packet(ev.mac, ev.data, ev.len, ev.rssi);
+      break;
+    case MESH_EV_SENT:
+      this->on_sent(ev.mac[0] == 0xFF ? nullptr : ev.mac, ev.ok);
+      break;
+    case MESH_EV_LOCAL:
+#ifdef IS_NODE
+      this->send_local(ev.pkt_type, ev.local->data(), ev.local->size(), ev.flags);
 #endif
+      delete ev.local;
+      break;
+  }
+}
 
+void EspMesh::submit(uint8_t type, const uint8_t *payload, size_t len, uint8_t flags) {
 #ifdef IS_NODE
-    // Rebroadcast Announce (Repeater Logic)
-    if (now - this->last_announce_sent_ > 5000) {
-      this->last_announce_sent_ = now;
-      uint8_t bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
-      MeshHeader h;
-      h.type = PKT_ANNOUNCE;
-      h.net_id = this->net_id_hash_;
-      h.ttl = 1;
-      memcpy(h.src, this->my_mac_, 6);
-      memcpy(h.dst, bcast, 6);
-      uint8_t my_h = this->hop_count_;
+  if (!this->use_task_) {
+    this->send_local(type, payload, len, flags);
+    return;
+  }
+  MeshEvent ev;
+  ev.type = MESH_EV_LOCAL;
+  ev.pkt_type = type;
+  ev.flags = flags;
+  ev.local = new std::vector<uint8_t>(payload, payload + len);
+  // Il chiamante (loop principale) può aspettare un attimo: un dato non va perso
+  if (xQueueSend(this->events_, &ev, pdMS_TO_TICKS(MESH_TASK_TICK_MS)) != pdTRUE) {
+    delete ev.local;
+    this->stats_.tx_dropped[flags & MESH_FLAG_PRIO_MASK]++;
+  }
+#endif
+}
+
+void EspMesh::run_mesh(uint32_t now) {
+  // 1. ANNOUNCE PROPAGATION (Root: hop 0, Node: repeater)
+  if (this->hop_count_ != 0xFF) {
+    if (static_cast<int32_t>(now - this->next_announce_) >= 0) {
+      // Un vicino ha appena annunciato: ci spostiamo invece di collidere,
+      // ma senza superare il jitter massimo
+      bool late = now - this->next_announce_ > ANNOUNCE_JITTER_MS;
+      if (now - this->last_heard_announce_ < ANNOUNCE_GUARD_MS && !late) {
+        this->next_announce_ = now + ANNOUNCE_GUARD_MS + random_uint32() % ANNOUNCE_GUARD_MS;
+        this->stats_.announce_deferred++;
+      } else {
+        this->send_announce();
+        this->schedule_announce(now);
+      }
+    }
 
-      uint8_t buf[sizeof(MeshHeader) + 1];
-      memcpy(buf, &h, sizeof(MeshHeader));
-      buf[sizeof(MeshHeader)] = my_h;
-      this->send_raw(bcast, buf, sizeof(buf));
+#ifdef IS_ROOT
+    // Carico dichiarato: pubblicazioni MQTT nell'ultima finestra
+    if (now - this->last_load_update_ > ROOT_LOAD_INTERVAL_MS) {
+      this->last_load_update_ = now;
+      this->root_load_ = std::min<uint32_t>(this->publish_count_, 255);
+      this->publish_count_ = 0;
     }
 #endif
   }
 
   // 2. SCANNING LOGIC (NODE ONLY)
 #ifdef IS_NODE
-  if (this->hop_count_ == 0xFF) {
+  this->check_migration(now);
+  if (this->hop_count_ == 0xFF && this->visit_ch_ == 0) {
     if (now - this->last_scan_step_ > 200) {
       this->last_scan_step_ = now;
-      this->current_scan_ch_ = (this->current_scan_ch_ % 13) + 1;
-      esp_wifi_set_channel(this->current_scan_ch_, WIFI_SECOND_CHAN_NONE);
+      // Dopo una migrazione annunciata si insiste sul canale nuovo
+      if (static_cast<int32_t>(now - this->scan_hold_until_) >= 0) {
+        this->current_scan_ch_ = (this->current_scan_ch_ % 13) + 1;
+        esp_wifi_set_channel(this->current_scan_ch_, WIFI_SECOND_CHAN_NONE);
+      }
       this->send_probe();
     }
   }
 #endif
 
-  // 3. ROUTE GARBAGE COLLECTOR (Every 60s)
-  static uint32_t last_route_gc = 0;
-  if (now - last_route_gc > 60000) {
-    last_route_gc = now;
-    for (auto it = this->routes_.begin(); it != this->routes_.end();) {
-      if (now - it->second.last_seen > 300000) {
-        it = this->routes_.erase(it);
-      } else {
-        ++it;
-      }
+  // 3. RIASSEMBLAGGIO FRAMMENTI (NACK + TIMEOUT) / RITRASMISSIONI
+#ifdef IS_ROOT
+  this->check_reassembly(now);
+  this->check_topology(now);
+  this->check_ota(now);
+  this->check_registry(now);
+  this->check_availability(now);
+  this->check_channel(now);
+  this->report_test(now);
+  {
+    std::vector<std::pair<MeshHeader, std::vector<uint8_t>>> frames;
+    {
+      LockGuard guard(this->ctrl_lock_);
+      frames.swap(this->ctrl_pending_);
     }
+    for (auto &f : frames)
+      this->route_packet(&f.first, f.second.data(), f.second.size());
+  }
+  this->send_entity_commands();
+#endif
+#ifdef IS_NODE
+  this->check_retransmit(now);
+  this->check_ota(now);
+  if (this->hop_count_ != 0xFF) {
+    this->check_parent(now);
+    this->refresh_upstream(now);
+    this->send_topology(now);
+  }
+  if (!this->agg_buf_.empty() && now - this->agg_started_ >= this->agg_hold_ms_)
+    this->flush_agg();
+  if (this->test_interval_ms_ != 0 && this->hop_count_ != 0xFF)
+    this->send_test_traffic(now);
+#endif
+
+  // 4. CODE DI TRASMISSIONE + METRICHE
+  this->pump_tx();
+  if (now - this->last_stats_ > STATS_INTERVAL_MS) {
+    this->last_stats_ = now;
+    this->log_stats();
   }
+
+  // 5. SCADENZA ROTTE (timer wheel)
+  this->advance_route_wheel(now);
 }
 
 void EspMesh::on_packet(const uint8_t *mac, const uint8_t *data, int len, int8_t rssi) {
-  if (len < sizeof(MeshHeader))
+  ProfScope prof(this->prof(PROF_ON_PACKET));
+  if (len < (int) sizeof(MeshHeader))
     return;
   auto *h = reinterpret_cast<const MeshHeader *>(data);
   if (h->net_id != this->net_id_hash_)
     return;
 
   // 1. REVERSE PATH LEARNING
-  if (memcmp(h->src, mac, 6) != 0) {
-    std::string src_s(reinterpret_cast<const char *>(h->src), 6);
-    RouteInfo r;
-    memcpy(r.next_hop, mac, 6);
-    r.last_seen = millis();
-    this->routes_[src_s] = r;
-  }
+  // Anche i vicini diretti (src == mac): senza rotta il Root non
+  // potrebbe rispondere (es. NACK) ai figli di primo livello.
+  this->learn_route(h->src, mac);
 
   // 2. HANDLE ANNOUNCE
   if (h->type == PKT_ANNOUNCE) {
-    uint8_t remote_hop = data[sizeof(MeshHeader)];
+    this->last_heard_announce_ = millis();
+#ifdef IS_ROOT
+    this->mark_alive(h->src);  // I figli diretti si sentono anche dagli annunci
+#endif
 #ifdef IS_NODE
-    if (this->hop_count_ == 0xFF || remote_hop + 1 < this->hop_count_) {
-      this->hop_count_ = remote_hop + 1;
-      memcpy(this->parent_mac_, h->src, 6);
-      ESP_LOGI(TAG, "Parent Found: %02X.. (Hop %d) Ch:%d", mac[0], this->hop_count_,
-               this->current_scan_ch_);
-      this->scan_local_entities();
+    if (len >= (int) (sizeof(MeshHeader) + sizeof(AnnouncePayload))) {
+      this->handle_announce(h, reinterpret_cast<const AnnouncePayload *>(data + sizeof(MeshHeader)), rssi);
     }
 #endif
     return;
   }
 
+  // 2a. MIGRAZIONE DI CANALE: flooding verso tutta la mesh
+  if (h->type == PKT_MIGRATE) {
+    this->handle_migrate(h, data, len);
+    return;
+  }
+
+  // 2b. GRUPPI: consegna ai membri, rilancio solo verso i sottoalberi con membri
+  if (h->dst[0] == MESH_GROUP_PREFIX) {
+    this->handle_group(mac, h, data, len);
+    return;
+  }
+
   // 3. ROUTING DECISION
   bool is_virtual_root = true;
   for (int i = 0; i < 6; i++) {
@@ -208,41 +715,114 @@ void EspMesh::on_packet(const uint8_t *mac, const uint8_t *data, int len, int8_t
   if (is_for_me || is_bcast) {
 // PROCESS PAYLOAD
 #ifdef IS_ROOT
-    if (h->type == PKT_REG) {
-      this->handle_reg(h->src, reinterpret_cast<const RegPayload *>(data + sizeof(MeshHeader)));
-    } else if (h->type == PKT_DATA) {
-      this->handle_data(h->src, data + sizeof(MeshHeader));
+    // Qualsiasi frame del nodo ne prova la vita, senza heartbeat periodici
+    this->mark_alive(h->src);
+    // Frame affidabile: confermiamo sempre, consegniamo una volta sola
+    if ((h->flags & MESH_FLAG_ACK_REQ) && !this->ack_reliable(h))
+      return;
+    if (h->type == PKT_FRAG) {
+      this->handle_frag(h, data + sizeof(MeshHeader), len - sizeof(MeshHeader));
+    } else if (h->type == PKT_AGG) {
+      this->handle_agg(mac, h, data + sizeof(MeshHeader), len - sizeof(MeshHeader));
+    } else {
+      this->deliver(h, h->type, data + sizeof(MeshHeader), len - sizeof(MeshHeader));
+    }
+#endif
+#ifdef IS_NODE
+    if (h->type == PKT_FRAG_NACK && len >= (int) (sizeof(MeshHeader) + sizeof(FragNack))) {
+      this->handle_frag_nack(reinterpret_cast<const FragNack *>(data + sizeof(MeshHeader)));
+    } else if (h->type == PKT_ACK && len >= (int) (sizeof(MeshHeader) + sizeof(AckPayload))) {
+      this->handle_ack(reinterpret_cast<const AckPayload *>(data + sizeof(MeshHeader)));
+    } else if (h->type == PKT_REG_ACK && is_for_me && len >= (int) (sizeof(MeshHeader) + sizeof(RegAck))) {
+      RegAck a;
+      memcpy(&a, data + sizeof(MeshHeader), sizeof(a));
+      this->handle_reg_ack(&a);
+    } else if (h->type == PKT_GROUP_SET && is_for_me && len >= (int) (sizeof(MeshHeader) + sizeof(GroupSet))) {
+      GroupSet g;
+      memcpy(&g, data + sizeof(MeshHeader), sizeof(g));
+      this->groups_ = g.groups;
+      this->groups_dirty_ = true;  // Salvato dal loop principale
+      ESP_LOGI(TAG, "Groups assigned by root: 0x%08X", g.groups);
+    } else if (h->type == PKT_CMD && is_for_me) {
+      // Comando per una sola entità (topic della discovery): firmato dal Root
+      int plen = len - sizeof(MeshHeader);
+      if (this->auth_check(this->group_auth_, h, data + sizeof(MeshHeader), plen) &&
+          plen >= (int) sizeof(CmdPayload)) {
+        CmdPayload c;
+        memcpy(&c, data + sizeof(MeshHeader), sizeof(c));
+        LockGuard guard(this->cmd_lock_);
+        this->pending_cmds_.push_back(c);
+      }
+    } else if (h->type == PKT_PING && is_for_me) {
+      this->send_to_root(PKT_PONG, nullptr, 0, PRIO_CONTROL);
+    } else if (h->type == PKT_DICT_MISS && is_for_me && len >= (int) (sizeof(MeshHeader) + sizeof(DictMiss))) {
+      this->handle_dict_miss(reinterpret_cast<const DictMiss *>(data + sizeof(MeshHeader)));
+    } else if (h->type == PKT_OTA_OFFER && is_for_me && len >= (int) (sizeof(MeshHeader) + sizeof(OtaOffer))) {
+      this->handle_ota_offer(reinterpret_cast<const OtaOffer *>(data + sizeof(MeshHeader)));
+    } else if (h->type == PKT_OTA_DATA) {
+      this->handle_ota_data(h, data + sizeof(MeshHeader), len - sizeof(MeshHeader));
     }
 #endif
   }
 
   // FORWARDING
   if (!is_for_me && !is_bcast && h->ttl > 0) {
-    uint8_t buf[250];
-    if (len > 250) return; 
+    uint8_t buf[MESH_MAX_FRAME];
+    if (len > MESH_MAX_FRAME)
+      return;
     memcpy(buf, data, len);
+    this->prof_bytes(PROF_ON_PACKET, len);
     
     auto *mutable_h = reinterpret_cast<MeshHeader *>(buf);
     mutable_h->ttl--;
+
+#ifdef IS_NODE
+    // Repeater: i blocchi OTA di passaggio restano in cache, e le richieste
+    // del sottoalbero si servono da qui quando possibile
+    if (h->type == PKT_OTA_DATA && len > (int) (sizeof(MeshHeader) + sizeof(OtaData))) {
+      OtaData d;
+      memcpy(&d, buf + sizeof(MeshHeader), sizeof(d));
+      this->ota_cache_put(d.session, d.block, buf + sizeof(MeshHeader) + sizeof(d),
+                          len - sizeof(MeshHeader) - sizeof(d));
+    } else if (h->type == PKT_OTA_REQ && len >= (int) (sizeof(MeshHeader) + sizeof(OtaReq))) {
+      OtaReq r;
+      memcpy(&r, buf + sizeof(MeshHeader), sizeof(r));
+      if (!this->ota_serve_cached(h, &r))
+        return;
+      memcpy(buf + sizeof(MeshHeader), &r, sizeof(r));
+    }
+
+    // Dati dei figli verso il Root: uniti in un solo frame per il parent
+    if (this->agg_hold_ms_ && is_virtual_root &&
+        this->aggregate(mac, mutable_h, buf + sizeof(MeshHeader), len - sizeof(MeshHeader)))
+      return;
+#endif
     
     this->route_packet(mutable_h, buf + sizeof(MeshHeader), len - sizeof(MeshHeader));
   }
 }
 
 void EspMesh::route_packet(MeshHeader *h, const uint8_t *payload, int len) {
+  ProfScope prof(this->prof(PROF_ROUTE));
   uint8_t next_hop[6];
 
-  if (h->dst[0] == 0xFF) {
+  if (h->dst[0] == 0xFF || h->dst[0] == MESH_GROUP_PREFIX) {
     memset(next_hop, 0xFF, 6);
   } else {
     std::string dst_s(reinterpret_cast<const char *>(h->dst), 6);
-    if (this->routes_.count(dst_s)) {
-      memcpy(next_hop, this->routes_[dst_s].next_hop, 6);
-    } else {
+    bool found;
+    {
+      LockGuard guard(this->route_lock_);
+      auto it = this->routes_.find(dst_s);
+      found = it != this->routes_.end();
+      if (found)
+        memcpy(next_hop, it->second.next_hop, 6);
+    }
+    if (!found) {
 // Upstream
 #ifdef IS_NODE
       if (this->hop_count_ != 0xFF) {
-        memcpy(next_hop, this->parent_mac_, 6);
+        this->pick_upstream(h, payload, len, next_hop);
       } else {
         return;
       }
@@ -252,948 +832,4172 @@ void EspMesh::route_packet(MeshHeader *h, const uint8_t *payload, int len) {
     }
   }
 
-  uint8_t buf[250];
-  if (sizeof(MeshHeader) + len > 250)
+  uint8_t buf[MESH_MAX_FRAME];
+  if (len > (int) MESH_MAX_PAYLOAD)
     return;
 
   memcpy(buf, h, sizeof(MeshHeader));
   memcpy(buf + sizeof(MeshHeader), payload, len);
+  this->prof_bytes(PROF_ROUTE, sizeof(MeshHeader) + len);
 
-  this->send_raw(next_hop, buf, sizeof(MeshHeader) + len);
+  this->enqueue_tx(next_hop, buf, sizeof(MeshHeader) + len);
 }
 
-// --- PEER MANAGEMENT ---
-void EspMesh::ensure_peer_slot(const uint8_t *mac) {
-  if (esp_now_is_peer_exist(mac)) {
-    std::string s(reinterpret_cast<const char *>(mac), 6);
-    this->peer_lru_.remove(s);
-    this->peer_lru_.push_back(s);
-    return;
+// --- ROTTE ---
+// Il refresh tocca solo last_seen (O(1)); alla scadenza dello slot la voce
+// si rimette in coda per il tempo residuo, oppure se ne va.
+void EspMesh::learn_route(const uint8_t *dst, const uint8_t *next_hop) {
+  std::string key(reinterpret_cast<const char *>(dst), 6);
+  LockGuard guard(this->route_lock_);
+  auto it = this->routes_.find(key);
+  if (it == this->routes_.end()) {
+    it = this->routes_.emplace(key, RouteInfo{}).first;
+    this->schedule_route(key, it->second, this->route_timeout_);
   }
+  memcpy(it->second.next_hop, next_hop, 6);
+  it->second.last_seen = millis();
+}
 
-  if (this->peer_lru_.size() >= MAX_PEERS) {
-    std::string victim_s = this->peer_lru_.front();
-#ifdef IS_NODE
-    if (this->hop_count_ != 0xFF && memcmp(victim_s.c_str(), this->parent_mac_, 6) == 0) {
-      if (this->peer_lru_.size() > 1) {
-        auto it = this->peer_lru_.begin();
-        it++;
-        victim_s = *it;
-      } else {
-        return;
-      }
+// --- AUTENTICAZIONE DEI FRAME IN BROADCAST ---
+// HMAC-SHA256 con la PMK su header, payload e contatore. next_hop e ttl
+// cambiano a ogni rilancio e restano fuori dal calcolo.
+void EspMesh::auth_tag(const MeshHeader *h, const uint8_t *payload, size_t len, uint32_t counter, uint8_t *tag) {
+  MeshHeader c = *h;
+  memset(c.next_hop, 0, 6);
+  c.ttl = 0;
+  uint8_t pad[64], digest[32];
+  mbedtls_sha256_context sha;
+  for (int pass = 0; pass < 2; pass++) {
+    memset(pad, pass == 0 ? 0x36 : 0x5C, sizeof(pad));
+    for (size_t i = 0; i < this->pmk_.size() && i < sizeof(pad); i++)
+      pad[i] ^= this->pmk_[i];
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    mbedtls_sha256_update(&sha, pad, sizeof(pad));
+    if (pass == 0) {
+      mbedtls_sha256_update(&sha, reinterpret_cast<const uint8_t *>(&c), sizeof(c));
+      mbedtls_sha256_update(&sha, payload, len);
+      mbedtls_sha256_update(&sha, reinterpret_cast<const uint8_t *>(&counter), sizeof(counter));
+    } else {
+      mbedtls_sha256_update(&sha, digest, sizeof(digest));
     }
-#endif
-
-    esp_now_del_peer(reinterpret_cast<const uint8_t *>(victim_s.c_str()));
-    this->peer_lru_.remove(victim_s);
-    ESP_LOGD(TAG, "Evicted peer to make space");
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
   }
+  memcpy(tag, digest, AUTH_TAG_LEN);
+}
 
-  esp_now_peer_info_t pi = {};
-  memcpy(pi.peer_addr, mac, 6);
-  pi.channel = (this->hop_count_ == 0xFF) ? this->current_scan_ch_ : 0;
-  pi.encrypt = true;
-  this->derive_lmk(mac, pi.lmk);
+// Aggiunge contatore e tag in coda al payload; header già definitivo
+void EspMesh::auth_sign(const MeshHeader &h, std::vector<uint8_t> &payload) {
+  AuthTrailer t;
+  {
+    LockGuard guard(this->auth_lock_);
+    t.counter = this->auth_counter_++;
+    // Blocco successivo con largo anticipo: il salvataggio avviene nel loop
+    if (this->auth_reserved_ - this->auth_counter_ < AUTH_BLOCK / 2) {
+      this->auth_reserved_ += AUTH_BLOCK;
+      this->auth_reserve_dirty_ = true;
+    }
+  }
+  this->auth_tag(&h, payload.data(), payload.size(), t.counter, t.tag);
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(&t);
+  payload.insert(payload.end(), p, p + sizeof(t));
+}
 
-  if (esp_now_add_peer(&pi) == ESP_OK) {
-    this->peer_lru_.push_back(std::string(reinterpret_cast<const char *>(mac), 6));
+// Loop principale: riserva dei contatori e finestre anti-replay in NVS
+void EspMesh::save_auth(bool force) {
+  bool reserve;
+  uint32_t reserved;
+  {
+    LockGuard guard(this->auth_lock_);
+    reserve = this->auth_reserve_dirty_;
+    this->auth_reserve_dirty_ = false;
+    reserved = this->auth_reserved_;
   }
+  if (reserve)
+    this->auth_pref_.save(&reserved);
+#ifdef IS_NODE
+  this->save_auth_table(this->group_auth_, force);
+  this->save_auth_table(this->migrate_auth_, force);
+#endif
 }
 
-void EspMesh::send_raw(const uint8_t *next_hop, const uint8_t *data, int len) {
-  bool is_bcast = (next_hop[0] == 0xFF);
+#ifdef IS_NODE
+// Frame autenticato: tag valido e contatore mai accettato dalla sorgente.
+// Replay e copie del flooding si scartano qui; len perde il trailer.
+bool EspMesh::auth_check(AuthTable &t, const MeshHeader *h, const uint8_t *payload, int &len) {
+  if (len < (int) sizeof(AuthTrailer))
+    return false;
+  AuthTrailer a;
+  memcpy(&a, payload + len - sizeof(a), sizeof(a));
+  uint8_t tag[AUTH_TAG_LEN];
+  this->auth_tag(h, payload, len - sizeof(a), a.counter, tag);
+  uint8_t diff = 0;
+  for (int i = 0; i < AUTH_TAG_LEN; i++)
+    diff |= tag[i] ^ a.tag[i];
+  if (diff != 0) {
+    this->stats_.auth_rejected++;
+    return false;
+  }
 
-  if (!is_bcast) {
-    this->ensure_peer_slot(next_hop);
+  LockGuard guard(this->auth_lock_);
+  AuthSource *src = nullptr;
+  AuthSource *victim = &t.src[0];
+  for (auto &e : t.src) {
+    if (e.seen != 0 && memcmp(e.mac, h->src, 6) == 0) {
+      src = &e;
+      break;
+    }
+    if (victim->seen != 0 && (e.seen == 0 || e.used < victim->used))
+      victim = &e;
+  }
+  if (src == nullptr) {
+    // Sorgente nuova: slot libero o, a tabella piena, la meno recente
+    src = victim;
+    memcpy(src->mac, h->src, 6);
+    src->last = a.counter;
+    src->seen = 1;
   } else {
-    if (!esp_now_is_peer_exist(next_hop)) {
-      esp_now_peer_info_t pi = {};
-      memcpy(pi.peer_addr, next_hop, 6);
-      pi.encrypt = false;
-      esp_now_add_peer(&pi);
+    int32_t d = static_cast<int32_t>(a.counter - src->last);
+    if (d > 0) {
+      src->seen = d < AUTH_WINDOW ? (src->seen << d) | 1 : 1;
+      src->last = a.counter;
+    } else if (static_cast<uint32_t>(-d) >= AUTH_WINDOW || (src->seen & (1u << -d))) {
+      return false;
+    } else {
+      src->seen |= 1u << -d;
     }
   }
+  src->used = millis();
+  t.dirty = true;
+  len -= sizeof(a);
+  return true;
+}
 
-  esp_now_send(next_hop, data, len);
+void EspMesh::restore_auth(AuthTable &t, const char *key) {
+  AuthTableRecord r;
+  t.pref = global_preferences->make_preference<AuthTableRecord>(fnv1_hash(key), true);
+  if (!t.pref.load(&r))
+    return;
+  static const uint8_t none[6] = {0};
+  for (int i = 0; i < AUTH_SOURCES; i++) {
+    if (memcmp(r.mac[i], none, 6) == 0)
+      continue;
+    memcpy(t.src[i].mac, r.mac[i], 6);
+    t.src[i].last = r.last[i];
+    t.src[i].seen = UINT32_MAX;  // Dopo un riavvio valgono solo contatori più recenti
+  }
 }
 
-void EspMesh::derive_lmk(const uint8_t *mac, uint8_t *lmk) {
-  for (int i = 0; i < 16; i++) {
-    lmk[i] = this->pmk_[i] ^ mac[i % 6];
+// Ogni comando accettato sposta la finestra: in NVS al massimo ogni
+// AUTH_SAVE_MS, salvo riavvio pianificato
+void EspMesh::save_auth_table(AuthTable &t, bool force) {
+  AuthTableRecord r{};
+  uint32_t now = millis();
+  {
+    LockGuard guard(this->auth_lock_);
+    if (!t.dirty || (!force && now - t.last_save < AUTH_SAVE_MS))
+      return;
+    t.dirty = false;
+    t.last_save = now;
+    for (int i = 0; i < AUTH_SOURCES; i++) {
+      if (t.src[i].seen == 0)
+        continue;
+      memcpy(r.mac[i], t.src[i].mac, 6);
+      r.last[i] = t.src[i].last;
+    }
   }
+  t.pref.save(&r);
 }
+#endif
 
+// Lungo l'albero un frame di gruppo si accetta solo dal proprio parent, così
+// ogni nodo lo riceve una volta e lo rilancia (in broadcast, un solo frame
+// per livello) solo se un figlio ha membri. Con MESH_FLAG_FLOOD rilancia
+// chiunque. In entrambi i casi il comando deve portare la firma del Root:
+// firme non valide, replay e duplicati del flooding non vengono né eseguiti
+// né rilanciati.
+void EspMesh::handle_group(const uint8_t *mac, const MeshHeader *h, const uint8_t *data, int len) {
 #ifdef IS_NODE
-void EspMesh::setup_bare_metal() {
-  nvs_flash_init();
-  esp_netif_init();
-  esp_event_loop_create_default();
-  wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-  esp_wifi_init(&cfg);
-  esp_wifi_set_mode(WIFI_MODE_STA);
-  esp_wifi_set_channel(this->current_scan_ch_, WIFI_SECOND_CHAN_NONE);
-  esp_wifi_start();
-  esp_wifi_set_ps(WIFI_PS_NONE);
-  esp_wifi_get_mac(WIFI_IF_STA, this->my_mac_);
-}
+  uint8_t g = h->dst[5];
+  if (g == 0 || g > MESH_GROUPS)
+    return;
+  bool flood = h->flags & MESH_FLAG_FLOOD;
+  if (!flood && (this->hop_count_ == 0xFF || memcmp(mac, this->parent_mac_, 6) != 0))
+    return;
+  int plen = len - sizeof(MeshHeader);
+  if (!this->auth_check(this->group_auth_, h, data + sizeof(MeshHeader), plen))
+    return;
 
-void EspMesh::send_probe() {
-  uint8_t bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
-  MeshHeader h;
-  h.type = PKT_PROBE;
-  h.net_id = this->net_id_hash_;
-  h.ttl = 1;
-  memcpy(h.src, this->my_mac_, 6);
-  memcpy(h.dst, bcast, 6);
-  this->send_raw(bcast, reinterpret_cast<uint8_t *>(&h), sizeof(h));
+  uint32_t bit = 1u << (g - 1);
+  if ((this->groups_ & bit) && h->type == PKT_CMD && plen >= (int) sizeof(CmdPayload)) {
+    CmdPayload c;
+    memcpy(&c, data + sizeof(MeshHeader), sizeof(c));
+    LockGuard guard(this->cmd_lock_);
+    this->pending_cmds_.push_back(c);
+  }
+
+  if (h->ttl > 1 && (flood || (this->children_groups() & bit)) && len <= MESH_MAX_FRAME) {
+    uint8_t buf[MESH_MAX_FRAME];
+    memcpy(buf, data, len);
+    auto *fwd = reinterpret_cast<MeshHeader *>(buf);
+    fwd->ttl--;
+    this->route_packet(fwd, buf + sizeof(MeshHeader), len - sizeof(MeshHeader));
+  }
+#endif
 }
-void EspMesh::scan_local_entities() {
-  uint8_t root_dst[6] = {0};
 
-  // --- SCANSIONE E REGISTRAZIONE ENTITÀ LOCALI ---
-  // Itera su tutte le entità registrate nel componente
-  for (auto obj : this->get_local_entities()) {
-    switch(obj.type) {
-
-      // ========== BINARY_SENSOR ==========
-      #ifdef USE_BINARY_SENSOR
-      case ENTITY_TYPE_BINARY_SENSOR: {
-        auto *bs = static_cast<binary_sensor::BinarySensor *>(obj.entity);
-        if (bs != nullptr) {
-          // 1. Registrazione entità al Root
-          RegPayload p;
-          p.entity_hash = bs->get_object_id_hash();
-          p.type_id = 'B';
-          strncpy(p.name, bs->get_name().c_str(), 23);
-          p.name[23] = '\0';
-          strncpy(p.dev_class, bs->get_device_class_ref().c_str(), 15);
-          p.dev_class[15] = '\0';
-          memset(p.unit, 0, 8);
-
-          MeshHeader h;
-          h.type = PKT_REG;
-          h.net_id = this->net_id_hash_;
-          h.ttl = 10;
-          memcpy(h.src, this->my_mac_, 6);
-          memcpy(h.dst, root_dst, 6);
-
-          this->route_packet(&h, reinterpret_cast<uint8_t *>(&p), sizeof(p));
-          delay(50);
-
-          // 2. Registrazione callback per trasmissione dati
-          bs->add_on_state_callback([this, bs](bool state) {
-            MeshHeader dh;
-            dh.type = PKT_DATA;
-            dh.net_id = this->net_id_hash_;
-            dh.ttl = 10;
-            memcpy(dh.src, this->my_mac_, 6);
-            memset(dh.dst, 0, 6);
-
-            uint8_t pl[5];
-            uint32_t hash = bs->get_object_id_hash();
-            memcpy(pl, &hash, 4);
-            pl[4] = state ? 1 : 0;
-
-            this->route_packet(&dh, pl, 5);
-          });
-        }
-        break;
-      }
-      #endif
-
-      // ========== SENSOR ==========
-      #ifdef USE_SENSOR
-      case ENTITY_TYPE_SENSOR: {
-        auto *s = static_cast<sensor::Sensor *>(obj.entity);
-        if (s != nullptr) {
-          RegPayload p;
-          p.entity_hash = s->get_object_id_hash();
-          p.type_id = 'S';
-          strncpy(p.name, s->get_name().c_str(), 23);
-          p.name[23] = '\0';
-          strncpy(p.unit, s->get_unit_of_measurement_ref().c_str(), 7);
-          p.unit[7] = '\0';
-          strncpy(p.dev_class, s->get_device_class_ref().c_str(), 15);
-          p.dev_class[15] = '\0';
-
-          MeshHeader h;
-          h.type = PKT_REG;
-          h.net_id = this->net_id_hash_;
-          h.ttl = 10;
-          memcpy(h.src, this->my_mac_, 6);
-          memcpy(h.dst, root_dst, 6);
-
-          this->route_packet(&h, reinterpret_cast<uint8_t *>(&p), sizeof(p));
-          delay(50);
-
-          s->add_on_state_callback([this, s](float val) {
-            MeshHeader dh;
-            dh.type = PKT_DATA;
-            dh.net_id = this->net_id_hash_;
-            dh.ttl = 10;
-            memcpy(dh.src, this->my_mac_, 6);
-            memset(dh.dst, 0, 6);
-
-            uint8_t pl[8];
-            uint32_t hash = s->get_object_id_hash();
-            memcpy(pl, &hash, 4);
-            memcpy(pl + 4, &val, 4);
-
-            this->route_packet(&dh, pl, 8);
-          });
-        }
-        break;
-      }
-      #endif
-
-      // ========== SWITCH ==========
-      #ifdef USE_SWITCH
-      case ENTITY_TYPE_SWITCH: {
-        auto *sw = static_cast<switch_::Switch *>(obj.entity);
-        if (sw != nullptr) {
-          RegPayload p;
-          p.entity_hash = sw->get_object_id_hash();
-          p.type_id = 'W';
-          strncpy(p.name, sw->get_name().c_str(), 23);
-          p.name[23] = '\0';
-          memset(p.unit, 0, 8);
-          memset(p.dev_class, 0, 16);
-
-          MeshHeader h;
-          h.type = PKT_REG;
-          h.net_id = this->net_id_hash_;
-          h.ttl = 10;
-          memcpy(h.src, this->my_mac_, 6);
-          memcpy(h.dst, root_dst, 6);
-
-          this->route_packet(&h, reinterpret_cast<uint8_t *>(&p), sizeof(p));
-          delay(50);
-
-          sw->add_on_state_callback([this, sw](bool state) {
-            MeshHeader dh;
-            dh.type = PKT_DATA;
-            dh.net_id = this->net_id_hash_;
-            dh.ttl = 10;
-            memcpy(dh.src, this->my_mac_, 6);
-            memset(dh.dst, 0, 6);
-
-            uint8_t pl[5];
-            uint32_t hash = sw->get_object_id_hash();
-            memcpy(pl, &hash, 4);
-            pl[4] = state ? 1 : 0;
-
-            this->route_packet(&dh, pl, 5);
-          });
-        }
-        break;
-      }
-      #endif
-
-      // ========== BUTTON ==========
-      #ifdef USE_BUTTON
-      case ENTITY_TYPE_BUTTON: {
-        auto *btn = static_cast<button::Button *>(obj.entity);
-        if (btn != nullptr) {
-          RegPayload p;
-          p.entity_hash = btn->get_object_id_hash();
-          p.type_id = 'N';
-          strncpy(p.name, btn->get_name().c_str(), 23);
-          p.name[23] = '\0';
-          memset(p.unit, 0, 8);
-          memset(p.dev_class, 0, 16);
-
-          MeshHeader h;
-          h.type = PKT_REG;
-          h.net_id = this->net_id_hash_;
-          h.ttl = 10;
-          memcpy(h.src, this->my_mac_, 6);
-          memcpy(h.dst, root_dst, 6);
-
-          this->route_packet(&h, reinterpret_cast<uint8_t *>(&p), sizeof(p));
-          delay(50);
-
-          btn->add_on_press_callback([this, btn]() {
-            MeshHeader dh;
-            dh.type = PKT_DATA;
-            dh.net_id = this->net_id_hash_;
-            dh.ttl = 10;
-            memcpy(dh.src, this->my_mac_, 6);
-            memset(dh.dst, 0, 6);
-
-            uint8_t pl[4];
-            uint32_t hash = btn->get_object_id_hash();
-            memcpy(pl, &hash, 4);
-
-            this->route_packet(&dh, pl, 4);
-          });
-        }
-        break;
-      }
-      #endif
-
-      // ========== TEXT_SENSOR ==========
-      #ifdef USE_TEXT_SENSOR
-      case ENTITY_TYPE_TEXT_SENSOR: {
-        auto *ts = static_cast<text_sensor::TextSensor *>(obj.entity);
-        if (ts != nullptr) {
-          RegPayload p;
-          p.entity_hash = ts->get_object_id_hash();
-          p.type_id = 'T';
-          strncpy(p.name, ts->get_name().c_str(), 23);
-          p.name[23] = '\0';
-          strncpy(p.dev_class, ts->get_device_class_ref().c_str(), 15);
-          p.dev_class[15] = '\0';
-          memset(p.unit, 0, 8);
-
-          MeshHeader h;
-          h.type = PKT_REG;
-          h.net_id = this->net_id_hash_;
-          h.ttl = 10;
-          memcpy(h.src, this->my_mac_, 6);
-          memcpy(h.dst, root_dst, 6);
-
-          this->route_packet(&h, reinterpret_cast<uint8_t *>(&p), sizeof(p));
-          delay(50);
-
-          ts->add_on_state_callback([this, ts](const std::string &state) {
-            MeshHeader dh;
-            dh.type = PKT_DATA;
-            dh.net_id = this->net_id_hash_;
-            dh.ttl = 10;
-            memcpy(dh.src, this->my_mac_, 6);
-            memset(dh.dst, 0, 6);
-
-            size_t state_len = std::min(state.length(), size_t(24));
-            uint8_t pl[28];
-            uint32_t hash = ts->get_object_id_hash();
-            memcpy(pl, &hash, 4);
-            memcpy(pl + 4, state.c_str(), state_len);
-            memset(pl + 4 + state_len, 0, 24 - state_len);
-
-            this->route_packet(&dh, pl, 28);
-          });
-        }
-        break;
-      }
-      #endif
-
-      // ========== FAN ==========
-      #ifdef USE_FAN
-      case ENTITY_TYPE_FAN: {
-        auto *f = static_cast<fan::Fan *>(obj.entity);
-        if (f != nullptr) {
-          RegPayload p;
-          p.entity_hash = f->get_object_id_hash();
-          p.type_id = 'F';
-          strncpy(p.name, f->get_name().c_str(), 23);
-          p.name[23] = '\0';
-          memset(p.unit, 0, 8);
-          memset(p.dev_class, 0, 16);
-
-          MeshHeader h;
-          h.type = PKT_REG;
-          h.net_id = this->net_id_hash_;
-          h.ttl = 10;
-          memcpy(h.src, this->my_mac_, 6);
-          memcpy(h.dst, root_dst, 6);
-
-          this->route_packet(&h, reinterpret_cast<uint8_t *>(&p), sizeof(p));
-          delay(50);
-
-          // Fan: invia stato (0=off, 1-speed levels)
-          f->add_on_state_callback([this, f]() {
-            MeshHeader dh;
-            dh.type = PKT_DATA;
-            dh.net_id = this->net_id_hash_;
-            dh.ttl = 10;
-            memcpy(dh.src, this->my_mac_, 6);
-            memset(dh.dst, 0, 6);
-
-            uint8_t pl[6];
-            uint32_t hash = f->get_object_id_hash();
-            memcpy(pl, &hash, 4);
-            pl[4] = f->state ? 1 : 0;
-            pl[5] = static_cast<uint8_t>(f->speed * 255.0f);
-
-            this->route_packet(&dh, pl, 6);
-          });
-        }
-        break;
-      }
-      #endif
-
-      // ========== COVER (Tenda/Tapparella) ==========
-      #ifdef USE_COVER
-      case ENTITY_TYPE_COVER: {
-        auto *c = static_cast<cover::Cover *>(obj.entity);
-        if (c != nullptr) {
-          RegPayload p;
-          p.entity_hash = c->get_object_id_hash();
-          p.type_id = 'C';
-          strncpy(p.name, c->get_name().c_str(), 23);
-          p.name[23] = '\0';
-          strncpy(p.unit, "%", 7);
-          p.unit[7] = '\0';
-          memset(p.dev_class, 0, 16);
-
-          MeshHeader h;
-          h.type = PKT_REG;
-          h.net_id = this->net_id_hash_;
-          h.ttl = 10;
-          memcpy(h.src, this->my_mac_, 6);
-          memcpy(h.dst, root_dst, 6);
-
-          this->route_packet(&h, reinterpret_cast<uint8_t *>(&p), sizeof(p));
-          delay(50);
-
-          // Cover: posizione 0-100%
-          c->add_on_state_callback([this, c]() {
-            MeshHeader dh;
-            dh.type = PKT_DATA;
-            dh.net_id = this->net_id_hash_;
-            dh.ttl = 10;
-            memcpy(dh.src, this->my_mac_, 6);
-            memset(dh.dst, 0, 6);
-
-            uint8_t pl[8];
-            uint32_t hash = c->get_object_id_hash();
-            memcpy(pl, &hash, 4);
-            float position = c->position;
-            memcpy(pl + 4, &position, 4);
-
-            this->route_packet(&dh, pl, 8);
-          });
-        }
-        break;
-      }
-      #endif
-
-      // ========== LIGHT (Luce) ==========
-      #ifdef USE_LIGHT
-      case ENTITY_TYPE_LIGHT: {
-        auto *light = static_cast<light::LightState *>(obj.entity);
-        if (light != nullptr) {
-          RegPayload p;
-          p.entity_hash = light->get_object_id_hash();
-          p.type_id = 'L';
-          strncpy(p.name, light->get_name().c_str(), 23);
-          p.name[23] = '\0';
-          memset(p.unit, 0, 8);
-          memset(p.dev_class, 0, 16);
-
-          MeshHeader h;
-          h.type = PKT_REG;
-          h.net_id = this->net_id_hash_;
-          h.ttl = 10;
-          memcpy(h.src, this->my_mac_, 6);
-          memcpy(h.dst, root_dst, 6);
-
-          this->route_packet(&h, reinterpret_cast<uint8_t *>(&p), sizeof(p));
-          delay(50);
-
-          // Light: stato on/off + brightness (0-255)
-          light->add_new_target_state_reached_callback([this, light]() {
-            MeshHeader dh;
-            dh.type = PKT_DATA;
-            dh.net_id = this->net_id_hash_;
-            dh.ttl = 10;
-            memcpy(dh.src, this->my_mac_, 6);
-            memset(dh.dst, 0, 6);
-
-            uint8_t pl[6];
-            uint32_t hash = light->get_object_id_hash();
-            memcpy(pl, &hash, 4);
-            pl[4] = light->remote_values.is_on() ? 1 : 0;
-            pl[5] = static_cast<uint8_t>(light->remote_values.get_brightness() * 255.0f);
-
-            this->route_packet(&dh, pl, 6);
-          });
-        }
-        break;
-      }
-      #endif
-
-      // ========== CLIMATE (Termostato) ==========
-      #ifdef USE_CLIMATE
-      case ENTITY_TYPE_CLIMATE: {
-        auto *clim = static_cast<climate::Climate *>(obj.entity);
-        if (clim != nullptr) {
-          RegPayload p;
-          p.entity_hash = clim->get_object_id_hash();
-          p.type_id = 'K';
-          strncpy(p.name, clim->get_name().c_str(), 23);
-          p.name[23] = '\0';
-          strncpy(p.unit, "°C", 7);
-          p.unit[7] = '\0';
-          memset(p.dev_class, 0, 16);
-
-          MeshHeader h;
-          h.type = PKT_REG;
-          h.net_id = this->net_id_hash_;
-          h.ttl = 10;
-          memcpy(h.src, this->my_mac_, 6);
-          memcpy(h.dst, root_dst, 6);
-
-          this->route_packet(&h, reinterpret_cast<uint8_t *>(&p), sizeof(p));
-          delay(50);
-
-          // Climate: temperatura target + modalità
-          clim->add_on_state_callback([this, clim](climate::Climate &) {
-            MeshHeader dh;
-            dh.type = PKT_DATA;
-            dh.net_id = this->net_id_hash_;
-            dh.ttl = 10;
-            memcpy(dh.src, this->my_mac_, 6);
-            memset(dh.dst, 0, 6);
-            
-            uint8_t pl[6];
-            uint32_t hash = clim->get_object_id_hash();
-            memcpy(pl, &hash, 4);
-            pl[4] = static_cast<uint8_t>(clim->target_temperature);
-            pl[5] = static_cast<uint8_t>(clim->mode);
-            
-            this->route_packet(&dh, pl, 6);
-          });
-        }
-        break;
-      }
-      #endif
-
-      // ========== NUMBER (Numero) ==========
-      #ifdef USE_NUMBER
-      case ENTITY_TYPE_NUMBER: {
-        auto *num = static_cast<number::Number *>(obj.entity);
-        if (num != nullptr) {
-          RegPayload p;
-          p.entity_hash = num->get_object_id_hash();
-          p.type_id = 'U';
-          strncpy(p.name, num->get_name().c_str(), 23);
-          p.name[23] = '\0';
-          p.unit[0] = '\0';
-          memset(p.dev_class, 0, 16);
-
-          MeshHeader h;
-          h.type = PKT_REG;
-          h.net_id = this->net_id_hash_;
-          h.ttl = 10;
-          memcpy(h.src, this->my_mac_, 6);
-          memcpy(h.dst, root_dst, 6);
-
-          this->route_packet(&h, reinterpret_cast<uint8_t *>(&p), sizeof(p));
-          delay(50);
-
-          num->add_on_state_callback([this, num](float val) {
-            MeshHeader dh;
-            dh.type = PKT_DATA;
-            dh.net_id = this->net_id_hash_;
-            dh.ttl = 10;
-            memcpy(dh.src, this->my_mac_, 6);
-            memset(dh.dst, 0, 6);
-
-            uint8_t pl[8];
-            uint32_t hash = num->get_object_id_hash();
-            memcpy(pl, &hash, 4);
-            memcpy(pl + 4, &val, 4);
-
-            this->route_packet(&dh, pl, 8);
-          });
-        }
-        break;
-      }
-      #endif
-
-      // ========== SELECT (Selezione) ==========
-      #ifdef USE_SELECT
-      case ENTITY_TYPE_SELECT: {
-        auto *sel = static_cast<select::Select *>(obj.entity);
-        if (sel != nullptr) {
-          RegPayload p;
-          p.entity_hash = sel->get_object_id_hash();
-          p.type_id = 'E';
-          strncpy(p.name, sel->get_name().c_str(), 23);
-          p.name[23] = '\0';
-          memset(p.unit, 0, 8);
-          memset(p.dev_class, 0, 16);
-
-          MeshHeader h;
-          h.type = PKT_REG;
-          h.net_id = this->net_id_hash_;
-          h.ttl = 10;
-          memcpy(h.src, this->my_mac_, 6);
-          memcpy(h.dst, root_dst, 6);
-
-          this->route_packet(&h, reinterpret_cast<uint8_t *>(&p), sizeof(p));
-          delay(50);
-
-          sel->add_on_state_callback([this, sel](const std::string &state, size_t index) {
-            MeshHeader dh;
-            dh.type = PKT_DATA;
-            dh.net_id = this->net_id_hash_;
-            dh.ttl = 10;
-            memcpy(dh.src, this->my_mac_, 6);
-            memset(dh.dst, 0, 6);
-            
-            size_t state_len = std::min(state.length(), size_t(24));
-            uint8_t pl[28];
-            uint32_t hash = sel->get_object_id_hash();
-            memcpy(pl, &hash, 4);
-            memcpy(pl + 4, state.c_str(), state_len);
-            memset(pl + 4 + state_len, 0, 24 - state_len);
-            
-            this->route_packet(&dh, pl, 28);
-          });
-        }
-        break;
-      }
-      #endif
-
-      // ========== LOCK (Serratura) ==========
-      #ifdef USE_LOCK
-      case ENTITY_TYPE_LOCK: {
-        auto *lock = static_cast<lock::Lock *>(obj.entity);
-        if (lock != nullptr) {
-          RegPayload p;
-          p.entity_hash = lock->get_object_id_hash();
-          p.type_id = 'O';
-          strncpy(p.name, lock->get_name().c_str(), 23);
-          p.name[23] = '\0';
-          memset(p.unit, 0, 8);
-          memset(p.dev_class, 0, 16);
-
-          MeshHeader h;
-          h.type = PKT_REG;
-          h.net_id = this->net_id_hash_;
-          h.ttl = 10;
-          memcpy(h.src, this->my_mac_, 6);
-          memcpy(h.dst, root_dst, 6);
-
-          this->route_packet(&h, reinterpret_cast<uint8_t *>(&p), sizeof(p));
-          delay(50);
-
-          // Lock: locked/unlocked state
-          lock->add_on_state_callback([this, lock]() {
-            MeshHeader dh;
-            dh.type = PKT_DATA;
-            dh.net_id = this->net_id_hash_;
-            dh.ttl = 10;
-            memcpy(dh.src, this->my_mac_, 6);
-            memset(dh.dst, 0, 6);
-
-            uint8_t pl[5];
-            uint32_t hash = lock->get_object_id_hash();
-            memcpy(pl, &hash, 4);
-            pl[4] = static_cast<uint8_t>(lock->state);
-
-            this->route_packet(&dh, pl, 5);
-          });
-        }
-        break;
-      }
-      #endif
-
-      // ========== TEXT (Testo) ==========
-      #ifdef USE_TEXT
-      case ENTITY_TYPE_TEXT: {
-        auto *txt = static_cast<text::Text *>(obj.entity);
-        if (txt != nullptr) {
-          RegPayload p;
-          p.entity_hash = txt->get_object_id_hash();
-          p.type_id = 'X';
-          strncpy(p.name, txt->get_name().c_str(), 23);
-          p.name[23] = '\0';
-          memset(p.unit, 0, 8);
-          memset(p.dev_class, 0, 16);
-
-          MeshHeader h;
-          h.type = PKT_REG;
-          h.net_id = this->net_id_hash_;
-          h.ttl = 10;
-          memcpy(h.src, this->my_mac_, 6);
-          memcpy(h.dst, root_dst, 6);
-
-          this->route_packet(&h, reinterpret_cast<uint8_t *>(&p), sizeof(p));
-          delay(50);
-
-          txt->add_on_state_callback([this, txt](const std::string &state) {
-            MeshHeader dh;
-            dh.type = PKT_DATA;
-            dh.net_id = this->net_id_hash_;
-            dh.ttl = 10;
-            memcpy(dh.src, this->my_mac_, 6);
-            memset(dh.dst, 0, 6);
-
-            size_t state_len = std::min(state.length(), size_t(24));
-            uint8_t pl[28];
-            uint32_t hash = txt->get_object_id_hash();
-            memcpy(pl, &hash, 4);
-            memcpy(pl + 4, state.c_str(), state_len);
-            memset(pl + 4 + state_len, 0, 24 - state_len);
-
-            this->route_packet(&dh, pl, 28);
-          });
-        }
-        break;
+// Un avviso di migrazione si rilancia una volta sul canale corrente e solo
+// dopo si cambia canale: i vicini lo sentono prima che la radio si sposti.
+// Arriva dal Root (pianificata) o da un nodo che ha ritrovato la mesh altrove,
+// sempre firmato: un avviso falso porterebbe via tutta la mesh, quindi senza
+// firma valida, o se già visto, non si esegue né si rilancia.
+void EspMesh::handle_migrate(const MeshHeader *h, const uint8_t *data, int len) {
+#ifdef IS_NODE
+  int plen = len - sizeof(MeshHeader);
+  if (!this->auth_check(this->migrate_auth_, h, data + sizeof(MeshHeader), plen) ||
+      plen < (int) sizeof(MigratePayload))
+    return;
+  MigratePayload m;
+  memcpy(&m, data + sizeof(MeshHeader), sizeof(m));
+  if (m.channel < 1 || m.channel > 13)
+    return;
+  if (m.switch_at == 0 && m.channel == this->current_scan_ch_)
+    return;  // Già qui
+  if (this->migrate_pending_ && this->migrate_ch_ == m.channel)
+    return;  // Già in partenza: l'avviso è stato rilanciato
+
+  uint32_t now = millis();
+  uint32_t delay = MIGRATE_GRACE_MS;
+  if (m.switch_at != 0) {
+    int32_t left = static_cast<int32_t>(m.switch_at - this->mesh_time());
+    delay = std::max<int32_t>(left, MIGRATE_GRACE_MS);
+  }
+  this->migrate_ch_ = m.channel;
+  this->migrate_pending_ = true;
+  this->migrate_due_ = now + delay;
+  ESP_LOGI(TAG, "Channel migration to %u in %u ms", m.channel, delay);
+
+  if (h->ttl > 1 && len <= MESH_MAX_FRAME) {
+    uint8_t buf[MESH_MAX_FRAME];
+    memcpy(buf, data, len);
+    auto *fwd = reinterpret_cast<MeshHeader *>(buf);
+    fwd->ttl--;
+    this->route_packet(fwd, buf + sizeof(MeshHeader), len - sizeof(MeshHeader));
+  }
+#endif
+}
+
+void EspMesh::schedule_route(const std::string &key, RouteInfo &r, uint32_t delay_ms) {
+  uint32_t ticks = std::max<uint32_t>((delay_ms + ROUTE_WHEEL_TICK_MS - 1) / ROUTE_WHEEL_TICK_MS, 1);
+  r.slot = (this->wheel_pos_ + ticks) % ROUTE_WHEEL_SLOTS;
+  r.rounds = (ticks - 1) / ROUTE_WHEEL_SLOTS;
+  auto &bucket = this->route_wheel_[r.slot];
+  r.wheel_it = bucket.insert(bucket.end(), key);
+}
+
+void EspMesh::advance_route_wheel(uint32_t now) {
+  LockGuard guard(this->route_lock_);
+  while (now - this->last_wheel_tick_ >= ROUTE_WHEEL_TICK_MS) {
+    this->last_wheel_tick_ += ROUTE_WHEEL_TICK_MS;
+    this->wheel_pos_ = (this->wheel_pos_ + 1) % ROUTE_WHEEL_SLOTS;
+
+    auto &bucket = this->route_wheel_[this->wheel_pos_];
+    for (auto it = bucket.begin(); it != bucket.end();) {
+      RouteInfo &r = this->routes_[*it];
+      if (r.rounds > 0) {
+        r.rounds--;
+        ++it;
+        continue;
       }
-      #endif
-
-      // ========== VALVE (Valvola) ==========
-      #ifdef USE_VALVE
-      case ENTITY_TYPE_VALVE: {
-        auto *valve = static_cast<valve::Valve *>(obj.entity);
-        if (valve != nullptr) {
-          RegPayload p;
-          p.entity_hash = valve->get_object_id_hash();
-          p.type_id = 'V';
-          strncpy(p.name, valve->get_name().c_str(), 23);
-          p.name[23] = '\0';
-          strncpy(p.unit, "%", 7);
-          p.unit[7] = '\0';
-          memset(p.dev_class, 0, 16);
-
-          MeshHeader h;
-          h.type = PKT_REG;
-          h.net_id = this->net_id_hash_;
-          h.ttl = 10;
-          memcpy(h.src, this->my_mac_, 6);
-          memcpy(h.dst, root_dst, 6);
-
-          this->route_packet(&h, reinterpret_cast<uint8_t *>(&p), sizeof(p));
-          delay(50);
-
-          // Valve: posizione apertura 0-100%
-          valve->add_on_state_callback([this, valve]() {
-            MeshHeader dh;
-            dh.type = PKT_DATA;
-            dh.net_id = this->net_id_hash_;
-            dh.ttl = 10;
-            memcpy(dh.src, this->my_mac_, 6);
-            memset(dh.dst, 0, 6);
-
-            uint8_t pl[8];
-            uint32_t hash = valve->get_object_id_hash();
-            memcpy(pl, &hash, 4);
-            float position = valve->position;
-            memcpy(pl + 4, &position, 4);
-
-            this->route_packet(&dh, pl, 8);
-          });
-        }
-        break;
+      uint32_t age = now - r.last_seen;
+      std::string key = *it;
+      it = bucket.erase(it);
+      if (age >= this->route_timeout_) {
+        this->routes_.erase(key);
+      } else {
+        this->schedule_route(key, r, this->route_timeout_ - age);
       }
-      #endif
-
-      // ========== ALARM_CONTROL_PANEL (Allarme) ==========
-      #ifdef USE_ALARM_CONTROL_PANEL
-      case ENTITY_TYPE_ALARM_CONTROL_PANEL: {
-        auto *acp = static_cast<alarm_control_panel::AlarmControlPanel *>(obj.entity);
-        if (acp != nullptr) {
-          RegPayload p;
-          p.entity_hash = acp->get_object_id_hash();
-          p.type_id = 'A';
-          strncpy(p.name, acp->get_name().c_str(), 23);
-          p.name[23] = '\0';
-          memset(p.unit, 0, 8);
-          memset(p.dev_class, 0, 16);
-
-          MeshHeader h;
-          h.type = PKT_REG;
-          h.net_id = this->net_id_hash_;
-          h.ttl = 10;
-          memcpy(h.src, this->my_mac_, 6);
-          memcpy(h.dst, root_dst, 6);
-
-          this->route_packet(&h, reinterpret_cast<uint8_t *>(&p), sizeof(p));
-          delay(50);
-
-          // Alarm: stato (disarmed/armed_home/armed_away/triggered)
-          acp->add_on_state_callback([this, acp]() {
-            MeshHeader dh;
-            dh.type = PKT_DATA;
-            dh.net_id = this->net_id_hash_;
-            dh.ttl = 10;
-            memcpy(dh.src, this->my_mac_, 6);
-            memset(dh.dst, 0, 6);
-
-            uint8_t pl[5];
-            uint32_t hash = acp->get_object_id_hash();
-            memcpy(pl, &hash, 4);
-            pl[4] = static_cast<uint8_t>(acp->get_state());
-
-            this->route_packet(&dh, pl, 5);
-          });
-        }
+    }
+  }
+}
+
+// Il next hop non conferma a livello MAC: le rotte che passano da lui sono
+// morte, meglio nessuna rotta (si impara di nuovo al prossimo frame) che un buco nero
+void EspMesh::invalidate_routes_via(const uint8_t *next_hop) {
+  LockGuard guard(this->route_lock_);
+  for (auto it = this->routes_.begin(); it != this->routes_.end();) {
+    if (memcmp(it->second.next_hop, next_hop, 6) == 0) {
+      this->route_wheel_[it->second.slot].erase(it->second.wheel_it);
+      it = this->routes_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+// --- CODE DI TRASMISSIONE ---
+void EspMesh::enqueue_tx(const uint8_t *next_hop, const uint8_t *data, int len) {
+  uint8_t prio = reinterpret_cast<const MeshHeader *>(data)->flags & MESH_FLAG_PRIO_MASK;
+  if (prio >= PRIO_CLASSES)
+    prio = PRIO_BULK;
+
+  {
+    LockGuard guard(this->tx_lock_);
+    auto &q = this->tx_queue_[prio];
+    if (q.size() >= TX_QUEUE_DEPTH) {
+      this->stats_.tx_dropped[prio]++;
+      return;
+    }
+    q.emplace_back();
+    uint8_t depth = this->tx_queue_[PRIO_CONTROL].size() + this->tx_queue_[PRIO_STATE].size() +
+                    this->tx_queue_[PRIO_BULK].size();
+    this->queue_peak_ = std::max(this->queue_peak_, depth);
+    TxFrame &f = q.back();
+    memcpy(f.next_hop, next_hop, 6);
+    memcpy(f.data, data, len);
+    this->prof_bytes(PROF_ROUTE, len);
+    f.len = len;
+    f.enqueued_us = micros();
+    f.not_before_us = f.enqueued_us;
+    // I frame propri non urgenti partono con un piccolo ritardo casuale:
+    // nodi che reagiscono allo stesso evento non trasmettono insieme
+    if (prio != PRIO_CONTROL && memcmp(reinterpret_cast<const MeshHeader *>(data)->src, this->my_mac_, 6) == 0)
+      f.not_before_us += random_uint32() % (TX_JITTER_MS * 1000);
+  }
+  this->pump_tx();
+}
+
+// Strict priority: trasmette il frame più vecchio della classe più urgente
+void EspMesh::pump_tx() {
+  TxFrame f;
+  uint8_t prio;
+  {
+    LockGuard guard(this->tx_lock_);
+    if (this->tx_busy_) {
+      if (millis() - this->tx_started_ < TX_BUSY_TIMEOUT_MS)
+        return;
+      this->tx_busy_ = false;  // Send callback persa
+    }
+#ifdef IS_NODE
+    if (this->visit_ch_ != 0)
+      return;  // La radio è sul vecchio canale: la coda aspetta il ritorno
+#endif
+    uint32_t now_us = micros();
+    for (prio = 0; prio < PRIO_CLASSES; prio++) {
+      auto &q = this->tx_queue_[prio];
+      if (!q.empty() && static_cast<int32_t>(now_us - q.front().not_before_us) >= 0)
         break;
+    }
+    if (prio == PRIO_CLASSES)
+      return;
+    f = this->tx_queue_[prio].front();
+    this->tx_queue_[prio].pop_front();
+    this->tx_busy_ = true;
+    this->tx_started_ = millis();
+
+    uint32_t delay_us = micros() - f.enqueued_us;
+    this->stats_.tx_sent[prio]++;
+    this->stats_.queue_delay_sum_us[prio] += delay_us;
+    if (delay_us > this->stats_.queue_delay_max_us[prio])
+      this->stats_.queue_delay_max_us[prio] = delay_us;
+  }
+
+  // L'orologio negli annunci si timbra all'uscita: il ritardo in coda di
+  // ogni hop non entra nell'errore di sincronizzazione
+  if (f.data[0] == PKT_ANNOUNCE && f.len >= (int) (sizeof(MeshHeader) + sizeof(AnnouncePayload))) {
+    uint32_t t = this->mesh_time();
+    memcpy(f.data + sizeof(MeshHeader) + offsetof(AnnouncePayload, mesh_time), &t, 4);
+  }
+
+  this->send_raw(f.next_hop, f.data, f.len);
+}
+
+void EspMesh::on_sent(const uint8_t *mac, bool ok) {
+  if (!ok)
+    this->stats_.tx_fail++;
+  if (mac != nullptr && mac[0] != 0xFF) {
+    std::string key(reinterpret_cast<const char *>(mac), 6);
+    bool invalidate = false;
+    {
+      LockGuard guard(this->tx_lock_);
+      if (ok) {
+        this->hop_fails_.erase(key);
+      } else if (++this->hop_fails_[key] >= ROUTE_MAX_FAILS) {
+        this->hop_fails_.erase(key);
+        invalidate = true;
       }
-      #endif
-
-      // ========== EVENT (Evento) ==========
-      #ifdef USE_EVENT
-      case ENTITY_TYPE_EVENT: {
-        auto *evt = static_cast<event::Event *>(obj.entity);
-        if (evt != nullptr) {
-          RegPayload p;
-          p.entity_hash = evt->get_object_id_hash();
-          p.type_id = 'V';
-          strncpy(p.name, evt->get_name().c_str(), 23);
-          p.name[23] = '\0';
-          memset(p.unit, 0, 8);
-          memset(p.dev_class, 0, 16);
-
-          MeshHeader h;
-          h.type = PKT_REG;
-          h.net_id = this->net_id_hash_;
-          h.ttl = 10;
-          memcpy(h.src, this->my_mac_, 6);
-          memcpy(h.dst, root_dst, 6);
-
-          this->route_packet(&h, reinterpret_cast<uint8_t *>(&p), sizeof(p));
-          delay(50);
-
-          // Event: registro dei timestamp e tipo di evento
-          evt->add_on_event_callback([this, evt](const std::string &event_type) {
-            MeshHeader dh;
-            dh.type = PKT_DATA;
-            dh.net_id = this->net_id_hash_;
-            dh.ttl = 10;
-            memcpy(dh.src, this->my_mac_, 6);
-            memset(dh.dst, 0, 6);
-
-            size_t event_len = std::min(event_type.length(), size_t(24));
-            uint8_t pl[28];
-            uint32_t hash = evt->get_object_id_hash();
-            memcpy(pl, &hash, 4);
-            memcpy(pl + 4, event_type.c_str(), event_len);
-            memset(pl + 4 + event_len, 0, 24 - event_len);
-
-            this->route_packet(&dh, pl, 28);
-          });
+    }
+#ifdef IS_NODE
+    if (this->hop_count_ != 0xFF && memcmp(mac, this->parent_mac_, 6) == 0) {
+      if (ok) {
+        this->parent_fails_ = 0;
+        this->parent_alive_ = millis();
+        // Primo frame consegnato dopo un failover: fine del buco
+        if (this->outage_pending_) {
+          this->outage_pending_ = false;
+          this->last_outage_ms_ = this->parent_alive_ - this->outage_start_;
+          this->stats_.outage_max_ms = std::max(this->stats_.outage_max_ms, this->last_outage_ms_);
+          ESP_LOGI(TAG, "Upstream restored after %u ms", this->last_outage_ms_);
         }
-        break;
+      } else if (++this->parent_fails_ >= PARENT_MAX_FAILS) {
+        this->parent_lost_ = true;
       }
-      #endif
-
-      default:
-        ESP_LOGW(TAG, "Entity type %u not supported for scanning", obj.type);
-        break;
     }
+#endif
+    if (invalidate) {
+      ESP_LOGD(TAG, "Next hop %02X:%02X:%02X:%02X:%02X:%02X unreachable, dropping its routes", mac[0], mac[1],
+               mac[2], mac[3], mac[4], mac[5]);
+      this->invalidate_routes_via(mac);
+    }
+  }
+  {
+    LockGuard guard(this->tx_lock_);
+    this->tx_busy_ = false;
   }
+  this->pump_tx();
+}
 
-  ESP_LOGI(TAG, "Scanned %zu local entities", this->get_local_entities().size());
-}
-
-template<typename T>
-void EspMesh::add_entities_to_local_list(const T& entities, EntityType type) {
-    for (auto *entity : entities) {
-        // 'entity' qui è già un puntatore (es. Sensor*)
-        EntityInfo info;
-        // Cast sicuro a EntityBase* (Sensor eredita da EntityBase)
-        info.entity = static_cast<esphome::EntityBase*>(entity);
-        info.type = type;
-        this->local_entities_.push_back(info);
-    }
-}
-
-std::vector<EntityInfo> EspMesh::get_local_entities() {
- if(!this->local_entities_.empty()){
-    return this->local_entities_;
- }
- #ifdef USE_BINARY_SENSOR
- this->add_entities_to_local_list(App.get_binary_sensors(), ENTITY_TYPE_BINARY_SENSOR);
- #endif
- #ifdef USE_SENSOR
- this->add_entities_to_local_list(App.get_sensors(), ENTITY_TYPE_SENSOR);
- #endif
- #ifdef USE_SWITCH
- this->add_entities_to_local_list(App.get_switches(), ENTITY_TYPE_SWITCH);
- #endif
- #ifdef USE_BUTTON
-  this->add_entities_to_local_list(App.get_buttons(), ENTITY_TYPE_BUTTON);
- #endif
- #ifdef USE_TEXT_SENSOR
-  this->add_entities_to_local_list(App.get_text_sensors(), ENTITY_TYPE_TEXT_SENSOR);
- #endif
-#ifdef USE_FAN
-  this->add_entities_to_local_list(App.get_fans(), ENTITY_TYPE_FAN);
-#endif
-#ifdef USE_COVER
-  this->add_entities_to_local_list(App.get_covers(), ENTITY_TYPE_COVER);
-#endif
-#ifdef USE_LIGHT
-  this->add_entities_to_local_list(App.get_lights(), ENTITY_TYPE_LIGHT);
-#endif
-#ifdef USE_CLIMATE
-  this->add_entities_to_local_list(App.get_climates(), ENTITY_TYPE_CLIMATE);
-#endif
-#ifdef USE_NUMBER
-  this->add_entities_to_local_list(App.get_numbers(), ENTITY_TYPE_NUMBER);
-#endif
-#ifdef USE_DATETIME_DATE
-  this->add_entities_to_local_list(App.get_dates(), ENTITY_TYPE_DATE);
-#endif
-#ifdef USE_DATETIME_TIME
-  this->add_entities_to_local_list(App.get_times(), ENTITY_TYPE_TIME);
-#endif
-#ifdef USE_DATETIME_DATETIME
-  this->add_entities_to_local_list(App.get_datetimes(), ENTITY_TYPE_DATETIME);
-#endif
-#ifdef USE_TEXT
-  this->add_entities_to_local_list(App.get_texts(), ENTITY_TYPE_TEXT);
+void EspMesh::log_stats() {
+  static const char *const names[PRIO_CLASSES] = {"control", "state", "bulk"};
+  for (uint8_t p = 0; p < PRIO_CLASSES; p++) {
+    uint32_t sent = this->stats_.tx_sent[p];
+    uint32_t avg = sent ? this->stats_.queue_delay_sum_us[p] / sent : 0;
+    ESP_LOGD(TAG, "TX %-7s sent %u dropped %u queue delay avg %u us max %u us", names[p], sent,
+             this->stats_.tx_dropped[p], avg, this->stats_.queue_delay_max_us[p]);
+  }
+  uint32_t total = this->stats_.tx_sent[PRIO_CONTROL] + this->stats_.tx_sent[PRIO_STATE] +
+                   this->stats_.tx_sent[PRIO_BULK];
+  ESP_LOGD(TAG, "TX failures %u (%.1f%%), retransmissions %u, unacknowledged %u, announces deferred %u",
+           this->stats_.tx_fail, total ? 100.0f * this->stats_.tx_fail / total : 0.0f, this->stats_.rtx_sent,
+           this->stats_.rtx_dropped, this->stats_.announce_deferred);
+#ifdef IS_NODE
+  if (this->stats_.sync_samples) {
+    ESP_LOGD(TAG, "Clock sync error avg %u ms max %u ms, drift %.1f ppm",
+             this->stats_.sync_err_sum_ms / this->stats_.sync_samples, this->stats_.sync_err_max_ms,
+             this->clock_drift_ * 1e6f);
+  }
+  std::map<std::string, uint32_t> upstream_tx;
+  {
+    LockGuard guard(this->route_lock_);
+    upstream_tx.swap(this->upstream_tx_);
+  }
+  for (auto &kv : upstream_tx) {
+    auto *p = reinterpret_cast<const uint8_t *>(kv.first.data());
+    ESP_LOGD(TAG, "Upstream via %02X:%02X:%02X:%02X:%02X:%02X: %u frames", p[0], p[1], p[2], p[3], p[4], p[5],
+             kv.second);
+  }
+  if (this->stats_.auth_rejected) {
+    ESP_LOGD(TAG, "Rejected %u control frames with an invalid signature", this->stats_.auth_rejected);
+  }
+  if (this->stats_.agg_frames) {
+    ESP_LOGD(TAG, "Aggregated %u records into %u frames", this->stats_.agg_records, this->stats_.agg_frames);
+  }
+  if (this->stats_.parent_failovers) {
+    ESP_LOGD(TAG, "Parent failovers %u, outage max %u ms (last %u ms)", this->stats_.parent_failovers,
+             this->stats_.outage_max_ms, this->last_outage_ms_);
+  }
 #endif
-#ifdef USE_SELECT
-  this->add_entities_to_local_list(App.get_selects(), ENTITY_TYPE_SELECT);
+  if (this->stats_.channel_moves) {
+    ESP_LOGD(TAG, "Channel moves %u (now %u)", this->stats_.channel_moves,
+#ifdef IS_ROOT
+             this->root_channel_);
+#else
+             this->current_scan_ch_);
 #endif
-#ifdef USE_LOCK
-  this->add_entities_to_local_list(App.get_locks(), ENTITY_TYPE_LOCK);
+  }
+#ifdef IS_ROOT
+  if (this->stats_.lat_samples) {
+    ESP_LOGD(TAG, "Data latency avg %u ms max %u ms, per hop %u ms",
+             this->stats_.lat_sum_ms / this->stats_.lat_samples, this->stats_.lat_max_ms,
+             this->stats_.lat_sum_ms / std::max<uint32_t>(this->stats_.lat_hops, 1));
+  }
 #endif
-#ifdef USE_VALVE
-  this->add_entities_to_local_list(App.get_valves(), ENTITY_TYPE_VALVE);
+#ifdef IS_ROOT
+  ESP_LOGD(TAG, "MQTT published %u coalesced %u dropped %u queued %zu", this->stats_.pub_sent,
+           this->stats_.pub_coalesced, this->stats_.pub_dropped, this->pub_queue_.size());
 #endif
-#ifdef USE_ALARM_CONTROL_PANEL
-  this->add_entities_to_local_list(App.get_alarm_control_panels(), ENTITY_TYPE_ALARM_CONTROL_PANEL);
+  this->stats_ = MeshStats{};
+  if (this->profile_)
+    this->log_profile();
+}
+
+// ns/op medi e massimi e byte copiati/op misurati sul dispositivo
+void EspMesh::log_profile() {
+  static const char *const names[PROF_PATHS] = {"on_packet", "route_packet", "peer_slot", "handle_reg",
+                                                "handle_data", "submit_state"};
+  for (uint8_t p = 0; p < PROF_PATHS; p++) {
+    const ProfCounter &c = this->prof_[p];
+    if (c.calls == 0)
+      continue;
+    uint32_t avg_ns = c.cycles * 1000 / CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ / c.calls;
+    uint32_t max_ns = (uint64_t) c.max_cycles * 1000 / CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ;
+    ESP_LOGD(TAG, "Profile %-12s %u calls, avg %u ns, max %u ns, %u B copied/op", names[p], c.calls, avg_ns, max_ns,
+             c.bytes / c.calls);
+  }
+  ESP_LOGD(TAG, "Heap free %u B, minimum %u B", (unsigned) esp_get_free_heap_size(),
+           (unsigned) esp_get_minimum_free_heap_size());
+  for (auto &c : this->prof_)
+    c = ProfCounter{};
+}
+
+void EspMesh::fill_header(MeshHeader &h, uint8_t type, const uint8_t *dst, uint8_t ttl, uint8_t flags) {
+  h.type = type;
+  h.net_id = this->net_id_hash_;
+  memcpy(h.src, this->my_mac_, 6);
+  memcpy(h.dst, dst, 6);
+  memset(h.next_hop, 0, 6);
+  h.ttl = ttl;
+  h.flags = flags;
+  h.seq = 0;
+}
+
+void EspMesh::send_announce() {
+  uint8_t bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+  MeshHeader h;
+  this->fill_header(h, PKT_ANNOUNCE, bcast, 1, PRIO_CONTROL);
+
+  AnnouncePayload a;
+  a.hop = this->hop_count_;
+  a.root_load = this->root_load_;
+#ifdef IS_ROOT
+  memcpy(a.root_id, this->my_mac_, 6);
+  memcpy(a.parent, this->my_mac_, 6);
+  a.path_cost = 0;
+  a.reg_epoch = this->reg_epoch_;
+  a.groups = 0;
+#else
+  a.reg_epoch = this->root_epoch_;
+  a.groups = this->groups_ | this->children_groups();
+  memcpy(a.root_id, this->root_id_, 6);
+  memcpy(a.parent, this->parent_mac_, 6);
+  // Le code piene rendono il ramo più caro: i figli si spostano altrove
+  {
+    LockGuard guard(this->tx_lock_);
+    a.path_cost = std::min<uint32_t>(this->path_cost_ + this->queue_peak_ * QUEUE_COST_PER_FRAME, 0xFFFE);
+    this->queue_peak_ = 0;
+  }
 #endif
-#ifdef USE_EVENT
-  this->add_entities_to_local_list(App.get_events(), ENTITY_TYPE_EVENT);
+  a.mesh_time = 0;  // Timbrato in pump_tx()
+
+  uint8_t buf[sizeof(MeshHeader) + sizeof(AnnouncePayload)];
+  memcpy(buf, &h, sizeof(MeshHeader));
+  memcpy(buf + sizeof(MeshHeader), &a, sizeof(a));
+  this->enqueue_tx(bcast, buf, sizeof(buf));
+}
+
+// Prossimo annuncio: periodo ±jitter. Con gli slot, e l'orologio di mesh
+// agganciato, ogni nodo annuncia nella propria fetta del periodo.
+void EspMesh::schedule_announce(uint32_t now) {
+  uint32_t delay = ANNOUNCE_INTERVAL_MS - ANNOUNCE_JITTER_MS + random_uint32() % (2 * ANNOUNCE_JITTER_MS);
+
+  bool synced = true;
+#ifdef IS_NODE
+  synced = this->clock_synced_;
 #endif
-#ifdef USE_UPDATE
-  this->add_entities_to_local_list(App.get_updates(), ENTITY_TYPE_UPDATE);
+  if (this->tx_slots_ > 1 && synced) {
+    uint32_t width = ANNOUNCE_INTERVAL_MS / this->tx_slots_;
+    uint32_t slot = ((this->my_mac_[4] << 8) | this->my_mac_[5]) % this->tx_slots_;
+    uint32_t t = this->mesh_time();
+    uint32_t frame = t - t % ANNOUNCE_INTERVAL_MS + ANNOUNCE_INTERVAL_MS;
+    uint32_t target = frame + slot * width + random_uint32() % std::max<uint32_t>(width / 2, 1);
+    if (target - t < ANNOUNCE_INTERVAL_MS / 2)
+      target += ANNOUNCE_INTERVAL_MS;
+    delay = target - t;
+  }
+  this->next_announce_ = now + delay;
+}
+
+// --- PEER MANAGEMENT ---
+void EspMesh::ensure_peer_slot(const uint8_t *mac) {
+  ProfScope prof(this->prof(PROF_PEER_SLOT));
+  if (esp_now_is_peer_exist(mac)) {
+    std::string s(reinterpret_cast<const char *>(mac), 6);
+    this->peer_lru_.remove(s);
+    this->peer_lru_.push_back(s);
+    return;
+  }
+
+  if (this->peer_lru_.size() >= MAX_PEERS) {
+    std::string victim_s = this->peer_lru_.front();
+#ifdef IS_NODE
+    if (this->hop_count_ != 0xFF && memcmp(victim_s.c_str(), this->parent_mac_, 6) == 0) {
+      if (this->peer_lru_.size() > 1) {
+        auto it = this->peer_lru_.begin();
+        it++;
+        victim_s = *it;
+      } else {
+        return;
+      }
+    }
 #endif
- return this->local_entities_;
 
+    esp_now_del_peer(reinterpret_cast<const uint8_t *>(victim_s.c_str()));
+    this->peer_lru_.remove(victim_s);
+    ESP_LOGD(TAG, "Evicted peer to make space");
+  }
+
+  esp_now_peer_info_t pi = {};
+  memcpy(pi.peer_addr, mac, 6);
+  pi.channel = (this->hop_count_ == 0xFF) ? this->current_scan_ch_ : 0;
+  pi.encrypt = true;
+  this->derive_lmk(mac, pi.lmk);
+
+  if (esp_now_add_peer(&pi) == ESP_OK) {
+    this->peer_lru_.push_back(std::string(reinterpret_cast<const char *>(mac), 6));
+  }
 }
 
-#endif
+void EspMesh::send_raw(const uint8_t *next_hop, const uint8_t *data, int len) {
+  bool is_bcast = (next_hop[0] == 0xFF);
 
-#ifdef IS_ROOT
-void EspMesh::handle_reg(const uint8_t *origin, const RegPayload *p) {
-  if (!this->mqtt_)
+  if (!is_bcast) {
+    this->ensure_peer_slot(next_hop);
+  } else {
+    if (!esp_now_is_peer_exist(next_hop)) {
+      esp_now_peer_info_t pi = {};
+      memcpy(pi.peer_addr, next_hop, 6);
+      pi.encrypt = false;
+      esp_now_add_peer(&pi);
+    }
+  }
+
+  // Nessuna send callback se l'invio fallisce subito
+  if (esp_now_send(next_hop, data, len) != ESP_OK) {
+    this->stats_.tx_fail++;
+    LockGuard guard(this->tx_lock_);
+    this->tx_busy_ = false;
+  }
+}
+
+void EspMesh::derive_lmk(const uint8_t *mac, uint8_t *lmk) {
+  for (int i = 0; i < 16; i++) {
+    lmk[i] = this->pmk_[i] ^ mac[i % 6];
+  }
+}
+
+#ifdef IS_NODE
+void EspMesh::setup_bare_metal() {
+  nvs_flash_init();
+  esp_netif_init();
+  esp_event_loop_create_default();
+  wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+  esp_wifi_init(&cfg);
+  esp_wifi_set_mode(WIFI_MODE_STA);
+  esp_wifi_set_channel(this->current_scan_ch_, WIFI_SECOND_CHAN_NONE);
+  esp_wifi_start();
+  esp_wifi_set_ps(WIFI_PS_NONE);
+  esp_wifi_get_mac(WIFI_IF_STA, this->my_mac_);
+}
+
+// Costo di un link: un hop pesa LINK_COST_BASE, i link deboli di più
+static uint16_t link_cost(int8_t rssi) {
+  uint16_t cost = LINK_COST_BASE;
+  if (rssi != 0 && rssi < LINK_RSSI_GOOD)
+    cost += LINK_RSSI_GOOD - rssi;
+  return cost;
+}
+
+// Scelta del parent per costo di percorso + carico del Root servito
+void EspMesh::handle_announce(const MeshHeader *h, const AnnouncePayload *a, int8_t rssi) {
+  this->track_neighbor(h->src, a, rssi);
+  bool from_parent = this->hop_count_ != 0xFF && memcmp(h->src, this->parent_mac_, 6) == 0;
+
+  // Mai scegliere un proprio figlio: chiuderebbe un loop. Se è il parent
+  // a non avere più strada (o a essersi agganciato a noi), è perso.
+  if (a->hop == 0xFF || a->path_cost == 0xFFFF || (a->hop != 0 && memcmp(a->parent, this->my_mac_, 6) == 0)) {
+    if (from_parent)
+      this->parent_lost_ = true;
     return;
-  char m[13];
-  sprintf(m, "%02X%02X%02X%02X%02X%02X", origin[0], origin[1], origin[2], origin[3], origin[4],
-          origin[5]);
-  std::string uid = std::string(m) + "_" + to_string(p->entity_hash);
+  }
+
+  uint32_t cost = a->path_cost + link_cost(rssi) + (a->root_load >> LOAD_COST_SHIFT);
+  if (cost >= 0xFFFF)
+    return;
+
+  if (from_parent)
+    this->parent_alive_ = millis();
+  bool better = this->hop_count_ == 0xFF || cost + PARENT_HYSTERESIS < this->path_cost_;
+  if (!from_parent && !better)
+    return;
+
+  // Appena agganciati si annuncia presto, ma non insieme ai fratelli
+  // che hanno sentito lo stesso annuncio
+  if (this->hop_count_ == 0xFF)
+    this->next_announce_ = millis() + random_uint32() % ANNOUNCE_JITTER_MS;
+  this->root_epoch_ = a->reg_epoch;
+  this->adopt_parent(h->src, a->hop + 1, cost, a->root_id, a->root_load);
+  this->sync_clock(a->mesh_time);
+
+  // Il Root ha azzerato il registro (o è ripartito senza): ci registriamo di
+  // nuovo. Con il registro ripristinato da NVS l'epoca non cambia.
+  uint32_t now = millis();
+  if (this->entities_attached_ && this->reg_epoch_ != this->root_epoch_ &&
+      now - this->last_reg_resync_ >= REG_RESYNC_MS) {
+    this->last_reg_resync_ = now;
+    ESP_LOGI(TAG, "Root registry epoch changed, re-registering");
+    this->request_rescan();
+  }
+}
 
-  std::string top = "homeassistant/sensor/" + uid + "/config";
-  std::string stat = "mesh_gw/" + uid + "/state";
-  std::string j = "{\"name\":\"" + std::string(p->name) + "\",\"uniq_id\":\"" + uid +
-                  "\",\"stat_t\":\"" + stat + "\",\"dev\":{\"ids\":[\"" + std::string(m) +
-                  "\"],\"name\":\"Node " + std::string(m) + "\"}}";
-  this->mqtt_->publish(top, j, 0, true);
+void EspMesh::adopt_parent(const uint8_t *mac, uint8_t hop, uint16_t cost, const uint8_t *root_id,
+                           uint8_t root_load) {
+  bool root_changed = this->hop_count_ == 0xFF || memcmp(this->root_id_, root_id, 6) != 0;
+  bool new_parent = this->hop_count_ == 0xFF || memcmp(this->parent_mac_, mac, 6) != 0;
+  // Ritrovata la mesh su un altro canale: l'AP del Root si è spostato senza
+  // preavviso. Chi è rimasto sul vecchio canale va avvisato da qui.
+  if (this->hop_count_ == 0xFF && this->op_channel_ != 0 && this->op_channel_ != this->current_scan_ch_) {
+    ESP_LOGI(TAG, "Mesh moved from channel %u to %u, notifying the old channel", this->op_channel_,
+             this->current_scan_ch_);
+    MeshHeader h;
+    uint8_t bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    this->fill_header(h, PKT_MIGRATE, bcast, MESH_DEFAULT_TTL, PRIO_CONTROL | MESH_FLAG_FLOOD);
+    h.seq = this->migrate_seq_++;
+    memcpy(h.next_hop, bcast, 6);
+    MigratePayload m{this->current_scan_ch_, 0};
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(&m);
+    std::vector<uint8_t> pl(p, p + sizeof(m));
+    this->auth_sign(h, pl);
+    this->visit_frame_.resize(sizeof(h) + pl.size());
+    memcpy(this->visit_frame_.data(), &h, sizeof(h));
+    memcpy(this->visit_frame_.data() + sizeof(h), pl.data(), pl.size());
+    this->visit_ch_ = this->op_channel_;
+    this->visit_left_ = MIGRATE_REPEAT;
+    this->visit_until_ = millis();
+  }
+  this->op_channel_ = this->current_scan_ch_;
+  if (root_changed)
+    this->clock_synced_ = false;  // Ogni Root ha il suo orologio
+  this->hop_count_ = hop;
+  this->path_cost_ = cost;
+  this->root_load_ = root_load;
+  memcpy(this->root_id_, root_id, 6);
+  if (new_parent) {
+    memcpy(this->parent_mac_, mac, 6);
+    this->parent_alive_ = millis();
+    this->parent_fails_ = 0;
+    this->parent_lost_ = false;
+    ESP_LOGI(TAG, "Parent Found: %02X.. (Hop %d, Cost %u) Ch:%d", mac[0], this->hop_count_, this->path_cost_,
+             this->current_scan_ch_);
+  }
+
+  // Nuovo Root: non conosce ancora le nostre entità
+  if (root_changed) {
+    ESP_LOGI(TAG, "Serving root %02X:%02X:%02X:%02X:%02X:%02X (load %u)", root_id[0], root_id[1], root_id[2],
+             root_id[3], root_id[4], root_id[5], root_load);
+    this->request_rescan();
+  }
 }
-void EspMesh::handle_data(const uint8_t *origin, const uint8_t *payload) {
-  if (!this->mqtt_)
+
+// Parent muto per PARENT_LOSS_ANNOUNCES periodi o senza ACK MAC per
+// PARENT_MAX_FAILS invii: si passa alla migliore riserva già sentita, sullo
+// stesso canale. Solo senza riserve si torna a scansionare.
+void EspMesh::check_parent(uint32_t now) {
+  bool silent = now - this->parent_alive_ > PARENT_LOSS_ANNOUNCES * (ANNOUNCE_INTERVAL_MS + ANNOUNCE_JITTER_MS);
+  if (!this->parent_lost_ && !silent)
     return;
-  uint32_t hash;
-  float val;
-  memcpy(&hash, payload, 4);
-  memcpy(&val, payload + 4, 4);
-  char m[13];
-  sprintf(m, "%02X%02X%02X%02X%02X%02X", origin[0], origin[1], origin[2], origin[3], origin[4],
-          origin[5]);
-  std::string uid = std::string(m) + "_" + to_string(hash);
-  char vs[16];
-  sprintf(vs, "%.2f", val);
-  this->mqtt_->publish("mesh_gw/" + uid + "/state", vs);
+
+  ESP_LOGW(TAG, "Parent %02X:%02X:%02X:%02X:%02X:%02X lost (%s)", this->parent_mac_[0], this->parent_mac_[1],
+           this->parent_mac_[2], this->parent_mac_[3], this->parent_mac_[4], this->parent_mac_[5],
+           silent ? "no announces" : "send failures");
+  this->stats_.parent_failovers++;
+  if (!this->outage_pending_) {
+    this->outage_pending_ = true;
+    this->outage_start_ = this->parent_alive_;
+  }
+  this->neighbors_.erase(std::string(reinterpret_cast<const char *>(this->parent_mac_), 6));
+  this->invalidate_routes_via(this->parent_mac_);
+  this->parent_lost_ = false;
+  this->parent_fails_ = 0;
+
+  const std::pair<const std::string, NeighborInfo> *best = nullptr;
+  for (auto &kv : this->neighbors_) {
+    const NeighborInfo &n = kv.second;
+    if (n.cost == 0xFFFF || n.is_child || now - n.last_seen > PARENT_CANDIDATE_TTL_MS)
+      continue;
+    if (best == nullptr || n.cost < best->second.cost)
+      best = &kv;
+  }
+
+  if (best == nullptr) {
+    ESP_LOGW(TAG, "No backup parent, rescanning");
+    this->hop_count_ = 0xFF;
+    this->path_cost_ = 0xFFFF;
+    // Ultima migrazione annunciata: si cerca prima lì
+    if (this->migrate_ch_ != 0 && this->migrate_ch_ != this->current_scan_ch_) {
+      this->current_scan_ch_ = this->migrate_ch_;
+      esp_wifi_set_channel(this->current_scan_ch_, WIFI_SECOND_CHAN_NONE);
+      this->scan_hold_until_ = now + MIGRATE_DWELL_MS;
+    }
+    return;
+  }
+  const NeighborInfo &n = best->second;
+  this->adopt_parent(reinterpret_cast<const uint8_t *>(best->first.data()), n.hop + 1, n.cost, n.root_id,
+                     n.root_load);
+}
+
+// Aggancio all'orologio del parent: il riferimento è già corretto per la coda
+// di ogni hop; qui si aggiunge il volo e si stima il drift dagli errori residui.
+void EspMesh::sync_clock(uint32_t ref) {
+  uint32_t now = millis();
+  ref += TIME_HOP_DELAY_MS;
+  int32_t err = ref - this->mesh_time();
+  uint32_t abs_err = std::abs(err);
+
+  if (!this->clock_synced_ || abs_err > CLOCK_STEP_MS) {
+    this->clock_offset_ = ref - now;
+    this->clock_drift_ = 0;
+    this->last_sync_local_ = now;
+    this->clock_synced_ = true;
+    return;
+  }
+
+  uint32_t elapsed = now - this->last_sync_local_;
+  if (elapsed > 0) {
+    this->clock_drift_ += CLOCK_DRIFT_GAIN * err / static_cast<float>(elapsed);
+    this->clock_drift_ = std::max(-CLOCK_DRIFT_MAX, std::min(this->clock_drift_, CLOCK_DRIFT_MAX));
+  }
+  this->clock_offset_ = ref - now;
+  this->last_sync_local_ = now;
+
+  this->stats_.sync_samples++;
+  this->stats_.sync_err_sum_ms += abs_err;
+  this->stats_.sync_err_max_ms = std::max(this->stats_.sync_err_max_ms, abs_err);
+}
+
+// --- TOPOLOGIA ---
+void EspMesh::track_neighbor(const uint8_t *mac, const AnnouncePayload *a, int8_t rssi) {
+  std::string key(reinterpret_cast<const char *>(mac), 6);
+  auto it = this->neighbors_.find(key);
+  if (it == this->neighbors_.end()) {
+    if (this->neighbors_.size() >= TOPO_MAX_TRACKED) {
+      // Fuori il vicino sentito meno di recente, i figli per ultimi: portano
+      // le maschere dei gruppi del sottoalbero
+      auto oldest = std::min_element(this->neighbors_.begin(), this->neighbors_.end(), [](const auto &x, const auto &y) {
+        if (x.second.is_child != y.second.is_child)
+          return !x.second.is_child;
+        return x.second.last_seen < y.second.last_seen;
+      });
+      this->neighbors_.erase(oldest);
+    }
+    it = this->neighbors_.emplace(key, NeighborInfo{rssi, false, 0}).first;
+  }
+  NeighborInfo &n = it->second;
+  n.rssi = (n.rssi * 3 + rssi) / 4;  // Media mobile: un singolo frame non cambia il report
+  n.is_child = a->hop != 0 && memcmp(a->parent, this->my_mac_, 6) == 0;
+  n.last_seen = millis();
+  n.groups = n.is_child ? a->groups : 0;
+
+  n.hop = a->hop;
+  n.adv_cost = a->path_cost;
+  n.cost = 0xFFFF;
+  if (a->hop != 0xFF && a->path_cost != 0xFFFF && !n.is_child)
+    n.cost = std::min<uint32_t>(a->path_cost + link_cost(rssi) + (a->root_load >> LOAD_COST_SHIFT), 0xFFFF);
+  memcpy(n.root_id, a->root_id, 6);
+  n.root_load = a->root_load;
+}
+
+// Gruppi dei sottoalberi dei figli, dai loro annunci
+uint32_t EspMesh::children_groups() {
+  uint32_t now = millis();
+  uint32_t mask = 0;
+  for (auto &kv : this->neighbors_) {
+    if (kv.second.is_child && now - kv.second.last_seen < TOPO_NEIGHBOR_TTL_MS)
+      mask |= kv.second.groups;
+  }
+  return mask;
+}
+
+// Cambio di canale alla scadenza, e visite brevi al vecchio canale per
+// portare l'avviso a chi non ha ancora sentito la mesh spostarsi
+void EspMesh::check_migration(uint32_t now) {
+  if (this->migrate_pending_ && static_cast<int32_t>(now - this->migrate_due_) >= 0) {
+    this->migrate_pending_ = false;
+    if (this->migrate_ch_ != this->current_scan_ch_) {
+      ESP_LOGI(TAG, "Switching to channel %u", this->migrate_ch_);
+      this->current_scan_ch_ = this->migrate_ch_;
+      esp_wifi_set_channel(this->current_scan_ch_, WIFI_SECOND_CHAN_NONE);
+      this->stats_.channel_moves++;
+    }
+    // Il parent si sposta con noi: tempo per risentirlo sul canale nuovo
+    if (this->hop_count_ != 0xFF) {
+      this->op_channel_ = this->current_scan_ch_;
+      this->parent_alive_ = now;
+    }
+    this->scan_hold_until_ = now + MIGRATE_DWELL_MS;
+  }
+
+  if (this->visit_ch_ == 0 || static_cast<int32_t>(now - this->visit_until_) < 0)
+    return;
+  bool on_old = false;
+  {
+    LockGuard guard(this->tx_lock_);
+    if (this->tx_busy_ && now - this->tx_started_ < TX_BUSY_TIMEOUT_MS)
+      return;  // Frame ancora in volo
+    if (this->visit_left_ > 0) {
+      this->visit_left_--;
+      this->tx_busy_ = true;
+      this->tx_started_ = now;
+      on_old = true;
+    }
+  }
+  if (on_old) {
+    uint8_t bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    esp_wifi_set_channel(this->visit_ch_, WIFI_SECOND_CHAN_NONE);
+    this->send_raw(bcast, this->visit_frame_.data(), this->visit_frame_.size());
+    this->visit_until_ = now + MIGRATE_VISIT_MS;
+    return;
+  }
+  // Visite finite: di nuovo sul canale della mesh
+  esp_wifi_set_channel(this->current_scan_ch_, WIFI_SECOND_CHAN_NONE);
+  this->visit_ch_ = 0;
+  this->visit_frame_.clear();
+  this->pump_tx();
+}
+
+// Report solo quando cambia un arco (parent, hop, figli) o allo scadere del
+// refresh, e mai più spesso di TOPO_MIN_INTERVAL_MS
+void EspMesh::send_topology(uint32_t now) {
+  if (now - this->last_topo_sent_ < TOPO_MIN_INTERVAL_MS)
+    return;
+
+  std::vector<std::pair<int8_t, const std::string *>> heard;
+  uint8_t children = 0;
+  for (auto &kv : this->neighbors_) {
+    if (now - kv.second.last_seen > TOPO_NEIGHBOR_TTL_MS)
+      continue;
+    heard.emplace_back(kv.second.rssi, &kv.first);
+    if (kv.second.is_child)
+      children++;
+  }
+
+  uint32_t manifest = this->manifest();
+  bool changed = memcmp(this->topo_sent_.parent, this->parent_mac_, 6) != 0 ||
+                 this->topo_sent_.hop != this->hop_count_ || this->topo_sent_.children != children ||
+                 this->topo_sent_.manifest != manifest;
+  if (!changed && this->last_topo_sent_ != 0 && now - this->last_topo_sent_ < TOPO_REFRESH_MS)
+    return;
+
+  std::sort(heard.begin(), heard.end(), [](const auto &x, const auto &y) { return x.first > y.first; });
+  if (heard.size() > TOPO_NEIGHBORS)
+    heard.resize(TOPO_NEIGHBORS);
+
+  TopoPayload t;
+  memcpy(t.parent, this->parent_mac_, 6);
+  t.hop = this->hop_count_;
+  t.path_cost = this->path_cost_;
+  t.children = children;
+  t.n_neighbors = heard.size();
+  t.manifest = manifest;
+
+  uint8_t buf[sizeof(TopoPayload) + TOPO_NEIGHBORS * sizeof(TopoNeighbor)];
+  memcpy(buf, &t, sizeof(t));
+  size_t len = sizeof(t);
+  for (auto &n : heard) {
+    TopoNeighbor tn;
+    memcpy(tn.mac, n.second->data(), 6);
+    tn.rssi = n.first;
+    memcpy(buf + len, &tn, sizeof(tn));
+    len += sizeof(tn);
+  }
+
+  this->topo_sent_ = t;
+  this->last_topo_sent_ = now;
+  this->send_to_root(PKT_TOPO, buf, len, PRIO_BULK);
+}
+
+// Alternative al primario: stesso Root, costo entro MULTIPATH_COST_SLACK e
+// costo annunciato minore del nostro (un vicino più vicino al Root non può
+// passare da noi, quindi niente loop). Esclusi i next hop che stanno fallendo.
+void EspMesh::refresh_upstream(uint32_t now) {
+  uint8_t alt[MULTIPATH_MAX][6];
+  uint8_t count = 0;
+  memcpy(alt[count++], this->parent_mac_, 6);
+
+  if (this->multipath_) {
+    std::vector<std::pair<uint16_t, const std::string *>> cands;
+    for (auto &kv : this->neighbors_) {
+      const NeighborInfo &n = kv.second;
+      if (memcmp(kv.first.data(), this->parent_mac_, 6) == 0 || n.cost == 0xFFFF || n.is_child)
+        continue;
+      if (now - n.last_seen > PARENT_CANDIDATE_TTL_MS || memcmp(n.root_id, this->root_id_, 6) != 0)
+        continue;
+      if (n.adv_cost >= this->path_cost_ || n.cost > this->path_cost_ + MULTIPATH_COST_SLACK)
+        continue;
+      cands.emplace_back(n.cost, &kv.first);
+    }
+    std::sort(cands.begin(), cands.end());
+
+    LockGuard guard(this->tx_lock_);
+    for (auto &c : cands) {
+      if (count >= MULTIPATH_MAX)
+        break;
+      if (this->hop_fails_.count(*c.second))
+        continue;
+      memcpy(alt[count++], c.second->data(), 6);
+    }
+  }
+
+  LockGuard guard(this->route_lock_);
+  memcpy(this->upstream_, alt, sizeof(alt));
+  this->upstream_count_ = count;
+}
+
+// Hash per flusso (originatore + entità): l'ordine dei valori di ogni
+// entità è preservato, flussi diversi si spalmano sui parent
+void EspMesh::pick_upstream(const MeshHeader *h, const uint8_t *payload, int len, uint8_t *next_hop) {
+  uint32_t flow = 2166136261UL;
+  auto mix = [&flow](const uint8_t *p, int n) {
+    for (int i = 0; i < n; i++)
+      flow = (flow ^ p[i]) * 16777619UL;
+  };
+  mix(h->src, 6);
+  int off = (h->flags & MESH_FLAG_TIMESTAMP) ? 4 : 0;
+  int id_len = (h->flags & MESH_FLAG_INDEX) ? 1 : 4;
+  if (h->type == PKT_DATA && len >= off + id_len)
+    mix(payload + off, id_len);
+
+  LockGuard guard(this->route_lock_);
+  if (this->upstream_count_ == 0) {
+    memcpy(next_hop, this->parent_mac_, 6);
+  } else {
+    memcpy(next_hop, this->upstream_[flow % this->upstream_count_], 6);
+  }
+  this->upstream_tx_[std::string(reinterpret_cast<const char *>(next_hop), 6)]++;
+}
+
+// Repeater: un PKT_DATA (o i record di un PKT_AGG a valle) entra nel
+// buffer di aggregazione; false = da inoltrare così com'è
+bool EspMesh::aggregate(const uint8_t *mac, const MeshHeader *h, const uint8_t *payload, int len) {
+  if (h->type == PKT_DATA) {
+    // Il controllo non aspetta; i record devono stare in un byte di lunghezza
+    if ((h->flags & MESH_FLAG_PRIO_MASK) == PRIO_CONTROL || len > (int) (MESH_MAX_PAYLOAD - sizeof(AggRecord)))
+      return false;
+    AggRecord r;
+    memcpy(r.src, h->src, 6);
+    r.ttl = h->ttl;
+    r.flags = h->flags;
+    r.seq = h->seq;
+    r.len = len;
+    this->agg_add(r, payload);
+    return true;
+  }
+  if (h->type != PKT_AGG)
+    return false;
+
+  // Aggregato di un repeater a valle: i suoi record si uniscono ai nostri
+  int off = 0;
+  while (off + (int) sizeof(AggRecord) <= len) {
+    AggRecord r;
+    memcpy(&r, payload + off, sizeof(r));
+    off += sizeof(r);
+    if (off + r.len > len)
+      break;
+    this->learn_route(r.src, mac);
+    if (r.ttl > 1) {
+      r.ttl--;
+      this->agg_add(r, payload + off);
+    }
+    off += r.len;
+  }
+  return true;
+}
+
+void EspMesh::agg_add(const AggRecord &r, const uint8_t *payload) {
+  if (this->agg_buf_.size() + sizeof(r) + r.len > MESH_MAX_PAYLOAD)
+    this->flush_agg();
+  if (this->agg_buf_.empty()) {
+    this->agg_started_ = millis();
+    this->agg_prio_ = PRIO_BULK;
+  }
+  const uint8_t *rp = reinterpret_cast<const uint8_t *>(&r);
+  this->agg_buf_.insert(this->agg_buf_.end(), rp, rp + sizeof(r));
+  this->agg_buf_.insert(this->agg_buf_.end(), payload, payload + r.len);
+  this->agg_prio_ = std::min<uint8_t>(this->agg_prio_, r.flags & MESH_FLAG_PRIO_MASK);
+  this->agg_count_++;
+}
+
+void EspMesh::flush_agg() {
+  if (this->agg_buf_.empty())
+    return;
+  MeshHeader h;
+  if (this->agg_count_ == 1) {
+    // Un solo record: torna un PKT_DATA normale, senza overhead
+    AggRecord r;
+    memcpy(&r, this->agg_buf_.data(), sizeof(r));
+    this->fill_header(h, PKT_DATA, MESH_ROOT_DST, r.ttl, r.flags);
+    memcpy(h.src, r.src, 6);
+    h.seq = r.seq;
+    this->route_packet(&h, this->agg_buf_.data() + sizeof(r), r.len);
+  } else {
+    this->fill_header(h, PKT_AGG, MESH_ROOT_DST, MESH_DEFAULT_TTL, this->agg_prio_);
+    this->route_packet(&h, this->agg_buf_.data(), this->agg_buf_.size());
+    this->stats_.agg_frames++;
+    this->stats_.agg_records += this->agg_count_;
+  }
+  this->agg_buf_.clear();
+  this->agg_count_ = 0;
+}
+
+// Generatore della modalità di test: un frame ogni test_interval_ms_, con
+// recupero limitato se il loop è rimasto indietro
+void EspMesh::send_test_traffic(uint32_t now) {
+  if (this->next_test_ == 0 || now - this->next_test_ > TEST_MAX_BURST * this->test_interval_ms_)
+    this->next_test_ = now;
+  for (int i = 0; i < TEST_MAX_BURST && static_cast<int32_t>(now - this->next_test_) >= 0; i++) {
+    this->next_test_ += this->test_interval_ms_;
+    uint8_t pl[MESH_MAX_PAYLOAD] = {};
+    TestPayload t;
+    t.seq = this->test_seq_++;
+    t.sent_at = this->clock_synced_ ? this->mesh_time() : 0;
+    memcpy(pl, &t, sizeof(t));
+    this->send_to_root(PKT_TEST, pl, std::min<size_t>(this->test_size_, MESH_MAX_PAYLOAD), this->test_flags_);
+  }
+}
+
+void EspMesh::send_probe() {
+  uint8_t bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+  MeshHeader h;
+  this->fill_header(h, PKT_PROBE, bcast, 1, PRIO_CONTROL);
+  this->enqueue_tx(bcast, reinterpret_cast<uint8_t *>(&h), sizeof(h));
+}
+
+// Invio verso il Root virtuale (dst tutto a zero).
+// Oltre MESH_MAX_PAYLOAD il messaggio viene spezzato in PKT_FRAG numerati.
+void EspMesh::send_to_root(uint8_t type, const uint8_t *payload, size_t len, uint8_t flags) {
+  // Entità con indice confermato dal Root: un byte al posto dell'hash e
+  // valore nel codec negoziato alla registrazione
+  uint8_t compact[MESH_MAX_PAYLOAD];
+  if (type == PKT_DATA && len >= 4 && len <= sizeof(compact)) {
+    uint32_t hash;
+    memcpy(&hash, payload, 4);
+    auto it = this->entity_index_.find(hash);
+    if (it != this->entity_index_.end() && it->second < this->index_acked_.size() &&
+        this->index_acked_[it->second]) {
+      len = this->encode_record(it->second, payload, len, compact, flags);
+      payload = compact;
+    }
+  }
+
+  // Timestamp d'origine davanti al record, se richiesto e con orologio
+  // agganciato: sullo stack per un frame singolo, nel buffer dei frammenti
+  // altrimenti
+  bool stamp = this->timestamps_ && this->clock_synced_ && type == PKT_DATA;
+  uint32_t t = 0;
+  if (stamp) {
+    t = this->mesh_time();
+    flags |= MESH_FLAG_TIMESTAMP;
+  }
+  size_t total = len + (stamp ? 4 : 0);
+
+  if (total <= MESH_MAX_PAYLOAD) {
+    uint8_t stamped[MESH_MAX_PAYLOAD];
+    if (stamp) {
+      memcpy(stamped, &t, 4);
+      memcpy(stamped + 4, payload, len);
+      payload = stamped;
+      len = total;
+    }
+    MeshHeader h;
+    this->fill_header(h, type, MESH_ROOT_DST, MESH_DEFAULT_TTL, flags);
+    if (flags & MESH_FLAG_ACK_REQ) {
+      h.seq = this->tx_seq_++;
+      this->track_reliable(h, payload, len);
+    }
+    this->route_packet(&h, payload, len);
+    return;
+  }
+
+  // I frammenti si recuperano via NACK, non con l'ACK end-to-end
+  flags &= ~MESH_FLAG_ACK_REQ;
+
+  size_t count = (total + FRAG_CHUNK - 1) / FRAG_CHUNK;
+  if (count > FRAG_MAX_COUNT) {
+    ESP_LOGW(TAG, "Message too large (%zu bytes), dropped", total);
+    return;
+  }
+
+  FragTx msg;
+  msg.msg_id = this->frag_msg_id_++;
+  msg.inner_type = type;
+  msg.flags = flags;
+  msg.data.reserve(total);
+  if (stamp)
+    msg.data.assign(reinterpret_cast<const uint8_t *>(&t), reinterpret_cast<const uint8_t *>(&t) + 4);
+  msg.data.insert(msg.data.end(), payload, payload + len);
+
+  for (uint8_t i = 0; i < count; i++) {
+    this->send_fragment(msg, i);
+  }
+
+  // Teniamo gli ultimi messaggi per la ritrasmissione selettiva
+  this->frag_tx_.push_back(std::move(msg));
+  if (this->frag_tx_.size() > FRAG_TX_CACHE)
+    this->frag_tx_.pop_front();
+}
+
+void EspMesh::send_fragment(const FragTx &msg, uint8_t index) {
+  size_t count = (msg.data.size() + FRAG_CHUNK - 1) / FRAG_CHUNK;
+  size_t offset = index * FRAG_CHUNK;
+  size_t chunk = std::min(msg.data.size() - offset, size_t(FRAG_CHUNK));
+
+  uint8_t pl[MESH_MAX_PAYLOAD];
+  FragHeader fh;
+  fh.msg_id = msg.msg_id;
+  fh.index = index;
+  fh.count = count;
+  fh.inner_type = msg.inner_type;
+  memcpy(pl, &fh, sizeof(fh));
+  memcpy(pl + sizeof(fh), msg.data.data() + offset, chunk);
+
+  MeshHeader h;
+  this->fill_header(h, PKT_FRAG, MESH_ROOT_DST, MESH_DEFAULT_TTL, msg.flags);
+  this->route_packet(&h, pl, sizeof(fh) + chunk);
+}
+
+void EspMesh::handle_frag_nack(const FragNack *n) {
+  for (const auto &msg : this->frag_tx_) {
+    if (msg.msg_id != n->msg_id)
+      continue;
+    size_t count = (msg.data.size() + FRAG_CHUNK - 1) / FRAG_CHUNK;
+    for (uint8_t i = 0; i < count; i++) {
+      if (n->missing & (1 << i))
+        this->send_fragment(msg, i);
+    }
+    return;
+  }
+  ESP_LOGD(TAG, "NACK for expired message %u", n->msg_id);
+}
+
+void EspMesh::send_registration(uint32_t hash, char type_id, const char *name, const char *unit,
+                                const char *dev_class, uint8_t codec, int8_t decimals,
+                                const std::vector<std::string> *options) {
+  size_t name_len = strlen(name) + 1;
+  size_t unit_len = strlen(unit) + 1;
+  size_t dc_len = strlen(dev_class) + 1;
+  // Opzioni della select in coda, una per stringa: il Root costruisce lo
+  // stesso dizionario statico e i dati viaggiano come codice
+  size_t opt_len = 0;
+  size_t opt_count = 0;
+  if (options != nullptr) {
+    opt_count = std::min<size_t>(options->size(), DICT_MAX_CODES - DICT_LEARNED);
+    for (size_t i = 0; i < opt_count; i++)
+      opt_len += (*options)[i].size() + 1;
+  }
+
+  std::vector<uint8_t> pl(sizeof(RegPayload) + name_len + unit_len + dc_len + opt_len);
+  RegPayload p;
+  p.entity_hash = hash;
+  p.type_id = type_id;
+  p.index = ENTITY_INDEX_MAX;  // Assegnato nel contesto mesh, vedi send_local()
+  p.codec = codec;
+  p.decimals = decimals;
+  memcpy(pl.data(), &p, sizeof(p));
+
+  uint8_t *w = pl.data() + sizeof(p);
+  memcpy(w, name, name_len);
+  memcpy(w + name_len, unit, unit_len);
+  memcpy(w + name_len + unit_len, dev_class, dc_len);
+  w += name_len + unit_len + dc_len;
+  for (size_t i = 0; i < opt_count; i++) {
+    memcpy(w, (*options)[i].c_str(), (*options)[i].size() + 1);
+    w += (*options)[i].size() + 1;
+  }
+
+  uint8_t flags = PRIO_BULK;
+  if (this->reliable_mask_ & (1u << RELIABLE_REG_BIT))
+    flags |= MESH_FLAG_ACK_REQ;
+  this->submit(PKT_REG, pl.data(), pl.size(), flags);
+}
+
+// Registrazione già serializzata da __init__.py: l'indice lo mette send_local()
+void EspMesh::send_registration(const ManifestEntry &m) {
+  uint8_t flags = PRIO_BULK;
+  if (this->reliable_mask_ & (1u << RELIABLE_REG_BIT))
+    flags |= MESH_FLAG_ACK_REQ;
+  this->submit(PKT_REG, m.reg, m.reg_len, flags);
+}
+
+// Contesto mesh. Le registrazioni arrivano dal loop principale senza indice:
+// indice e stato del codec appartengono alla mesh e si assegnano qui
+void EspMesh::send_local(uint8_t type, const uint8_t *payload, size_t len, uint8_t flags) {
+  if (type != PKT_REG || len < sizeof(RegPayload)) {
+    this->send_to_root(type, payload, len, flags);
+    return;
+  }
+  std::vector<uint8_t> reg(payload, payload + len);
+  reg[offsetof(RegPayload, index)] = this->prepare_registration(reg.data(), len);
+  this->send_to_root(PKT_REG, reg.data(), len, flags);
+}
+
+// Campi dalla registrazione serializzata: header fisso, nome, unità, device
+// class, poi le opzioni
+uint8_t EspMesh::prepare_registration(const uint8_t *reg, size_t len) {
+  RegPayload p;
+  memcpy(&p, reg, sizeof(p));
+  uint32_t hash = p.entity_hash;
+  std::vector<std::string> opts;
+  const char *end = reinterpret_cast<const char *>(reg + len);
+  const char *w = reinterpret_cast<const char *>(reg + sizeof(p));
+  for (int skip = 0; w < end; skip++) {
+    size_t n = strnlen(w, end - w);
+    if (skip >= 3)
+      opts.emplace_back(w, n);
+    w += n + 1;
+  }
+
+  // Indice assegnato alla prima registrazione e mantenuto: il Root lo
+  // conferma con PKT_REG_ACK prima che i dati possano usarlo
+  auto it = this->entity_index_.find(hash);
+  if (it == this->entity_index_.end() && this->entity_index_.size() < ENTITY_INDEX_MAX)
+    it = this->entity_index_.emplace(hash, this->entity_index_.size()).first;
+
+  // Il codec vale da quando il Root conferma l'indice; la base dei delta
+  // riparte da zero con ogni (ri)registrazione
+  CodecState &st = this->codecs_[hash];
+  st.codec = p.codec;
+  st.decimals = p.decimals;
+  st.base_valid = false;
+  // Le voci apprese valevano per il Root precedente: si riparte dalle opzioni
+  st.dict = std::move(opts);
+  st.dict_fixed = st.dict.size();
+  st.dict_used.assign(st.dict.size(), 0);
+  st.dict_state.assign(st.dict.size(), DICT_ST_KNOWN);
+  st.last_code = DICT_LITERAL;
+  st.type_id = p.type_id;
+  return it != this->entity_index_.end() ? it->second : ENTITY_INDEX_MAX;
+}
+
+void EspMesh::handle_reg_ack(const RegAck *a) {
+  if (a->index >= ENTITY_INDEX_MAX)
+    return;
+  if (a->status == REG_ACK_UNKNOWN) {
+    // Il Root non conosce più i nostri indici: tutti tornano all'hash
+    // finché la ri-registrazione non li riconferma
+    std::fill(this->index_acked_.begin(), this->index_acked_.end(), false);
+    uint32_t now = millis();
+    if (now - this->last_reg_resync_ >= REG_RESYNC_MS) {
+      this->last_reg_resync_ = now;
+      ESP_LOGW(TAG, "Root lost entity index %u, re-registering", a->index);
+      this->request_rescan();
+    }
+    return;
+  }
+  auto it = this->entity_index_.find(a->entity_hash);
+  if (it == this->entity_index_.end() || it->second != a->index)
+    return;  // Conferma di un'associazione che non è la nostra
+  if (this->index_acked_.size() <= a->index)
+    this->index_acked_.resize(a->index + 1, false);
+  this->index_acked_[a->index] = true;
+}
+
+// Record [hash][float32][extra] -> [indice][valore codificato][extra]
+size_t EspMesh::encode_record(uint8_t index, const uint8_t *payload, size_t len, uint8_t *out, uint8_t &flags) {
+  out[0] = index;
+  flags |= MESH_FLAG_INDEX;
+  uint32_t hash;
+  memcpy(&hash, payload, 4);
+  auto it = this->codecs_.find(hash);
+  if (it != this->codecs_.end() && (it->second.codec & CODEC_MASK) == CODEC_DICT)
+    return 1 + this->encode_text(it->second, payload + 4, len - 4, out + 1, flags);
+  if (it == this->codecs_.end() || it->second.codec == CODEC_F32 || len < 8) {
+    memcpy(out + 1, payload + 4, len - 4);
+    return len - 3;
+  }
+
+  CodecState &st = it->second;
+  float v;
+  memcpy(&v, payload + 4, 4);
+  size_t n = 1;
+  int32_t fx;
+  // Delta solo su frame confermati: la base è l'ultimo assoluto che il Root ha ACKato
+  if ((st.codec & CODEC_DELTA) && (flags & MESH_FLAG_ACK_REQ) && st.base_valid && st.deltas < DELTA_REFRESH &&
+      to_fixed16(v, st.decimals, fx) && fx - st.base >= INT8_MIN && fx - st.base <= INT8_MAX) {
+    out[n++] = st.base_seq & 0xFF;
+    out[n++] = static_cast<uint8_t>(static_cast<int8_t>(fx - st.base));
+    st.deltas++;
+    flags |= MESH_FLAG_DELTA;
+  } else {
+    n += encode_value(st.codec, st.decimals, v, out + n);
+  }
+  memcpy(out + n, payload + 8, len - 8);
+  return n + len - 8;
+}
+
+// Voce di dizionario insegnata nel record, o nullptr
+static const uint8_t *dict_teach(const RtxEntry &e, const CodecState *st, size_t off) {
+  if (st == nullptr || (st->codec & CODEC_MASK) != CODEC_DICT || e.payload.size() < off + 3 ||
+      e.payload[off + 1] != DICT_LEARN)
+    return nullptr;
+  return e.payload.data() + off + 2;
+}
+
+// ACK di un record: un assoluto con codec delta diventa la nuova base, un
+// insegnamento rende la voce utilizzabile come codice
+void EspMesh::codec_acked(const RtxEntry &e) {
+  if (e.type != PKT_DATA || !(e.flags & MESH_FLAG_INDEX) || (e.flags & MESH_FLAG_DELTA))
+    return;
+  size_t off = (e.flags & MESH_FLAG_TIMESTAMP) ? 4 : 0;
+  if (e.payload.size() < off + 3)
+    return;
+  CodecState *st = this->codec_by_index(e.payload[off], nullptr);
+  if (const uint8_t *t = dict_teach(e, st, off)) {
+    // La voce conta solo se lo slot insegna ancora la stessa stringa
+    uint8_t code = t[0];
+    size_t n = e.payload.size() - (t + 1 - e.payload.data());
+    if (code < st->dict.size() && st->dict_state[code] == DICT_ST_TEACHING && st->dict[code].size() == n &&
+        memcmp(st->dict[code].data(), t + 1, n) == 0)
+      st->dict_state[code] = DICT_ST_KNOWN;
+    return;
+  }
+  if (st == nullptr || !(st->codec & CODEC_DELTA))
+    return;
+  int16_t w;
+  memcpy(&w, e.payload.data() + off + 1, 2);
+  if (w == INT16_MIN || (st->base_valid && static_cast<int16_t>(e.seq - st->base_seq) <= 0))
+    return;  // Escape float32, o ACK di un assoluto più vecchio della base
+  st->base = w;
+  st->base_seq = e.seq;
+  st->base_valid = true;
+  st->deltas = 0;
+}
+
+// Record abbandonato senza ACK: la voce che insegnava torna da insegnare
+void EspMesh::codec_lost(const RtxEntry &e) {
+  if (e.type != PKT_DATA || !(e.flags & MESH_FLAG_INDEX))
+    return;
+  size_t off = (e.flags & MESH_FLAG_TIMESTAMP) ? 4 : 0;
+  if (e.payload.size() < off + 3)
+    return;
+  CodecState *st = this->codec_by_index(e.payload[off], nullptr);
+  const uint8_t *t = dict_teach(e, st, off);
+  if (t != nullptr && t[0] < st->dict.size() && st->dict_state[t[0]] == DICT_ST_TEACHING)
+    st->dict_state[t[0]] = DICT_ST_UNKNOWN;
+}
+
+CodecState *EspMesh::codec_by_index(uint8_t index, uint32_t *hash) {
+  for (const auto &kv : this->entity_index_) {
+    if (kv.second != index)
+      continue;
+    auto it = this->codecs_.find(kv.first);
+    if (it == this->codecs_.end())
+      return nullptr;
+    if (hash != nullptr)
+      *hash = kv.first;
+    return &it->second;
+  }
+  return nullptr;
+}
+
+uint32_t EspMesh::manifest() {
+  uint32_t m = 0;
+  for (const auto &kv : this->codecs_)
+    m ^= manifest_part(kv.first, kv.second.type_id, kv.second.codec, kv.second.decimals);
+  return m;
+}
+
+// Stato testuale: codice se il Root ha confermato la stringa, altrimenti
+// letterale che la insegna (voce nuova o LRU tra le apprese). L'insegnamento
+// viaggia sempre con ACK: finché non arriva, le ripetizioni vanno letterali
+size_t EspMesh::encode_text(CodecState &st, const uint8_t *text, size_t len, uint8_t *out, uint8_t &flags) {
+  std::string s(reinterpret_cast<const char *>(text), len);
+  size_t code = std::find(st.dict.begin(), st.dict.end(), s) - st.dict.begin();
+  if (code == st.dict.size() && len > 0 && len <= DICT_MAX_LEN) {
+    if (st.dict.size() < (size_t) (st.dict_fixed + DICT_LEARNED) && st.dict.size() < DICT_MAX_CODES) {
+      st.dict.push_back(s);
+      st.dict_used.push_back(0);
+      st.dict_state.push_back(DICT_ST_UNKNOWN);
+    } else {
+      // LRU tra le voci apprese non in volo: uno slot che sta insegnando
+      // non si riusa finché il suo ACK (o l'abbandono) non è arrivato
+      size_t victim = st.dict.size();
+      for (size_t i = st.dict_fixed; i < st.dict.size(); i++) {
+        if (st.dict_state[i] != DICT_ST_TEACHING && (victim == st.dict.size() || st.dict_used[i] < st.dict_used[victim]))
+          victim = i;
+      }
+      if (victim < st.dict.size()) {
+        code = victim;
+        st.dict[code] = s;
+        st.dict_state[code] = DICT_ST_UNKNOWN;
+      }
+    }
+  }
+  if (code >= st.dict.size() || st.dict_state[code] == DICT_ST_TEACHING) {
+    if (code < st.dict.size())
+      st.dict_used[code] = ++this->dict_clock_;
+    st.last_code = DICT_LITERAL;
+    out[0] = DICT_LITERAL;
+    memcpy(out + 1, text, len);
+    return 1 + len;
+  }
+
+  st.dict_used[code] = ++this->dict_clock_;
+  st.last_code = code;
+  if (st.dict_state[code] == DICT_ST_KNOWN) {
+    out[0] = code;
+    return 1;
+  }
+  st.dict_state[code] = DICT_ST_TEACHING;
+  flags |= MESH_FLAG_ACK_REQ;
+  out[0] = DICT_LEARN;
+  out[1] = code;
+  memcpy(out + 2, text, len);
+  return 2 + len;
+}
+
+// Il Root ha perso una voce (frame d'insegnamento perso, o riavvio): la
+// reinsegniamo al prossimo uso, e subito se era lo stato corrente
+void EspMesh::handle_dict_miss(const DictMiss *m) {
+  uint32_t hash;
+  CodecState *st = this->codec_by_index(m->index, &hash);
+  if (st == nullptr || m->code >= st->dict.size())
+    return;
+  if (st->dict_state[m->code] == DICT_ST_KNOWN)
+    st->dict_state[m->code] = DICT_ST_UNKNOWN;  // Un insegnamento in volo resta tale
+  if (m->code != st->last_code)
+    return;
+  const std::string &s = st->dict[m->code];
+  std::vector<uint8_t> pl(4 + s.size());
+  memcpy(pl.data(), &hash, 4);
+  memcpy(pl.data() + 4, s.data(), s.size());
+  this->send_to_root(PKT_DATA, pl.data(), pl.size(), PRIO_STATE);
+}
+
+// --- OTA (NODO) ---
+void EspMesh::handle_ota_offer(const OtaOffer *o) {
+  OtaRx &x = this->ota_;
+  if (x.reboot_at != 0)
+    return;  // Immagine già scritta, riavvio imminente
+
+  // Stessa immagine: si riprende da dove eravamo (Root riavviato, nuova sessione)
+  if (x.active && memcmp(x.sha256, o->sha256, 32) == 0) {
+    x.session = o->session;
+    x.multicast = o->multicast;
+    this->send_ota_req(true);
+    return;
+  }
+  if (x.active) {
+    esp_ota_abort(x.handle);
+    mbedtls_sha256_free(&x.sha);
+    x.active = false;
+  }
+
+  x.session = o->session;
+  x.base = 0;
+  x.count = 0;
+  memcpy(x.sha256, o->sha256, 32);
+
+  // Già installata: confermiamo senza scaricare
+  OtaInstalled installed;
+  auto pref = global_preferences->make_preference<OtaInstalled>(fnv1_hash("esp_mesh_ota"), true);
+  if (pref.load(&installed) && memcmp(installed.sha256, o->sha256, 32) == 0) {
+    x.status = OTA_ST_DONE;
+    this->send_ota_req(false);
+    return;
+  }
+
+  x.part = esp_ota_get_next_update_partition(nullptr);
+  if (x.part == nullptr || o->size == 0 || o->size > x.part->size ||
+      esp_ota_begin(x.part, OTA_WITH_SEQUENTIAL_WRITES, &x.handle) != ESP_OK) {
+    ESP_LOGE(TAG, "OTA offer of %u bytes rejected", o->size);
+    x.status = OTA_ST_ERROR;
+    this->send_ota_req(false);
+    return;
+  }
+
+  x.active = true;
+  x.multicast = o->multicast;
+  x.size = o->size;
+  x.count = (o->size + OTA_BLOCK - 1) / OTA_BLOCK;
+  x.have = 0;
+  x.req_hi = 0;
+  x.last_rx = millis();
+  x.status = OTA_ST_RUNNING;
+  mbedtls_sha256_init(&x.sha);
+  mbedtls_sha256_starts(&x.sha, 0);
+  ESP_LOGI(TAG, "OTA started: %u bytes in %u blocks%s", x.size, x.count, x.multicast ? " (multicast)" : "");
+  this->send_ota_req(false);
+}
+
+// Conferma cumulativa (base) + blocchi da mandare. Normalmente solo quelli
+// mai chiesti, così la finestra scorre senza doppioni; dopo un timeout
+// (retry) tutti i mancanti.
+void EspMesh::send_ota_req(bool retry) {
+  OtaRx &x = this->ota_;
+  OtaReq r;
+  r.session = x.session;
+  r.base = x.base;
+  r.status = x.status;
+  r.missing = 0;
+  if (x.active) {
+    uint32_t end = std::min<uint32_t>(x.base + OTA_WINDOW, x.count);
+    uint32_t from = retry ? x.base : std::max(x.req_hi, x.base);
+    for (uint32_t b = from; b < end; b++) {
+      if (!(x.have & (1 << (b - x.base))))
+        r.missing |= 1 << (b - x.base);
+    }
+    x.req_hi = end;
+  }
+  x.last_req = millis();
+  this->send_to_root(PKT_OTA_REQ, reinterpret_cast<uint8_t *>(&r), sizeof(r), PRIO_CONTROL);
+}
+
+void EspMesh::handle_ota_data(const MeshHeader *h, const uint8_t *payload, int len) {
+  if (len <= (int) sizeof(OtaData))
+    return;
+  OtaData d;
+  memcpy(&d, payload, sizeof(d));
+  const uint8_t *data = payload + sizeof(d);
+  uint8_t dlen = len - sizeof(d);
+
+  // Multicast: ogni repeater ritrasmette un blocco una volta sola (la cache
+  // fa da filtro duplicati), e solo se ha figli che possono averne bisogno
+  if (h->dst[0] == 0xFF) {
+    bool seen = this->ota_cache_get(d.session, d.block) != nullptr;
+    this->ota_cache_put(d.session, d.block, data, dlen);
+    if (!seen && h->ttl > 0 && this->has_children()) {
+      MeshHeader fwd = *h;
+      fwd.ttl--;
+      this->route_packet(&fwd, payload, len);
+    }
+  }
+
+  OtaRx &x = this->ota_;
+  if (!x.active || d.session != x.session)
+    return;
+  if (d.block < x.base || d.block >= x.base + OTA_WINDOW || d.block >= x.count)
+    return;
+  uint32_t expected = d.block == x.count - 1 ? x.size - d.block * OTA_BLOCK : OTA_BLOCK;
+  uint8_t bit = 1 << (d.block - x.base);
+  if (dlen != expected || (x.have & bit))
+    return;
+  memcpy(x.buf[d.block % OTA_WINDOW], data, dlen);
+  x.have |= bit;
+  x.last_rx = millis();
+
+  // Scrittura in ordine: la flash vede un flusso sequenziale
+  while (x.have & 1) {
+    uint32_t blen = x.base == x.count - 1 ? x.size - x.base * OTA_BLOCK : OTA_BLOCK;
+    const uint8_t *b = x.buf[x.base % OTA_WINDOW];
+    if (esp_ota_write(x.handle, b, blen) != ESP_OK) {
+      ESP_LOGE(TAG, "OTA write failed at block %u", x.base);
+      esp_ota_abort(x.handle);
+      mbedtls_sha256_free(&x.sha);
+      x.active = false;
+      x.status = OTA_ST_ERROR;
+      this->send_ota_req(false);
+      return;
+    }
+    mbedtls_sha256_update(&x.sha, b, blen);
+    x.have >>= 1;
+    x.base++;
+    if (x.base == x.count) {
+      this->finish_ota();
+      return;
+    }
+  }
+
+  // Mezza finestra libera: chiediamo i blocchi successivi
+  if (x.req_hi < x.count && x.base + OTA_WINDOW / 2 >= x.req_hi)
+    this->send_ota_req(false);
+}
+
+void EspMesh::finish_ota() {
+  OtaRx &x = this->ota_;
+  uint8_t digest[32];
+  mbedtls_sha256_finish(&x.sha, digest);
+  mbedtls_sha256_free(&x.sha);
+  x.active = false;
+
+  if (memcmp(digest, x.sha256, 32) != 0) {
+    ESP_LOGE(TAG, "OTA image hash mismatch, discarded");
+    esp_ota_abort(x.handle);
+    x.status = OTA_ST_HASH_FAIL;
+  } else if (esp_ota_end(x.handle) != ESP_OK || esp_ota_set_boot_partition(x.part) != ESP_OK) {
+    ESP_LOGE(TAG, "OTA image rejected by bootloader");
+    x.status = OTA_ST_ERROR;
+  } else {
+    OtaInstalled installed;
+    memcpy(installed.sha256, x.sha256, 32);
+    global_preferences->make_preference<OtaInstalled>(fnv1_hash("esp_mesh_ota"), true).save(&installed);
+    global_preferences->sync();
+    ESP_LOGI(TAG, "OTA image verified, rebooting");
+    x.status = OTA_ST_DONE;
+    x.reboot_at = millis() + OTA_REBOOT_DELAY_MS;
+  }
+  this->send_ota_req(false);
+}
+
+void EspMesh::check_ota(uint32_t now) {
+  OtaRx &x = this->ota_;
+  if (x.reboot_at != 0 && static_cast<int32_t>(now - x.reboot_at) >= 0)
+    esp_restart();
+  if (!x.active)
+    return;
+  // Root sparito a lungo: si rinuncia, un'offerta successiva riparte da zero
+  if (now - x.last_rx > OTA_NODE_TIMEOUT_MS) {
+    ESP_LOGW(TAG, "OTA stalled at block %u/%u, aborting", x.base, x.count);
+    esp_ota_abort(x.handle);
+    mbedtls_sha256_free(&x.sha);
+    x.active = false;
+    return;
+  }
+  if (now - x.last_req > OTA_REQ_TIMEOUT_MS && this->hop_count_ != 0xFF)
+    this->send_ota_req(true);
+}
+
+bool EspMesh::has_children() {
+  uint32_t now = millis();
+  for (auto &kv : this->neighbors_) {
+    if (kv.second.is_child && now - kv.second.last_seen < TOPO_NEIGHBOR_TTL_MS)
+      return true;
+  }
+  return false;
+}
+
+void EspMesh::ota_cache_put(uint16_t session, uint32_t block, const uint8_t *data, uint8_t len) {
+  if (len > OTA_BLOCK || this->ota_cache_get(session, block) != nullptr)
+    return;
+  if (this->ota_cache_.size() >= OTA_REPEATER_CACHE)
+    this->ota_cache_.pop_front();
+  this->ota_cache_.emplace_back();
+  OtaCacheEntry &e = this->ota_cache_.back();
+  e.session = session;
+  e.block = block;
+  e.len = len;
+  memcpy(e.data, data, len);
+}
+
+const OtaCacheEntry *EspMesh::ota_cache_get(uint16_t session, uint32_t block) {
+  for (auto &e : this->ota_cache_) {
+    if (e.session == session && e.block == block)
+      return &e;
+  }
+  return nullptr;
+}
+
+// Richiesta di un discendente: i blocchi in cache partono da qui. Se non
+// resta nulla da chiedere al Root la richiesta si ferma (false).
+bool EspMesh::ota_serve_cached(const MeshHeader *h, OtaReq *r) {
+  for (uint8_t i = 0; i < OTA_WINDOW; i++) {
+    if (!(r->missing & (1 << i)))
+      continue;
+    const OtaCacheEntry *e = this->ota_cache_get(r->session, r->base + i);
+    if (e == nullptr)
+      continue;
+    uint8_t buf[sizeof(OtaData) + OTA_BLOCK];
+    OtaData d{e->session, e->block};
+    memcpy(buf, &d, sizeof(d));
+    memcpy(buf + sizeof(d), e->data, e->len);
+    MeshHeader dh;
+    this->fill_header(dh, PKT_OTA_DATA, h->src, MESH_DEFAULT_TTL, PRIO_BULK);
+    this->route_packet(&dh, buf, sizeof(d) + e->len);
+    r->missing &= ~(1 << i);
+  }
+  return r->missing != 0 || r->status != OTA_ST_RUNNING;
+}
+
+// --- ACK END-TO-END (NODO) ---
+void EspMesh::track_reliable(const MeshHeader &h, const uint8_t *payload, size_t len) {
+  if (this->rtx_.size() >= RTX_BUFFER) {
+    ESP_LOGW(TAG, "Retransmit buffer full, giving up on seq %u", this->rtx_.front().seq);
+    this->stats_.rtx_dropped++;
+    this->codec_lost(this->rtx_.front());
+    this->rtx_.pop_front();
+  }
+  uint32_t now = millis();
+  RtxEntry e;
+  e.seq = h.seq;
+  e.type = h.type;
+  e.flags = h.flags;
+  e.retries = 0;
+  e.first_sent = now;
+  e.last_sent = now;
+  e.rto = this->current_rto();
+  e.payload.assign(payload, payload + len);
+  this->rtx_.push_back(std::move(e));
+}
+
+void EspMesh::check_retransmit(uint32_t now) {
+  if (this->hop_count_ == 0xFF)
+    return;  // Senza parent le ritrasmissioni andrebbero perse
+  for (auto it = this->rtx_.begin(); it != this->rtx_.end();) {
+    if (now - it->last_sent < it->rto) {
+      ++it;
+      continue;
+    }
+    if (it->retries >= RTX_MAX_RETRIES) {
+      ESP_LOGW(TAG, "No ACK for seq %u after %u retries", it->seq, it->retries);
+      this->stats_.rtx_dropped++;
+      this->codec_lost(*it);
+      it = this->rtx_.erase(it);
+      continue;
+    }
+    it->retries++;
+    it->last_sent = now;
+    it->rto = std::min<uint32_t>(it->rto * 2, RTO_MAX_MS);  // Backoff esponenziale
+
+    MeshHeader h;
+    this->fill_header(h, it->type, MESH_ROOT_DST, MESH_DEFAULT_TTL, it->flags);
+    h.seq = it->seq;
+    this->route_packet(&h, it->payload.data(), it->payload.size());
+    this->stats_.rtx_sent++;
+    ++it;
+  }
+}
+
+void EspMesh::handle_ack(const AckPayload *a) {
+  uint32_t now = millis();
+  for (auto it = this->rtx_.begin(); it != this->rtx_.end();) {
+    uint16_t d = a->seq - it->seq;
+    if (d >= ACK_WINDOW || !(a->window & (1u << d))) {
+      ++it;
+      continue;
+    }
+    // Karn: solo i frame mai ritrasmessi danno un campione RTT affidabile
+    if (it->retries == 0)
+      this->update_rtt(now - it->first_sent);
+    this->codec_acked(*it);
+    it = this->rtx_.erase(it);
+  }
+}
+
+void EspMesh::update_rtt(uint32_t sample) {
+  RttEstimator &r = this->rtt_[std::min<uint8_t>(this->hop_count_, RTT_HOP_BUCKETS - 1)];
+  if (r.srtt == 0) {
+    r.srtt = sample;
+    r.rttvar = sample / 2;
+  } else {
+    uint32_t err = (r.srtt > sample) ? r.srtt - sample : sample - r.srtt;
+    r.rttvar = (3 * r.rttvar + err) / 4;
+    r.srtt = (7 * r.srtt + sample) / 8;
+  }
+}
+
+// RTO alla Jacobson, per la profondità attuale del nodo nella mesh
+uint32_t EspMesh::current_rto() {
+  uint8_t hops = std::min<uint8_t>(this->hop_count_, RTT_HOP_BUCKETS - 1);
+  const RttEstimator &r = this->rtt_[hops];
+  uint32_t rto = (r.srtt == 0) ? RTO_INIT_PER_HOP_MS * std::max<uint8_t>(hops, 1) : r.srtt + 4 * r.rttvar;
+  return std::max<uint32_t>(RTO_MIN_MS, std::min<uint32_t>(rto, RTO_MAX_MS));
+}
+
+// Classe di priorità dei dati di stato, per tipo di entità
+static uint8_t entity_priority(EntityType type) {
+  switch (type) {
+    case ENTITY_TYPE_BINARY_SENSOR:
+    case ENTITY_TYPE_BUTTON:
+    case ENTITY_TYPE_EVENT:
+    case ENTITY_TYPE_LOCK:
+    case ENTITY_TYPE_ALARM_CONTROL_PANEL:
+      return PRIO_CONTROL;
+    case ENTITY_TYPE_SENSOR:
+    case ENTITY_TYPE_TEXT_SENSOR:
+      return PRIO_BULK;
+    default:
+      return PRIO_STATE;
+  }
+}
+
+// Priorità + eventuale richiesta di ACK, configurabile per tipo
+uint8_t EspMesh::entity_flags(EntityType type) {
+  uint8_t flags = entity_priority(type);
+  if (this->reliable_mask_ & (1u << type))
+    flags |= MESH_FLAG_ACK_REQ;
+  return flags;
+}
+
+// --- TRATTI DELLE ENTITÀ ---
+// Ogni tipo esportato descrive una volta sola i campi di registrazione, come
+// si aggancia al suo stato e quali comandi accetta; registrazione, invio e
+// comandi sono poi un solo template per tutti. Solo i tipi USE_* abilitati
+// vengono compilati.
+
+// Campi di registrazione noti solo a runtime
+struct RegFields {
+  const char *unit = "";
+  const char *dev_class = "";
+  uint8_t codec = CODEC_F32;
+  int8_t decimals = 0;
+  std::vector<std::string> options;
+};
+
+// Default: nessun campo extra, nessun comando
+struct EntityTraitsBase {
+  template<typename E> static void reg(E *, RegFields &, uint8_t) {}
+  template<typename E> static void command(E *, const CmdPayload &) {}
+};
+
+template<typename E> struct EntityTraits;
+
+// Valore float (sensor, number, posizioni): il codec lo compatta in encode_record
+template<typename F> static void send_float(F &send, float v) {
+  send(reinterpret_cast<const uint8_t *>(&v), sizeof(v));
+}
+
+template<typename F> static void send_text(F &send, const std::string &s) {
+  send(reinterpret_cast<const uint8_t *>(s.data()), s.size());
+}
+
+#ifdef USE_BINARY_SENSOR
+template<> struct EntityTraits<binary_sensor::BinarySensor> : EntityTraitsBase {
+  static constexpr char ID = 'B';
+  static void reg(binary_sensor::BinarySensor *bs, RegFields &r, uint8_t) {
+    r.dev_class = bs->get_device_class_ref().c_str();
+  }
+  template<typename F> static void attach(binary_sensor::BinarySensor *bs, F send) {
+    bs->add_on_state_callback([send](bool state) {
+      uint8_t v = state;
+      send(&v, 1);
+    });
+  }
+};
+#endif
+
+#ifdef USE_SENSOR
+template<> struct EntityTraits<sensor::Sensor> : EntityTraitsBase {
+  static constexpr char ID = 'S';
+  // Range ignoto: int16 con le cifre dichiarate (escape a float32 se esce),
+  // delta sulla base confermata quando i dati del sensore sono affidabili
+  static void reg(sensor::Sensor *s, RegFields &r, uint8_t flags) {
+    r.unit = s->get_unit_of_measurement_ref().c_str();
+    r.dev_class = s->get_device_class_ref().c_str();
+    r.decimals = s->get_accuracy_decimals();
+    if (r.decimals >= 0 && r.decimals <= 2)
+      r.codec = CODEC_I16 | ((flags & MESH_FLAG_ACK_REQ) ? CODEC_DELTA : 0);
+  }
+  template<typename F> static void attach(sensor::Sensor *s, F send) {
+    s->add_on_state_callback([send](float v) mutable { send_float(send, v); });
+  }
+};
+#endif
+
+#ifdef USE_SWITCH
+template<> struct EntityTraits<switch_::Switch> : EntityTraitsBase {
+  static constexpr char ID = 'W';
+  template<typename F> static void attach(switch_::Switch *sw, F send) {
+    sw->add_on_state_callback([send](bool state) {
+      uint8_t v = state;
+      send(&v, 1);
+    });
+  }
+  static void command(switch_::Switch *sw, const CmdPayload &c) {
+    if (c.action == CMD_ON) {
+      sw->turn_on();
+    } else if (c.action == CMD_OFF) {
+      sw->turn_off();
+    } else if (c.action == CMD_TOGGLE) {
+      sw->toggle();
+    }
+  }
+};
+#endif
+
+#ifdef USE_BUTTON
+template<> struct EntityTraits<button::Button> : EntityTraitsBase {
+  static constexpr char ID = 'N';
+  template<typename F> static void attach(button::Button *btn, F send) {
+    btn->add_on_press_callback([send]() { send(nullptr, 0); });
+  }
+  static void command(button::Button *btn, const CmdPayload &c) {
+    if (c.action == CMD_PRESS)
+      btn->press();
+  }
+};
+#endif
+
+#ifdef USE_TEXT_SENSOR
+template<> struct EntityTraits<text_sensor::TextSensor> : EntityTraitsBase {
+  static constexpr char ID = 'T';
+  static void reg(text_sensor::TextSensor *ts, RegFields &r, uint8_t) {
+    r.dev_class = ts->get_device_class_ref().c_str();
+    r.codec = CODEC_DICT;
+  }
+  template<typename F> static void attach(text_sensor::TextSensor *ts, F send) {
+    ts->add_on_state_callback([send](const std::string &state) mutable { send_text(send, state); });
+  }
+};
+#endif
+
+#ifdef USE_FAN
+template<> struct EntityTraits<fan::Fan> : EntityTraitsBase {
+  static constexpr char ID = 'F';
+  // On/off + velocità riportata a 0-255 (ESPHome la conta in livelli)
+  template<typename F> static void attach(fan::Fan *f, F send) {
+    f->add_on_state_callback([f, send]() {
+      int count = std::max(f->get_traits().supported_speed_count(), 1);
+      uint8_t v[2] = {static_cast<uint8_t>(f->state ? 1 : 0),
+                      static_cast<uint8_t>(std::min(f->speed, count) * 255 / count)};
+      send(v, 2);
+    });
+  }
+  static void command(fan::Fan *f, const CmdPayload &c) {
+    if (c.action == CMD_SET) {
+      int speed = lroundf(c.value * f->get_traits().supported_speed_count());
+      (speed > 0 ? f->turn_on().set_speed(speed) : f->turn_off()).perform();
+      return;
+    }
+    if (c.action != CMD_ON && c.action != CMD_OFF && c.action != CMD_TOGGLE)
+      return;
+    bool on = c.action == CMD_ON || (c.action == CMD_TOGGLE && !f->state);
+    (on ? f->turn_on() : f->turn_off()).perform();
+  }
+};
+#endif
+
+#if defined(USE_COVER) || defined(USE_VALVE)
+// Cover e valvole: posizione 0-1, aperto/chiuso o posizione esplicita
+template<typename E> struct PositionTraits : EntityTraitsBase {
+  static void reg(E *, RegFields &r, uint8_t) {
+    r.unit = "%";
+    r.codec = codec_for_range(0.0f, 1.0f, 0.01f, r.decimals);
+  }
+  template<typename F> static void attach(E *e, F send) {
+    e->add_on_state_callback([e, send]() mutable { send_float(send, e->position); });
+  }
+  static void command(E *e, const CmdPayload &c) {
+    if (c.action != CMD_ON && c.action != CMD_OFF && c.action != CMD_SET)
+      return;
+    float pos = c.action == CMD_SET ? c.value : (c.action == CMD_ON ? 1.0f : 0.0f);
+    e->make_call().set_position(pos).perform();
+  }
+};
+#endif
+
+#ifdef USE_COVER
+template<> struct EntityTraits<cover::Cover> : PositionTraits<cover::Cover> {
+  static constexpr char ID = 'C';
+};
+#endif
+
+#ifdef USE_VALVE
+template<> struct EntityTraits<valve::Valve> : PositionTraits<valve::Valve> {
+  static constexpr char ID = 'V';
+};
+#endif
+
+#ifdef USE_LIGHT
+template<> struct EntityTraits<light::LightState> : EntityTraitsBase {
+  static constexpr char ID = 'L';
+  // On/off + luminosità 0-255, a transizione finita
+  template<typename F> static void attach(light::LightState *light, F send) {
+    light->add_new_target_state_reached_callback([light, send]() {
+      uint8_t v[2] = {static_cast<uint8_t>(light->remote_values.is_on() ? 1 : 0),
+                      static_cast<uint8_t>(light->remote_values.get_brightness() * 255.0f)};
+      send(v, 2);
+    });
+  }
+  static void command(light::LightState *light, const CmdPayload &c) {
+    if (c.action == CMD_ON) {
+      light->turn_on().perform();
+    } else if (c.action == CMD_OFF) {
+      light->turn_off().perform();
+    } else if (c.action == CMD_TOGGLE) {
+      light->toggle().perform();
+    } else if (c.action == CMD_SET) {
+      light->make_call().set_state(c.value > 0).set_brightness(c.value).perform();
+    }
+  }
+};
+#endif
+
+#ifdef USE_CLIMATE
+template<> struct EntityTraits<climate::Climate> : EntityTraitsBase {
+  static constexpr char ID = 'K';
+  static void reg(climate::Climate *clim, RegFields &r, uint8_t) {
+    auto traits = clim->get_traits();
+    r.unit = "°C";
+    r.codec = codec_for_range(traits.get_visual_min_temperature(), traits.get_visual_max_temperature(),
+                              traits.get_visual_target_temperature_step(), r.decimals);
+    // Modalità supportate, per la discovery del Root
+    for (uint8_t m = 0; m < sizeof(CLIMATE_MODE_NAMES) / sizeof(CLIMATE_MODE_NAMES[0]); m++) {
+      if (traits.supports_mode(static_cast<climate::ClimateMode>(m)))
+        r.options.emplace_back(CLIMATE_MODE_NAMES[m]);
+    }
+  }
+  // Temperatura target (codificata dal codec) + modalità
+  template<typename F> static void attach(climate::Climate *clim, F send) {
+    clim->add_on_state_callback([send](climate::Climate &c) {
+      uint8_t v[5];
+      float target = c.target_temperature;
+      memcpy(v, &target, 4);
+      v[4] = static_cast<uint8_t>(c.mode);
+      send(v, 5);
+    });
+  }
+  // SET: target; MODE: modalità; ON/OFF: prima modalità attiva supportata / off
+  static void command(climate::Climate *clim, const CmdPayload &c) {
+    auto traits = clim->get_traits();
+    int mode = -1;
+    if (c.action == CMD_MODE) {
+      mode = c.value;
+    } else if (c.action == CMD_OFF) {
+      mode = climate::CLIMATE_MODE_OFF;
+    } else if (c.action == CMD_ON) {
+      for (uint8_t m = climate::CLIMATE_MODE_HEAT_COOL; m <= climate::CLIMATE_MODE_AUTO && mode < 0; m++) {
+        if (traits.supports_mode(static_cast<climate::ClimateMode>(m)))
+          mode = m;
+      }
+    } else if (c.action == CMD_SET) {
+      clim->make_call().set_target_temperature(c.value).perform();
+      return;
+    }
+    auto m = static_cast<climate::ClimateMode>(mode);
+    if (mode >= 0 && mode <= climate::CLIMATE_MODE_AUTO && traits.supports_mode(m))
+      clim->make_call().set_mode(m).perform();
+  }
+};
+#endif
+
+#ifdef USE_NUMBER
+template<> struct EntityTraits<number::Number> : EntityTraitsBase {
+  static constexpr char ID = 'U';
+  static void reg(number::Number *num, RegFields &r, uint8_t) {
+    r.codec = codec_for_range(num->traits.get_min_value(), num->traits.get_max_value(), num->traits.get_step(),
+                              r.decimals);
+    // Range e passo per la discovery del Root
+    for (float v : {num->traits.get_min_value(), num->traits.get_max_value(), num->traits.get_step()}) {
+      char s[16];
+      snprintf(s, sizeof(s), "%g", v);
+      r.options.emplace_back(s);
+    }
+  }
+  template<typename F> static void attach(number::Number *num, F send) {
+    num->add_on_state_callback([send](float v) mutable { send_float(send, v); });
+  }
+  static void command(number::Number *num, const CmdPayload &c) {
+    if (c.action == CMD_SET)
+      num->make_call().set_value(c.value).perform();
+  }
+};
+#endif
+
+#ifdef USE_SELECT
+template<> struct EntityTraits<select::Select> : EntityTraitsBase {
+  static constexpr char ID = 'E';
+  // Opzioni in registrazione: lo stato viaggia come indice dell'opzione
+  static void reg(select::Select *sel, RegFields &r, uint8_t) {
+    r.codec = CODEC_DICT;
+    for (const auto &o : sel->traits.get_options())
+      r.options.emplace_back(o);
+  }
+  template<typename F> static void attach(select::Select *sel, F send) {
+    sel->add_on_state_callback([send](const std::string &state, size_t) mutable { send_text(send, state); });
+  }
+  static void command(select::Select *sel, const CmdPayload &c) {
+    if (c.action == CMD_SET && c.value >= 0 && c.value < sel->size())
+      sel->make_call().set_index(c.value).perform();
+  }
+};
+#endif
+
+#ifdef USE_LOCK
+template<> struct EntityTraits<lock::Lock> : EntityTraitsBase {
+  static constexpr char ID = 'O';
+  template<typename F> static void attach(lock::Lock *lock, F send) {
+    lock->add_on_state_callback([lock, send]() {
+      uint8_t v = static_cast<uint8_t>(lock->state);
+      send(&v, 1);
+    });
+  }
+  static void command(lock::Lock *lock, const CmdPayload &c) {
+    if (c.action == CMD_ON) {
+      lock->lock();
+    } else if (c.action == CMD_OFF) {
+      lock->unlock();
+    }
+  }
+};
+#endif
+
+#ifdef USE_TEXT
+template<> struct EntityTraits<text::Text> : EntityTraitsBase {
+  static constexpr char ID = 'X';
+  static void reg(text::Text *, RegFields &r, uint8_t) { r.codec = CODEC_DICT; }
+  template<typename F> static void attach(text::Text *txt, F send) {
+    txt->add_on_state_callback([send](const std::string &state) mutable { send_text(send, state); });
+  }
+};
+#endif
+
+#ifdef USE_ALARM_CONTROL_PANEL
+template<> struct EntityTraits<alarm_control_panel::AlarmControlPanel> : EntityTraitsBase {
+  static constexpr char ID = 'A';
+  template<typename F> static void attach(alarm_control_panel::AlarmControlPanel *acp, F send) {
+    acp->add_on_state_callback([acp, send]() {
+      uint8_t v = static_cast<uint8_t>(acp->get_state());
+      send(&v, 1);
+    });
+  }
+  // MODE: stato armato come nello stato (0 = disarmato); ON/OFF: fuori casa / disarmato
+  static void command(alarm_control_panel::AlarmControlPanel *acp, const CmdPayload &c) {
+    int mode = c.action == CMD_MODE ? static_cast<int>(c.value) : -1;
+    if (c.action == CMD_ON || c.action == CMD_OFF)
+      mode = c.action == CMD_ON ? 2 : 0;
+    switch (mode) {
+      case 0:
+        acp->disarm();
+        break;
+      case 1:
+        acp->arm_home();
+        break;
+      case 2:
+        acp->arm_away();
+        break;
+      case 3:
+        acp->arm_night();
+        break;
+      case 4:
+        acp->arm_vacation();
+        break;
+      case 5:
+        acp->arm_custom_bypass();
+        break;
+    }
+  }
+};
+#endif
+
+#ifdef USE_EVENT
+template<> struct EntityTraits<event::Event> : EntityTraitsBase {
+  // 'Y': 'V' è già usato dalle valvole e il Root decodifica per tipo
+  static constexpr char ID = 'Y';
+  // Tipi di evento come opzioni, per la discovery del Root
+  static void reg(event::Event *evt, RegFields &r, uint8_t) {
+    r.codec = CODEC_DICT;
+    for (const auto &t : evt->get_event_types())
+      r.options.emplace_back(t);
+  }
+  template<typename F> static void attach(event::Event *evt, F send) {
+    evt->add_on_event_callback([send](const std::string &event_type) mutable { send_text(send, event_type); });
+  }
+};
+#endif
+
+// Unico punto che passa da EntityType alla classe concreta
+template<typename V> static void visit_entity(const EntityInfo &obj, V &&visit) {
+  switch (obj.type) {
+#ifdef USE_BINARY_SENSOR
+    case ENTITY_TYPE_BINARY_SENSOR:
+      visit(static_cast<binary_sensor::BinarySensor *>(obj.entity));
+      break;
+#endif
+#ifdef USE_SENSOR
+    case ENTITY_TYPE_SENSOR:
+      visit(static_cast<sensor::Sensor *>(obj.entity));
+      break;
+#endif
+#ifdef USE_SWITCH
+    case ENTITY_TYPE_SWITCH:
+      visit(static_cast<switch_::Switch *>(obj.entity));
+      break;
+#endif
+#ifdef USE_BUTTON
+    case ENTITY_TYPE_BUTTON:
+      visit(static_cast<button::Button *>(obj.entity));
+      break;
+#endif
+#ifdef USE_TEXT_SENSOR
+    case ENTITY_TYPE_TEXT_SENSOR:
+      visit(static_cast<text_sensor::TextSensor *>(obj.entity));
+      break;
+#endif
+#ifdef USE_FAN
+    case ENTITY_TYPE_FAN:
+      visit(static_cast<fan::Fan *>(obj.entity));
+      break;
+#endif
+#ifdef USE_COVER
+    case ENTITY_TYPE_COVER:
+      visit(static_cast<cover::Cover *>(obj.entity));
+      break;
+#endif
+#ifdef USE_LIGHT
+    case ENTITY_TYPE_LIGHT:
+      visit(static_cast<light::LightState *>(obj.entity));
+      break;
+#endif
+#ifdef USE_CLIMATE
+    case ENTITY_TYPE_CLIMATE:
+      visit(static_cast<climate::Climate *>(obj.entity));
+      break;
+#endif
+#ifdef USE_NUMBER
+    case ENTITY_TYPE_NUMBER:
+      visit(static_cast<number::Number *>(obj.entity));
+      break;
+#endif
+#ifdef USE_SELECT
+    case ENTITY_TYPE_SELECT:
+      visit(static_cast<select::Select *>(obj.entity));
+      break;
+#endif
+#ifdef USE_LOCK
+    case ENTITY_TYPE_LOCK:
+      visit(static_cast<lock::Lock *>(obj.entity));
+      break;
+#endif
+#ifdef USE_TEXT
+    case ENTITY_TYPE_TEXT:
+      visit(static_cast<text::Text *>(obj.entity));
+      break;
+#endif
+#ifdef USE_VALVE
+    case ENTITY_TYPE_VALVE:
+      visit(static_cast<valve::Valve *>(obj.entity));
+      break;
+#endif
+#ifdef USE_ALARM_CONTROL_PANEL
+    case ENTITY_TYPE_ALARM_CONTROL_PANEL:
+      visit(static_cast<alarm_control_panel::AlarmControlPanel *>(obj.entity));
+      break;
+#endif
+#ifdef USE_EVENT
+    case ENTITY_TYPE_EVENT:
+      visit(static_cast<event::Event *>(obj.entity));
+      break;
+#endif
+    default:
+      ESP_LOGW(TAG, "Entity type %u not supported", obj.type);
+      break;
+  }
+}
+
+// Registrazione (se non già pronta dal manifest) e, una sola volta, aggancio
+// allo stato: la callback porta con sé l'hash, non l'entità
+template<typename E> void EspMesh::export_entity(E *e, bool prebuilt, bool attach, uint8_t flags) {
+  using T = EntityTraits<E>;
+  uint32_t hash = e->get_object_id_hash();
+  if (!prebuilt) {
+    RegFields r;
+    T::reg(e, r, flags);
+    this->send_registration(hash, T::ID, e->get_name().c_str(), r.unit, r.dev_class, r.codec, r.decimals,
+                            r.options.empty() ? nullptr : &r.options);
+  }
+  if (attach) {
+    T::attach(e, [this, hash, flags](const uint8_t *value, size_t len) {
+      this->submit_state(hash, value, len, flags);
+    });
+  }
+}
+
+// Record [hash][stato]: stringhe lunghe oltre un frame vanno in frammentazione
+void EspMesh::submit_state(uint32_t hash, const uint8_t *value, size_t len, uint8_t flags) {
+  ProfScope prof(this->prof(PROF_SUBMIT_STATE));
+  uint8_t buf[64];
+  std::vector<uint8_t> big;
+  uint8_t *pl = buf;
+  if (4 + len > sizeof(buf)) {
+    big.resize(4 + len);
+    pl = big.data();
+  }
+  memcpy(pl, &hash, 4);
+  if (len > 0)
+    memcpy(pl + 4, value, len);
+  this->submit(PKT_DATA, pl, 4 + len, flags);
+}
+
+void EspMesh::scan_local_entities() {
+  // --- SCANSIONE E REGISTRAZIONE ENTITÀ LOCALI ---
+  // Un'entità del manifest generato da __init__.py per passo, ogni
+  // REG_PACE_MS: il loop non si blocca e la raffica di registrazioni non
+  // trabocca dalla coda BULK
+  const auto &list = this->get_local_entities();
+  if (this->scan_pos_ >= list.size()) {
+    this->scan_active_ = false;
+    this->entities_attached_ = true;
+    ESP_LOGI(TAG, "Scanned %zu local entities", list.size());
+    return;
+  }
+  size_t i = this->scan_pos_++;
+  const auto &obj = list[i];
+  uint8_t flags = this->entity_flags(obj.type);
+  // Registrazione già pronta dal manifest; altrimenti la costruiscono i tratti
+  bool prebuilt = obj.meta != nullptr && obj.meta->reg != nullptr;
+  if (prebuilt)
+    this->send_registration(*obj.meta);
+  // Una scansione ripartita a metà della prima non aggancia due volte
+  bool attach = i >= this->attached_count_;
+  if (attach)
+    this->attached_count_ = i + 1;
+  visit_entity(obj, [&](auto *e) { this->export_entity(e, prebuilt, attach, flags); });
+}
+
+// Nuovo Root, nuova epoca o indici persi. Gli indici valgono solo dopo la
+// conferma del Root e si azzerano qui, nel contesto mesh; la scansione
+// aggancia le callback e legge i tratti delle entità, quindi la esegue il
+// loop principale
+void EspMesh::request_rescan() {
+  this->reg_epoch_ = this->root_epoch_;
+  std::fill(this->index_acked_.begin(), this->index_acked_.end(), false);
+  for (auto &kv : this->codecs_)
+    kv.second.base_valid = false;
+  LockGuard guard(this->cmd_lock_);
+  this->rescan_pending_ = true;
+}
+
+// Loop principale: le azioni sulle entità non sono thread-safe
+void EspMesh::apply_command(const CmdPayload &c) {
+  for (const auto &obj : this->get_local_entities()) {
+    if (c.entity_hash != 0 && obj.entity->get_object_id_hash() != c.entity_hash)
+      continue;
+    visit_entity(obj, [&](auto *e) {
+      using T = EntityTraits<std::remove_pointer_t<decltype(e)>>;
+      if (c.type_id == T::ID)
+        T::command(e, c);
+    });
+  }
+}
+
+#endif
+
+#ifdef IS_ROOT
+void EspMesh::deliver(const MeshHeader *h, uint8_t type, const uint8_t *payload, int len) {
+  if (type == PKT_REG) {
+    this->handle_reg(h->src, payload, len);
+  } else if (type == PKT_TOPO) {
+    this->handle_topo(h->src, payload, len);
+  } else if (type == PKT_OTA_REQ) {
+    this->handle_ota_req(h->src, payload, len);
+  } else if (type == PKT_TEST) {
+    this->handle_test(h, payload, len);
+  } else if (type == PKT_DATA) {
+    uint32_t origin_ts = 0;
+    if (h->flags & MESH_FLAG_TIMESTAMP) {
+      if (len < 4)
+        return;
+      memcpy(&origin_ts, payload, 4);
+      payload += 4;
+      len -= 4;
+
+      // Latenza end-to-end, ripartita sugli hop percorsi (TTL consumato)
+      uint32_t lat = this->mesh_time() - origin_ts;
+      if (lat < 60000) {
+        this->stats_.lat_samples++;
+        this->stats_.lat_sum_ms += lat;
+        this->stats_.lat_max_ms = std::max(this->stats_.lat_max_ms, lat);
+        this->stats_.lat_hops += MESH_DEFAULT_TTL - h->ttl + 1;
+      }
+    }
+    this->handle_data(h, payload, len, origin_ts);
+  }
+}
+
+// --- RIASSEMBLAGGIO ---
+void EspMesh::handle_frag(const MeshHeader *h, const uint8_t *payload, int len) {
+  const uint8_t *origin = h->src;
+  if (len <= (int) sizeof(FragHeader))
+    return;
+  FragHeader fh;
+  memcpy(&fh, payload, sizeof(fh));
+  if (fh.count < 2 || fh.count > FRAG_MAX_COUNT || fh.index >= fh.count)
+    return;
+  int chunk = len - sizeof(FragHeader);
+  // Solo l'ultimo frammento può essere corto
+  if (fh.index < fh.count - 1 && chunk != (int) FRAG_CHUNK)
+    return;
+
+  uint32_t now = millis();
+  FragSlot *slot = nullptr;
+  for (auto &s : this->frag_slots_) {
+    if (s.in_use && s.msg_id == fh.msg_id && memcmp(s.src, origin, 6) == 0) {
+      slot = &s;
+      break;
+    }
+  }
+
+  if (slot == nullptr) {
+    // Slot libero, altrimenti sacrifichiamo il riassemblaggio più vecchio
+    FragSlot *oldest = &this->frag_slots_[0];
+    for (auto &s : this->frag_slots_) {
+      if (!s.in_use) {
+        slot = &s;
+        break;
+      }
+      if (now - s.first_rx > now - oldest->first_rx)
+        oldest = &s;
+    }
+    if (slot == nullptr) {
+      ESP_LOGW(TAG, "Reassembly buffers full, dropping message %u", oldest->msg_id);
+      slot = oldest;
+    }
+    slot->in_use = true;
+    memcpy(slot->src, origin, 6);
+    slot->msg_id = fh.msg_id;
+    slot->count = 0;
+  }
+
+  // msg_id riutilizzato con una geometria diversa: ricominciamo
+  if (slot->count != fh.count || slot->inner_type != fh.inner_type) {
+    slot->inner_type = fh.inner_type;
+    slot->count = fh.count;
+    slot->received = 0;
+    slot->nacks = 0;
+    slot->len = 0;
+    slot->first_rx = now;
+    slot->data.assign(fh.count * FRAG_CHUNK, 0);
+  }
+
+  uint8_t bit = 1 << fh.index;
+  slot->last_rx = now;
+  if (slot->received & bit)
+    return;  // Duplicato (ritrasmissione)
+
+  memcpy(slot->data.data() + fh.index * FRAG_CHUNK, payload + sizeof(FragHeader), chunk);
+  slot->received |= bit;
+  if (fh.index == fh.count - 1)
+    slot->len = fh.index * FRAG_CHUNK + chunk;
+
+  uint8_t full = (1 << fh.count) - 1;
+  if (slot->received == full) {
+    slot->in_use = false;
+    this->deliver(h, slot->inner_type, slot->data.data(), slot->len);
+    std::vector<uint8_t>().swap(slot->data);
+  }
+}
+
+// Ogni record torna un PKT_DATA del suo originatore: rotta inversa,
+// conferma end-to-end e consegna come se fosse arrivato da solo
+void EspMesh::handle_agg(const uint8_t *mac, const MeshHeader *h, const uint8_t *payload, int len) {
+  int off = 0;
+  while (off + (int) sizeof(AggRecord) <= len) {
+    AggRecord r;
+    memcpy(&r, payload + off, sizeof(r));
+    off += sizeof(r);
+    if (off + r.len > len)
+      return;
+    MeshHeader sh = *h;
+    sh.type = PKT_DATA;
+    memcpy(sh.src, r.src, 6);
+    sh.ttl = r.ttl;
+    sh.flags = r.flags;
+    sh.seq = r.seq;
+    this->learn_route(r.src, mac);
+    this->mark_alive(r.src);
+    if (!(r.flags & MESH_FLAG_ACK_REQ) || this->ack_reliable(&sh))
+      this->deliver(&sh, PKT_DATA, payload + off, r.len);
+    off += r.len;
+  }
+}
+
+// Finestra anti-duplicato alla IPsec: true se il frame è nuovo.
+// Un salto oltre la finestra (nodo riavviato) la reinizializza.
+bool EspMesh::ack_reliable(const MeshHeader *h) {
+  AckWindow &w = this->ack_windows_[std::string(reinterpret_cast<const char *>(h->src), 6)];
+  int16_t d = h->seq - w.highest;
+  bool fresh;
+  if (!w.valid || d >= ACK_WINDOW || d <= -ACK_WINDOW) {
+    w.valid = true;
+    w.highest = h->seq;
+    w.window = 1;
+    fresh = true;
+  } else if (d > 0) {
+    w.window = (w.window << d) | 1;
+    w.highest = h->seq;
+    fresh = true;
+  } else {
+    uint32_t bit = 1u << -d;
+    fresh = !(w.window & bit);
+    w.window |= bit;
+  }
+
+  AckPayload a;
+  a.seq = w.highest;
+  a.window = w.window;
+  MeshHeader ah;
+  this->fill_header(ah, PKT_ACK, h->src, MESH_DEFAULT_TTL, PRIO_CONTROL);
+  this->route_packet(&ah, reinterpret_cast<uint8_t *>(&a), sizeof(a));
+  return fresh;
+}
+
+// --- MULTI-ROOT ---
+// Ogni nodo è pubblicato da un solo Root: chi lo serve rinnova una
+// rivendicazione MQTT retained (mesh_gw/owner/<nodo>) entro OWNER_LEASE_MS.
+// Un altro Root subentra su registrazione esplicita o a lease scaduto.
+bool EspMesh::claim_node(const std::string &node, bool force) {
+  LockGuard guard(this->owner_lock_);
+  NodeOwner &o = this->node_owners_[node];
+  uint32_t now = millis();
+  bool mine = o.root.empty() || o.root == this->root_hex_;
+  if (!mine && !force && now - o.refreshed < OWNER_LEASE_MS)
+    return false;
+
+  if (!mine || now - o.refreshed > OWNER_LEASE_MS / 2) {
+    if (!mine)
+      ESP_LOGI(TAG, "Taking over node %s from root %s", node.c_str(), o.root.c_str());
+    o.root = this->root_hex_;
+    o.refreshed = now;
+    this->queue_control("mesh_gw/owner/" + node, this->root_hex_);
+  }
+  return true;
+}
+
+void EspMesh::on_owner_message(const std::string &topic, const std::string &payload) {
+  size_t slash = topic.rfind('/');
+  if (slash == std::string::npos || payload.empty())
+    return;
+  LockGuard guard(this->owner_lock_);
+  NodeOwner &o = this->node_owners_[topic.substr(slash + 1)];
+  o.root = payload;
+  o.refreshed = millis();
+}
+
+void EspMesh::check_reassembly(uint32_t now) {
+  for (auto &s : this->frag_slots_) {
+    if (!s.in_use)
+      continue;
+
+    if (now - s.first_rx > FRAG_TIMEOUT_MS) {
+      ESP_LOGD(TAG, "Reassembly timeout for message %u", s.msg_id);
+      s.in_use = false;
+      std::vector<uint8_t>().swap(s.data);
+      continue;
+    }
+
+    // Ritrasmissione selettiva: chiediamo solo i frammenti mancanti
+    if (now - s.last_rx > FRAG_NACK_DELAY_MS && s.nacks < FRAG_MAX_NACKS) {
+      FragNack n;
+      n.msg_id = s.msg_id;
+      n.missing = ~s.received & ((1 << s.count) - 1);
+
+      MeshHeader h;
+      this->fill_header(h, PKT_FRAG_NACK, s.src, MESH_DEFAULT_TTL, PRIO_CONTROL);
+      this->route_packet(&h, reinterpret_cast<uint8_t *>(&n), sizeof(n));
+
+      s.nacks++;
+      s.last_rx = now;
+    }
+  }
+}
+
+// --- TRATTI DEI TIPI SUL ROOT ---
+// Speculari agli EntityTraits del nodo: per ogni type_id il decoder dello
+// stato, il componente e le chiavi della discovery di Home Assistant, e come
+// un comando MQTT diventa un PKT_CMD. handle_data, handle_reg e i topic di
+// comando passano solo da RootType.
+
+using Decoder = bool (EspMesh::*)(StateContext &);
+
+// Nomi degli enum di ESPHome come li attende Home Assistant
+static const char *const LOCK_STATE_NAMES[] = {"NONE", "LOCKED", "UNLOCKED", "JAMMED", "LOCKING", "UNLOCKING"};
+static const char *const ALARM_STATE_NAMES[] = {"disarmed",       "armed_home",          "armed_away", "armed_night",
+                                                "armed_vacation", "armed_custom_bypass", "pending",    "arming",
+                                                "disarming",      "triggered"};
+// Comandi del pannello d'allarme, nello stesso ordine degli stati armati
+static const char *const ALARM_COMMANDS[] = {"DISARM",    "ARM_HOME",     "ARM_AWAY",
+                                             "ARM_NIGHT", "ARM_VACATION", "ARM_CUSTOM_BYPASS"};
+
+template<size_t N> static constexpr uint8_t name_count(const char *const (&)[N]) { return N; }
+
+static int find_name(const char *s, const char *const *names, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (strcmp(s, names[i]) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static const std::string &reg_field(const std::vector<std::string> &f, size_t i) {
+  static const std::string empty;
+  return i < f.size() ? f[i] : empty;
+}
+
+static void json_key(std::string &j, const char *key, const std::string &v) {
+  j += ",\"";
+  j += key;
+  j += "\":\"";
+  j += v;
+  j += '"';
+}
+
+// Topic dell'entità: mesh_gw/<uid> + suffisso
+static void json_topic(std::string &j, const char *key, const std::string &base, const char *suffix) {
+  j += ",\"";
+  j += key;
+  j += "\":\"";
+  j += base;
+  j += suffix;
+  j += '"';
+}
+
+// Opzioni della registrazione (dopo unità e device class) come lista JSON
+static void json_options(std::string &j, const char *key, const std::vector<std::string> &f) {
+  if (f.size() <= 2)
+    return;
+  j += ",\"";
+  j += key;
+  j += "\":[";
+  for (size_t i = 2; i < f.size(); i++) {
+    j += i > 2 ? ",\"" : "\"";
+    j += f[i];
+    j += '"';
+  }
+  j += ']';
+}
+
+// ON / OFF / TOGGLE sul topic set, nell'ordine di CmdAction
+static bool cmd_switch(uint8_t topic, const std::string &p, CmdPayload &c) {
+  static const char *const acts[] = {"OFF", "ON", "TOGGLE"};
+  int i = find_name(p.c_str(), acts, 3);
+  if (topic != CMD_TOPIC_SET || i < 0)
+    return false;
+  c.action = i;
+  return true;
+}
+
+// Numero nel payload, riscalato (es. percentuale -> 0-1)
+static bool cmd_value(const std::string &p, float scale, CmdPayload &c) {
+  char *end;
+  float v = strtof(p.c_str(), &end);
+  if (end == p.c_str())
+    return false;
+  c.action = CMD_SET;
+  c.value = v * scale;
+  return true;
+}
+
+// Default: sensore in sola lettura, con unità e device class se presenti
+struct RootTraitsBase {
+  static constexpr const char *COMPONENT = "sensor";
+  static constexpr bool OCCURRENCE = false;
+  static constexpr const char *const *NAMES = nullptr;
+  static constexpr uint8_t NAME_COUNT = 0;
+  static constexpr std::nullptr_t command = nullptr;
+  static void discovery(std::string &j, const std::string &base, const std::vector<std::string> &f) {
+    json_topic(j, "stat_t", base, "/state");
+    if (!reg_field(f, 0).empty())
+      json_key(j, "unit_of_meas", f[0]);
+    if (!reg_field(f, 1).empty())
+      json_key(j, "dev_cla", f[1]);
+  }
+};
+
+template<char ID> struct RootTraits;
+
+template<> struct RootTraits<'S'> : RootTraitsBase {
+  static constexpr Decoder DECODE = &EspMesh::publish_value;
+};
+
+template<> struct RootTraits<'T'> : RootTraitsBase {
+  static constexpr Decoder DECODE = &EspMesh::publish_text;
+};
+
+// Text: i comandi portano solo numeri, quindi in sola lettura come sensore
+template<> struct RootTraits<'X'> : RootTraitsBase {
+  static constexpr Decoder DECODE = &EspMesh::publish_text;
+};
+
+template<> struct RootTraits<'B'> : RootTraitsBase {
+  static constexpr const char *COMPONENT = "binary_sensor";
+  static constexpr Decoder DECODE = &EspMesh::publish_bool;
+};
+
+template<> struct RootTraits<'W'> : RootTraitsBase {
+  static constexpr const char *COMPONENT = "switch";
+  static constexpr Decoder DECODE = &EspMesh::publish_bool;
+  static void discovery(std::string &j, const std::string &base, const std::vector<std::string> &) {
+    json_topic(j, "stat_t", base, "/state");
+    json_topic(j, "cmd_t", base, "/set");
+  }
+  static bool command(uint8_t topic, const std::string &p, const RegEntity &, CmdPayload &c) {
+    return cmd_switch(topic, p, c);
+  }
+};
+
+template<> struct RootTraits<'N'> : RootTraitsBase {
+  static constexpr const char *COMPONENT = "button";
+  static constexpr bool OCCURRENCE = true;
+  static constexpr Decoder DECODE = &EspMesh::publish_press;
+  static void discovery(std::string &j, const std::string &base, const std::vector<std::string> &) {
+    json_topic(j, "cmd_t", base, "/set");
+  }
+  static bool command(uint8_t topic, const std::string &p, const RegEntity &, CmdPayload &c) {
+    c.action = CMD_PRESS;
+    return topic == CMD_TOPIC_SET && p == "PRESS";
+  }
+};
+
+// Fan e luci: on/off su state e set, livello in % su level e set_level
+static bool cmd_level(uint8_t topic, const std::string &p, CmdPayload &c) {
+  return topic == CMD_TOPIC_LEVEL ? cmd_value(p, 0.01f, c) : cmd_switch(topic, p, c);
+}
+
+template<> struct RootTraits<'F'> : RootTraitsBase {
+  static constexpr const char *COMPONENT = "fan";
+  static constexpr Decoder DECODE = &EspMesh::publish_level;
+  static void discovery(std::string &j, const std::string &base, const std::vector<std::string> &) {
+    json_topic(j, "stat_t", base, "/state");
+    json_topic(j, "cmd_t", base, "/set");
+    json_topic(j, "pct_stat_t", base, "/level");
+    json_topic(j, "pct_cmd_t", base, "/set_level");
+  }
+  static bool command(uint8_t topic, const std::string &p, const RegEntity &, CmdPayload &c) {
+    return cmd_level(topic, p, c);
+  }
+};
+
+template<> struct RootTraits<'L'> : RootTraitsBase {
+  static constexpr const char *COMPONENT = "light";
+  static constexpr Decoder DECODE = &EspMesh::publish_level;
+  static void discovery(std::string &j, const std::string &base, const std::vector<std::string> &) {
+    json_topic(j, "stat_t", base, "/state");
+    json_topic(j, "cmd_t", base, "/set");
+    json_topic(j, "bri_stat_t", base, "/level");
+    json_topic(j, "bri_cmd_t", base, "/set_level");
+    j += ",\"bri_scl\":100";
+  }
+  static bool command(uint8_t topic, const std::string &p, const RegEntity &, CmdPayload &c) {
+    return cmd_level(topic, p, c);
+  }
+};
+
+// Cover e valvole: lo stato è la posizione 0-1, Home Assistant ragiona in %
+static bool cmd_position(uint8_t topic, const std::string &p, CmdPayload &c) {
+  return cmd_switch(topic, p, c) || cmd_value(p, 0.01f, c);
+}
+
+template<> struct RootTraits<'C'> : RootTraitsBase {
+  static constexpr const char *COMPONENT = "cover";
+  static constexpr Decoder DECODE = &EspMesh::publish_value;
+  static void discovery(std::string &j, const std::string &base, const std::vector<std::string> &) {
+    json_topic(j, "pos_t", base, "/state");
+    json_key(j, "pos_tpl", "{{ (value | float * 100) | round }}");
+    json_topic(j, "set_pos_t", base, "/set_level");
+    json_topic(j, "cmd_t", base, "/set");
+    j += ",\"pl_open\":\"ON\",\"pl_cls\":\"OFF\",\"pl_stop\":null";
+  }
+  static bool command(uint8_t topic, const std::string &p, const RegEntity &, CmdPayload &c) {
+    return cmd_position(topic, p, c);
+  }
+};
+
+template<> struct RootTraits<'V'> : RootTraitsBase {
+  static constexpr const char *COMPONENT = "valve";
+  static constexpr Decoder DECODE = &EspMesh::publish_value;
+  // Con reports_position la posizione (0-100) arriva su cmd_t
+  static void discovery(std::string &j, const std::string &base, const std::vector<std::string> &) {
+    json_topic(j, "stat_t", base, "/state");
+    json_key(j, "val_tpl", "{{ (value | float * 100) | round }}");
+    json_topic(j, "cmd_t", base, "/set");
+    j += ",\"reports_position\":true";
+  }
+  static bool command(uint8_t topic, const std::string &p, const RegEntity &, CmdPayload &c) {
+    return cmd_position(topic, p, c);
+  }
+};
+
+template<> struct RootTraits<'K'> : RootTraitsBase {
+  static constexpr const char *COMPONENT = "climate";
+  static constexpr Decoder DECODE = &EspMesh::publish_climate;
+  static constexpr const char *const *NAMES = CLIMATE_MODE_NAMES;
+  static constexpr uint8_t NAME_COUNT = name_count(CLIMATE_MODE_NAMES);
+  // Modalità supportate: le opzioni della registrazione
+  static void discovery(std::string &j, const std::string &base, const std::vector<std::string> &f) {
+    json_topic(j, "temp_stat_t", base, "/state");
+    json_topic(j, "temp_cmd_t", base, "/set");
+    json_topic(j, "mode_stat_t", base, "/mode");
+    json_topic(j, "mode_cmd_t", base, "/set_mode");
+    json_options(j, "modes", f);
+  }
+  static bool command(uint8_t topic, const std::string &p, const RegEntity &, CmdPayload &c) {
+    if (topic == CMD_TOPIC_SET)
+      return cmd_value(p, 1.0f, c);
+    int mode = find_name(p.c_str(), NAMES, NAME_COUNT);
+    c.action = CMD_MODE;
+    c.value = mode;
+    return topic == CMD_TOPIC_MODE && mode >= 0;
+  }
+};
+
+template<> struct RootTraits<'U'> : RootTraitsBase {
+  static constexpr const char *COMPONENT = "number";
+  static constexpr Decoder DECODE = &EspMesh::publish_value;
+  // Opzioni della registrazione: min, max, step
+  static void discovery(std::string &j, const std::string &base, const std::vector<std::string> &f) {
+    json_topic(j, "stat_t", base, "/state");
+    json_topic(j, "cmd_t", base, "/set");
+    if (f.size() >= 5)
+      j += ",\"min\":" + f[2] + ",\"max\":" + f[3] + ",\"step\":" + f[4];
+    j += ",\"mode\":\"box\"";
+  }
+  static bool command(uint8_t topic, const std::string &p, const RegEntity &, CmdPayload &c) {
+    return topic == CMD_TOPIC_SET && cmd_value(p, 1.0f, c);
+  }
+};
+
+template<> struct RootTraits<'E'> : RootTraitsBase {
+  static constexpr const char *COMPONENT = "select";
+  static constexpr Decoder DECODE = &EspMesh::publish_text;
+  static void discovery(std::string &j, const std::string &base, const std::vector<std::string> &f) {
+    json_topic(j, "stat_t", base, "/state");
+    json_topic(j, "cmd_t", base, "/set");
+    json_options(j, "options", f);
+  }
+  // Le opzioni aprono il dizionario dell'entità: il nodo riceve l'indice
+  static bool command(uint8_t topic, const std::string &p, const RegEntity &e, CmdPayload &c) {
+    auto it = std::find(e.dict.begin(), e.dict.end(), p);
+    c.action = CMD_SET;
+    c.value = it - e.dict.begin();
+    return topic == CMD_TOPIC_SET && it != e.dict.end();
+  }
+};
+
+template<> struct RootTraits<'O'> : RootTraitsBase {
+  static constexpr const char *COMPONENT = "lock";
+  static constexpr Decoder DECODE = &EspMesh::publish_enum;
+  static constexpr const char *const *NAMES = LOCK_STATE_NAMES;
+  static constexpr uint8_t NAME_COUNT = name_count(LOCK_STATE_NAMES);
+  static void discovery(std::string &j, const std::string &base, const std::vector<std::string> &) {
+    json_topic(j, "stat_t", base, "/state");
+    json_topic(j, "cmd_t", base, "/set");
+  }
+  static bool command(uint8_t topic, const std::string &p, const RegEntity &, CmdPayload &c) {
+    static const char *const acts[] = {"UNLOCK", "LOCK"};  // CMD_OFF, CMD_ON
+    int i = find_name(p.c_str(), acts, 2);
+    c.action = i;
+    return topic == CMD_TOPIC_SET && i >= 0;
+  }
+};
+
+template<> struct RootTraits<'A'> : RootTraitsBase {
+  static constexpr const char *COMPONENT = "alarm_control_panel";
+  static constexpr Decoder DECODE = &EspMesh::publish_enum;
+  static constexpr const char *const *NAMES = ALARM_STATE_NAMES;
+  static constexpr uint8_t NAME_COUNT = name_count(ALARM_STATE_NAMES);
+  static void discovery(std::string &j, const std::string &base, const std::vector<std::string> &) {
+    json_topic(j, "stat_t", base, "/state");
+    json_topic(j, "cmd_t", base, "/set");
+    j += ",\"code_arm_required\":false,\"code_disarm_required\":false";
+  }
+  static bool command(uint8_t topic, const std::string &p, const RegEntity &, CmdPayload &c) {
+    int i = find_name(p.c_str(), ALARM_COMMANDS, name_count(ALARM_COMMANDS));
+    c.action = CMD_MODE;
+    c.value = i;
+    return topic == CMD_TOPIC_SET && i >= 0;
+  }
+};
+
+template<> struct RootTraits<'Y'> : RootTraitsBase {
+  static constexpr const char *COMPONENT = "event";
+  static constexpr bool OCCURRENCE = true;
+  static constexpr Decoder DECODE = &EspMesh::publish_event;
+  static void discovery(std::string &j, const std::string &base, const std::vector<std::string> &f) {
+    json_topic(j, "stat_t", base, "/state");
+    if (!reg_field(f, 1).empty())
+      json_key(j, "dev_cla", f[1]);
+    json_options(j, "event_types", f);
+  }
+};
+
+template<char ID> static constexpr RootType root_type() {
+  using T = RootTraits<ID>;
+  return RootType{ID, T::COMPONENT, T::OCCURRENCE, T::NAMES, T::NAME_COUNT, T::DECODE, T::discovery, T::command};
+}
+
+// Il primo è anche il fallback per i tipi sconosciuti (firmware più nuovo)
+static constexpr RootType ROOT_TYPES[] = {
+    root_type<'S'>(), root_type<'B'>(), root_type<'W'>(), root_type<'N'>(), root_type<'T'>(), root_type<'F'>(),
+    root_type<'C'>(), root_type<'V'>(), root_type<'L'>(), root_type<'K'>(), root_type<'U'>(), root_type<'E'>(),
+    root_type<'O'>(), root_type<'X'>(), root_type<'A'>(), root_type<'Y'>(),
+};
+
+static const RootType *root_type_of(char id) {
+  for (const RootType &t : ROOT_TYPES) {
+    if (t.id == id)
+      return &t;
+  }
+  return &ROOT_TYPES[0];
+}
+
+void EspMesh::handle_reg(const uint8_t *origin, const uint8_t *payload, int len) {
+  ProfScope prof(this->prof(PROF_HANDLE_REG));
+  if (!this->mqtt_ || len <= (int) sizeof(RegPayload))
+    return;
+  RegPayload p;
+  memcpy(&p, payload, sizeof(p));
+
+  // Il nome è la prima stringa NUL-terminata dopo l'header fisso, seguono
+  // unità, device class e le opzioni
+  const char *name = reinterpret_cast<const char *>(payload + sizeof(RegPayload));
+  const char *end = reinterpret_cast<const char *>(payload + len);
+  size_t name_len = strnlen(name, end - name);
+  std::vector<std::string> fields;
+  for (const char *w = name + name_len + 1; w < end;) {
+    size_t n = strnlen(w, end - w);
+    fields.emplace_back(w, n);
+    w += n + 1;
+  }
+
+  char m[13];
+  sprintf(m, "%02X%02X%02X%02X%02X%02X", origin[0], origin[1], origin[2], origin[3], origin[4],
+          origin[5]);
+  std::string uid = std::string(m) + "_" + to_string(p.entity_hash);
+  // La registrazione arriva quando il nodo sceglie questo Root: rivendichiamolo
+  if (!this->claim_node(m, true))
+    return;
+
+  // Indice proposto dal nodo: lo slot (ri)assegnato viene confermato, da lì
+  // in poi i dati arrivano con un byte al posto dell'hash
+  RegNode &node = this->reg_node(m);
+  node.last_seen = millis();
+  node.idle_base_s = 0;
+  node.dirty = true;
+  // Entità già nota con questo tipo: la vecchia discovery è stata tolta allora
+  RegEntity *prev = this->find_entity(node, p.entity_hash);
+  bool migrated = prev != nullptr && prev->type_id == p.type_id && prev->migrated;
+  std::vector<RegEntity> &reg = node.entities;
+  RegEntity *ent;
+  if (p.index < ENTITY_INDEX_MAX) {
+    if (reg.size() <= p.index)
+      reg.resize(p.index + 1);
+    // Stessa entità con un altro indice (firmware del nodo cambiato): via
+    for (size_t i = 0; i < reg.size(); i++) {
+      if (i != p.index && reg[i].hash == p.entity_hash)
+        reg[i] = RegEntity{};
+    }
+    node.overflow.erase(p.entity_hash);
+    ent = &reg[p.index];
+    ent->hash = p.entity_hash;
+    ent->base_tag[0] = ent->base_tag[1] = -1;
+    ent->uid = uid;
+    this->send_reg_ack(origin, p.entity_hash, p.index, REG_ACK_OK);
+  } else {
+    // Entità senza indice: tabella a parte, trovata per hash
+    ent = this->find_entity(node, p.entity_hash);
+    if (ent == nullptr) {
+      ent = &node.overflow[p.entity_hash];
+      ent->hash = p.entity_hash;
+      ent->uid = uid;
+    }
+  }
+  ent->type_id = p.type_id;
+  ent->codec = p.codec;
+  ent->decimals = p.decimals;
+  ent->migrated = true;
+  // Opzioni: dizionario statico dei testi, opzioni delle select per i comandi
+  ent->dict.assign(fields.begin() + std::min<size_t>(fields.size(), 2), fields.end());
+
+  const RootType *rt = root_type_of(p.type_id);
+  std::string base = "mesh_gw/" + uid;
+  std::string j;
+  j.reserve(320);
+  j += "{\"name\":\"";
+  j.append(name, name_len);
+  j += "\",\"uniq_id\":\"";
+  j += uid;
+  j += '"';
+  rt->discovery(j, base, fields);
+  j += ",\"avty_t\":\"mesh_gw/";
+  j += m;
+  j += "/avail\",\"dev\":{\"ids\":[\"";
+  j += m;
+  j += "\"],\"name\":\"Node ";
+  j += m;
+  j += "\"}}";
+  // Discovery: mai coalescere. Prima tutti i tipi erano annunciati come sensor:
+  // la vecchia configurazione retained va tolta, una volta per entità, o
+  // resterebbe un doppione
+  if (!migrated && strcmp(rt->component, "sensor") != 0)
+    this->queue_publish("homeassistant/sensor/" + uid + "/config", "", 0, true, false);
+  this->queue_publish(std::string("homeassistant/") + rt->component + "/" + uid + "/config", j, 0, true, false);
+}
+
+void EspMesh::handle_data(const MeshHeader *h, const uint8_t *payload, int len, uint32_t origin_ts) {
+  ProfScope prof(this->prof(PROF_HANDLE_DATA));
+  const uint8_t *origin = h->src;
+  bool indexed = h->flags & MESH_FLAG_INDEX;
+  int id_len = indexed ? 1 : 4;
+  if (!this->mqtt_ || len < id_len)
+    return;
+  char m[13];
+  sprintf(m, "%02X%02X%02X%02X%02X%02X", origin[0], origin[1], origin[2], origin[3], origin[4],
+          origin[5]);
+  if (!this->claim_node(m, false))
+    return;  // Servito da un altro Root
+
+  // Entità del record: accesso diretto per indice, ricerca per hash solo
+  // sulla forma lunga (prima della conferma o oltre ENTITY_INDEX_MAX)
+  RegNode &node = this->reg_node(m);
+  node.last_seen = millis();
+  node.idle_base_s = 0;
+  RegEntity *ent = nullptr;
+  if (indexed) {
+    uint8_t idx = payload[0];
+    if (idx < node.entities.size() && !node.entities[idx].uid.empty())
+      ent = &node.entities[idx];
+  } else {
+    uint32_t hash;
+    memcpy(&hash, payload, 4);
+    ent = this->find_entity(node, hash);
+  }
+  if (ent == nullptr) {
+    // Entità mai registrata qui (registro perso o incompleto): senza discovery
+    // il valore non servirebbe, chiediamo al nodo di ri-registrarsi
+    this->request_resync(origin, node);
+    return;
+  }
+
+  // Il decoder del tipo pubblica lo stato; eventi e pressioni di pulsanti
+  // sono occorrenze: ognuna va pubblicata
+  const RootType *rt = root_type_of(ent->type_id);
+  StateContext c{h, ent, rt, payload + id_len, len - id_len, "mesh_gw/" + ent->uid + "/state", !rt->occurrence};
+  if ((this->*rt->decode)(c))
+    this->publish_origin_ts(ent->uid, origin_ts, c.coalesce);
+}
+
+bool EspMesh::publish_bool(StateContext &c) {
+  if (c.len < 1)
+    return false;
+  this->queue_publish(c.stat, c.payload[0] ? "ON" : "OFF", 0, false, c.coalesce);
+  return true;
+}
+
+// On/off + livello 0-255, pubblicato in % su mesh_gw/<uid>/level
+bool EspMesh::publish_level(StateContext &c) {
+  if (c.len < 2)
+    return false;
+  this->queue_publish(c.stat, c.payload[0] ? "ON" : "OFF", 0, false, c.coalesce);
+  this->queue_publish("mesh_gw/" + c.ent->uid + "/level", to_string(c.payload[1] * 100 / 255), 0, false,
+                      c.coalesce);
+  return true;
+}
+
+bool EspMesh::publish_enum(StateContext &c) {
+  if (c.len < 1)
+    return false;
+  this->queue_publish(c.stat, c.payload[0] < c.rt->name_count ? c.rt->names[c.payload[0]] : "unknown", 0, false,
+                      c.coalesce);
+  return true;
+}
+
+bool EspMesh::publish_press(StateContext &c) {
+  this->queue_publish(c.stat, "PRESS", 0, false, c.coalesce);
+  return true;
+}
+
+// Stati testuali: codice di dizionario con l'indice, stringa a lunghezza
+// piena con l'hash
+bool EspMesh::read_text(StateContext &c, std::string &out) {
+  if ((c.h->flags & MESH_FLAG_INDEX) && (c.ent->codec & CODEC_MASK) == CODEC_DICT)
+    return this->decode_text(c.h, *c.ent, c.payload, c.len, out);
+  out.assign(reinterpret_cast<const char *>(c.payload), c.len);
+  return true;
+}
+
+bool EspMesh::publish_text(StateContext &c) {
+  std::string text;
+  if (!this->read_text(c, text))
+    return false;
+  this->queue_publish(c.stat, text, 0, false, c.coalesce);
+  return true;
+}
+
+// Home Assistant attende l'evento come JSON con il suo tipo
+bool EspMesh::publish_event(StateContext &c) {
+  std::string text;
+  if (!this->read_text(c, text))
+    return false;
+  this->queue_publish(c.stat, "{\"event_type\":\"" + text + "\"}", 0, false, c.coalesce);
+  return true;
+}
+
+// Forma con hash: float32 grezzo. Forma con indice: codec negoziato.
+// Restituisce i byte consumati, -1 se il valore non si può ricostruire
+int EspMesh::publish_number(StateContext &c) {
+  RegEntity *ent = c.ent;
+  const uint8_t *payload = c.payload;
+  bool indexed = c.h->flags & MESH_FLAG_INDEX;
+  float val = 0;
+  int used = 0;
+  uint8_t codec = indexed ? ent->codec : CODEC_F32;
+  if ((c.h->flags & MESH_FLAG_DELTA) && indexed) {
+    if (c.len < 2)
+      return -1;
+    used = 2;
+    int k = ent->base_tag[0] == payload[0] ? 0 : (ent->base_tag[1] == payload[0] ? 1 : -1);
+    if (k < 0) {
+      ESP_LOGD(TAG, "Delta for %s on unknown base, dropped", ent->uid.c_str());
+      return -1;  // Il nodo rimanda un assoluto entro DELTA_REFRESH record
+    }
+    val = (ent->base[k] + static_cast<int8_t>(payload[1])) / codec_scale(ent->decimals);
+  } else if (codec != CODEC_F32) {
+    used = decode_value(codec, ent->decimals, payload, c.len, val);
+    if (used < 0)
+      return -1;
+    // Assoluto confermato: nuova base per i delta che lo citano
+    int16_t w = INT16_MIN;
+    if (codec & CODEC_DELTA)
+      memcpy(&w, payload, 2);
+    if ((c.h->flags & MESH_FLAG_ACK_REQ) && w != INT16_MIN) {
+      ent->base[1] = ent->base[0];
+      ent->base_tag[1] = ent->base_tag[0];
+      ent->base[0] = w;
+      ent->base_tag[0] = c.h->seq & 0xFF;
+    }
+  } else if (c.len >= 4) {
+    memcpy(&val, payload, 4);
+    used = 4;
+  }
+  char vs[24];
+  uint8_t fmt = codec & CODEC_MASK;
+  if (fmt == CODEC_I8 || fmt == CODEC_I16) {
+    sprintf(vs, "%.*f", std::max<int>(ent->decimals, 0), val);
+  } else {
+    sprintf(vs, "%.2f", val);
+  }
+  this->queue_publish(c.stat, vs, 0, false, c.coalesce);
+  return used;
+}
+
+bool EspMesh::publish_value(StateContext &c) { return this->publish_number(c) >= 0; }
+
+// Climate: dopo il target, la modalità
+bool EspMesh::publish_climate(StateContext &c) {
+  int used = this->publish_number(c);
+  if (used < 0)
+    return false;
+  if (used > 0 && used < c.len) {
+    uint8_t mode = c.payload[used];
+    this->queue_publish("mesh_gw/" + c.ent->uid + "/mode", mode < c.rt->name_count ? c.rt->names[mode] : "unknown",
+                        0, false, c.coalesce);
+  }
+  return true;
+}
+
+// Traffico di test: consegna (buchi nella sequenza), latenza sull'orologio
+// di mesh e goodput, per sorgente
+void EspMesh::handle_test(const MeshHeader *h, const uint8_t *payload, int len) {
+  if (len < (int) sizeof(TestPayload))
+    return;
+  TestPayload t;
+  memcpy(&t, payload, sizeof(t));
+  TestStats &st = this->test_stats_[mac_hex(h->src)];
+  // Prima volta, o sorgente ripartita (sequenza tornata molto indietro)
+  if (!st.started || static_cast<int32_t>(t.seq - st.base_seq) < -1000) {
+    st = TestStats{};
+    st.started = true;
+    st.base_seq = t.seq;
+  }
+  if (static_cast<int32_t>(t.seq - st.base_seq) < 0) {
+    st.dup++;  // Fuori finestra: arrivato dopo il riepilogo che l'ha dato per perso
+    return;
+  }
+  if (!st.any || static_cast<int32_t>(t.seq - st.max_seq) > 0)
+    st.max_seq = t.seq;
+  st.any = true;
+  st.rx++;
+  st.bytes += len;
+  if (t.sent_at != 0) {
+    uint32_t lat = this->mesh_time() - t.sent_at;
+    if (lat < 60000) {
+      st.lat_samples++;
+      st.lat_sum_ms += lat;
+      st.lat_max_ms = std::max(st.lat_max_ms, lat);
+    }
+  }
+}
+
+// Riepilogo per sorgente su mesh_gw/<MAC>/test, poi nuova finestra
+void EspMesh::report_test(uint32_t now) {
+  if (this->test_stats_.empty() || now - this->last_test_report_ < TEST_REPORT_MS)
+    return;
+  uint32_t window = now - this->last_test_report_;
+  this->last_test_report_ = now;
+  for (auto &kv : this->test_stats_) {
+    TestStats &st = kv.second;
+    uint32_t expected = st.any ? st.max_seq - st.base_seq + 1 : 0;
+    uint32_t rx = std::min(st.rx, expected);
+    char j[200];
+    snprintf(j, sizeof(j),
+             "{\"rx\":%u,\"expected\":%u,\"pdr\":%.3f,\"late\":%u,\"lat_avg\":%u,\"lat_max\":%u,"
+             "\"goodput\":%u}",
+             rx, expected, expected ? (float) rx / expected : 0.0f, st.dup,
+             st.lat_samples ? st.lat_sum_ms / st.lat_samples : 0, st.lat_max_ms,
+             (uint32_t) ((uint64_t) st.bytes * 1000 / std::max<uint32_t>(window, 1)));
+    ESP_LOGI(TAG, "Test %s: %s", kv.first.c_str(), j);
+    this->queue_publish("mesh_gw/" + kv.first + "/test", j, 0, false, true);
+    uint32_t next = st.any ? st.max_seq + 1 : st.base_seq;
+    st = TestStats{};
+    st.started = true;
+    st.base_seq = next;
+  }
+}
+
+void EspMesh::send_reg_ack(const uint8_t *node, uint32_t hash, uint8_t index, uint8_t status) {
+  RegAck a;
+  a.entity_hash = hash;
+  a.index = index;
+  a.status = status;
+  MeshHeader h;
+  this->fill_header(h, PKT_REG_ACK, node, MESH_DEFAULT_TTL, PRIO_CONTROL);
+  this->route_packet(&h, reinterpret_cast<uint8_t *>(&a), sizeof(a));
+}
+
+// Nodo nel registro; un nodo nuovo prende il primo short ID libero
+RegNode &EspMesh::reg_node(const std::string &id) {
+  auto it = this->registry_.find(id);
+  if (it != this->registry_.end())
+    return it->second;
+  bool used[REG_PERSIST_NODES] = {};
+  for (auto &kv : this->registry_) {
+    if (kv.second.slot < REG_PERSIST_NODES)
+      used[kv.second.slot] = true;
+  }
+  RegNode &n = this->registry_[id];
+  n.last_seen = millis();
+  for (uint8_t i = 0; i < REG_PERSIST_NODES; i++) {
+    if (!used[i]) {
+      n.slot = i;
+      this->reg_index_dirty_ = true;
+      break;
+    }
+  }
+  return n;
+}
+
+uint32_t EspMesh::reg_manifest(const RegNode &n) {
+  uint32_t m = 0;
+  for (const auto &e : n.entities) {
+    if (!e.uid.empty())
+      m ^= manifest_part(e.hash, e.type_id, e.codec, e.decimals);
+  }
+  for (const auto &kv : n.overflow)
+    m ^= manifest_part(kv.first, kv.second.type_id, kv.second.codec, kv.second.decimals);
+  return m;
+}
+
+// Entità per hash: prima la forma con indice (record non ancora confermato),
+// poi le entità senza indice
+RegEntity *EspMesh::find_entity(RegNode &n, uint32_t hash) {
+  for (auto &e : n.entities) {
+    if (e.hash == hash && !e.uid.empty())
+      return &e;
+  }
+  auto it = n.overflow.find(hash);
+  return it != n.overflow.end() ? &it->second : nullptr;
+}
+
+// Richiesta di ri-registrazione a un singolo nodo, al massimo ogni REG_RESYNC_MS
+void EspMesh::request_resync(const uint8_t *node, RegNode &n) {
+  uint32_t now = millis();
+  if (n.last_resync != 0 && now - n.last_resync < REG_RESYNC_MS)
+    return;
+  n.last_resync = now;
+  this->send_reg_ack(node, 0, 0, REG_ACK_UNKNOWN);
+}
+
+// Avvio a caldo: nodi ed entità dall'ultimo salvataggio. Senza registro si
+// parte con una nuova epoca, che gli annunci portano a tutta la mesh
+void EspMesh::restore_registry() {
+  this->reg_index_pref_ = global_preferences->make_preference<RegIndexRecord>(fnv1_hash("esp_mesh_reg"), true);
+  for (uint8_t slot = 0; slot < REG_PERSIST_NODES; slot++) {
+    this->reg_prefs_[slot] =
+        global_preferences->make_preference<RegNodeRecord>(fnv1_hash("esp_mesh_reg_" + to_string(slot)), true);
+  }
+  RegIndexRecord idx;
+  if (!this->reg_index_pref_.load(&idx) || idx.epoch == 0) {
+    this->reg_epoch_ = 1 + random_uint32() % 0xFFFE;
+    this->reg_index_dirty_ = true;
+    ESP_LOGI(TAG, "No stored registry, epoch %u", this->reg_epoch_);
+    return;
+  }
+  this->reg_epoch_ = idx.epoch;
+  uint32_t now = millis();
+  for (uint8_t slot = 0; slot < REG_PERSIST_NODES; slot++) {
+    if (!idx.used[slot])
+      continue;
+    RegNodeRecord r;
+    if (!this->reg_prefs_[slot].load(&r) || r.idle_s > REG_EXPIRE_S) {
+      this->reg_index_dirty_ = true;
+      continue;
+    }
+    std::string id = mac_hex(r.mac);
+    RegNode &n = this->registry_[id];
+    n.slot = slot;
+    n.last_seen = now;
+    n.idle_base_s = r.idle_s;
+    // Entità con indice al loro posto, le altre nella tabella per hash
+    for (uint8_t i = 0; i < std::min<uint8_t>(r.count, REG_PERSIST_ENTITIES); i++) {
+      const RegEntityRecord &er = r.entities[i];
+      RegEntity e;
+      e.hash = er.hash;
+      e.type_id = er.type_id;
+      e.codec = er.codec;
+      e.decimals = er.decimals;
+      e.migrated = er.migrated;
+      e.uid = id + "_" + to_string(er.hash);
+      if (er.index < ENTITY_INDEX_MAX) {
+        if (n.entities.size() <= er.index)
+          n.entities.resize(er.index + 1);
+        n.entities[er.index] = e;
+      } else {
+        n.overflow[er.hash] = e;
+      }
+    }
+  }
+  ESP_LOGI(TAG, "Registry restored: %zu nodes, epoch %u", this->registry_.size(), this->reg_epoch_);
+}
+
+// Contesto mesh: resync richiesti, nodi dimenticati, record dei nodi modificati
+void EspMesh::check_registry(uint32_t now) {
+  if (this->resync_requested_) {
+    this->resync_requested_ = false;
+    this->reg_epoch_ = this->reg_epoch_ % 0xFFFF + 1;
+    this->registry_.clear();
+    this->reg_index_dirty_ = true;
+    ESP_LOGI(TAG, "Registry cleared, epoch %u: nodes will re-register", this->reg_epoch_);
+  }
+  if (now - this->last_reg_save_ < REG_SAVE_MS)
+    return;
+  this->last_reg_save_ = now;
+  bool refresh = now - this->last_reg_refresh_ > REG_REFRESH_MS;
+  if (refresh)
+    this->last_reg_refresh_ = now;
+
+  std::vector<std::pair<uint8_t, RegNodeRecord>> records;
+  RegIndexRecord index{};
+  index.epoch = this->reg_epoch_;
+  for (auto it = this->registry_.begin(); it != this->registry_.end();) {
+    RegNode &n = it->second;
+    uint32_t idle = n.idle_base_s + (now - n.last_seen) / 1000;
+    if (idle > REG_EXPIRE_S) {
+      ESP_LOGI(TAG, "Forgetting node %s (idle %u s)", it->first.c_str(), idle);
+      if (n.slot < REG_PERSIST_NODES)
+        this->reg_index_dirty_ = true;
+      it = this->registry_.erase(it);
+      continue;
+    }
+    if (n.slot < REG_PERSIST_NODES) {
+      index.used[n.slot] = 1;
+      if (n.dirty || refresh) {
+        RegNodeRecord r{};
+        parse_hex(it->first.c_str(), r.mac, 6);
+        r.idle_s = idle;
+        for (size_t i = 0; i < n.entities.size() && r.count < REG_PERSIST_ENTITIES; i++) {
+          const RegEntity &e = n.entities[i];
+          if (e.uid.empty())
+            continue;
+          RegEntityRecord &er = r.entities[r.count++];
+          er.hash = e.hash;
+          er.type_id = e.type_id;
+          er.codec = e.codec;
+          er.decimals = e.decimals;
+          er.index = i;
+          er.migrated = e.migrated;
+        }
+        for (auto oit = n.overflow.begin(); oit != n.overflow.end() && r.count < REG_PERSIST_ENTITIES; ++oit) {
+          RegEntityRecord &er = r.entities[r.count++];
+          er.hash = oit->first;
+          er.type_id = oit->second.type_id;
+          er.codec = oit->second.codec;
+          er.decimals = oit->second.decimals;
+          er.index = ENTITY_INDEX_MAX;
+          er.migrated = oit->second.migrated;
+        }
+        records.emplace_back(n.slot, r);
+      }
+    }
+    n.dirty = false;
+    ++it;
+  }
+  if (records.empty() && !this->reg_index_dirty_)
+    return;
+
+  LockGuard guard(this->reg_lock_);
+  for (auto &r : records)
+    this->reg_pending_.push_back(r);
+  if (this->reg_index_dirty_) {
+    this->reg_index_rec_ = index;
+    this->reg_index_pending_ = true;
+    this->reg_index_dirty_ = false;
+  }
+}
+
+// Loop principale: le preferenze non sono thread-safe. La scrittura in
+// flash avviene poi secondo flash_write_interval di ESPHome
+void EspMesh::save_registry() {
+  std::vector<std::pair<uint8_t, RegNodeRecord>> pending;
+  RegIndexRecord index;
+  bool write_index;
+  {
+    LockGuard guard(this->reg_lock_);
+    pending.swap(this->reg_pending_);
+    write_index = this->reg_index_pending_;
+    index = this->reg_index_rec_;
+    this->reg_index_pending_ = false;
+  }
+  for (auto &p : pending)
+    this->reg_prefs_[p.first].save(&p.second);
+  if (write_index)
+    this->reg_index_pref_.save(&index);
+}
+
+// Solo i nodi registrati qui: gli altri li pubblica il loro Root
+void EspMesh::mark_alive(const uint8_t *node) {
+  auto it = this->registry_.find(mac_hex(node));
+  if (it == this->registry_.end())
+    return;
+  RegNode &n = it->second;
+  n.last_seen = millis();
+  n.idle_base_s = 0;
+  n.pings = 0;
+  if (n.avail != 1) {
+    n.avail = 1;
+    this->avail_changes_[it->first] = true;
+  }
+}
+
+// Ping solo ai nodi silenziosi oltre la soglia; offline dopo AVAIL_PINGS
+// senza risposta. I cambi escono a gruppi, al massimo ogni AVAIL_BATCH_MS
+void EspMesh::check_availability(uint32_t now) {
+  if (this->avail_timeout_ == 0 || now - this->last_avail_check_ < AVAIL_BATCH_MS)
+    return;
+  this->last_avail_check_ = now;
+  for (auto &kv : this->registry_) {
+    RegNode &n = kv.second;
+    if (now - n.last_seen < this->avail_timeout_ || now - n.last_ping < AVAIL_PING_INTERVAL_MS)
+      continue;
+    if (n.pings < AVAIL_PINGS) {
+      uint8_t mac[6];
+      parse_hex(kv.first.c_str(), mac, 6);
+      MeshHeader h;
+      this->fill_header(h, PKT_PING, mac, MESH_DEFAULT_TTL, PRIO_CONTROL);
+      this->route_packet(&h, nullptr, 0);
+      n.pings++;
+      n.last_ping = now;
+    } else if (n.avail != 0) {
+      n.avail = 0;
+      this->avail_changes_[kv.first] = false;
+    }
+  }
+
+  if (this->avail_changes_.empty())
+    return;
+  for (auto &c : this->avail_changes_)
+    this->queue_control("mesh_gw/" + c.first + "/avail", c.second ? "online" : "offline");
+  ESP_LOGD(TAG, "Availability: %zu nodes changed", this->avail_changes_.size());
+  this->avail_changes_.clear();
+}
+
+// mesh_gw/group/<g>/cmd (lungo l'albero) o mesh_gw/group/<g>/flood, payload
+// "<tipo> <azione> [valore] [hash]", es. "L on", "L set 0.4", "W toggle", "K mode 3"
+void EspMesh::on_group_command(const std::string &topic, const std::string &payload) {
+  unsigned g;
+  char mode[8];
+  if (sscanf(topic.c_str(), "mesh_gw/group/%u/%7s", &g, mode) != 2 || g == 0 || g > MESH_GROUPS)
+    return;
+  bool flood = strcmp(mode, "flood") == 0;
+  if (!flood && strcmp(mode, "cmd") != 0)
+    return;
+
+  static const char *const actions[] = {"off", "on", "toggle", "press", "set", "mode"};
+  char type_id, action[8];
+  float value = 0;
+  unsigned hash = 0;
+  if (sscanf(payload.c_str(), " %c %7s %f %u", &type_id, action, &value, &hash) < 2) {
+    ESP_LOGW(TAG, "Invalid group command '%s'", payload.c_str());
+    return;
+  }
+  CmdPayload c;
+  c.type_id = type_id;
+  c.action = 0xFF;
+  for (uint8_t i = 0; i < sizeof(actions) / sizeof(actions[0]); i++) {
+    if (strcmp(action, actions[i]) == 0)
+      c.action = i;
+  }
+  if (c.action == 0xFF)
+    return;
+  c.value = value;
+  c.entity_hash = hash;
+
+  uint8_t dst[6] = {MESH_GROUP_PREFIX, 0, 0, 0, 0, static_cast<uint8_t>(g)};
+  MeshHeader h;
+  this->fill_header(h, PKT_CMD, dst, MESH_DEFAULT_TTL, PRIO_CONTROL | (flood ? MESH_FLAG_FLOOD : 0));
+  h.seq = this->group_seq_++;
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(&c);
+  std::vector<uint8_t> pl(p, p + sizeof(c));
+  this->auth_sign(h, pl);  // I nodi eseguono e rilanciano solo comandi firmati
+  LockGuard guard(this->ctrl_lock_);
+  this->ctrl_pending_.emplace_back(h, std::move(pl));
+}
+
+// mesh_gw/<uid>/set, set_level e set_mode dai topic di comando della discovery.
+// Il registro vive nel contesto mesh: il comando si risolve lì
+void EspMesh::on_entity_command(const std::string &topic, const std::string &payload) {
+  LockGuard guard(this->ctrl_lock_);
+  this->entity_cmds_.emplace_back(topic, payload);
+}
+
+// Comando per entità: unicast al nodo, firmato come quelli di gruppo
+void EspMesh::send_entity_commands() {
+  std::vector<std::pair<std::string, std::string>> cmds;
+  {
+    LockGuard guard(this->ctrl_lock_);
+    cmds.swap(this->entity_cmds_);
+  }
+  static const char *const suffixes[] = {"set", "set_level", "set_mode"};  // CmdTopic
+  for (auto &cmd : cmds) {
+    char m[13], suffix[10];
+    unsigned hash;
+    if (sscanf(cmd.first.c_str(), "mesh_gw/%12[0-9A-F]_%u/%9s", m, &hash, suffix) != 3)
+      continue;  // Altri topic mesh_gw/<x>/set, es. channel/set
+    int topic = find_name(suffix, suffixes, 3);
+    auto node = this->registry_.find(m);
+    RegEntity *e = topic < 0 || node == this->registry_.end() ? nullptr : this->find_entity(node->second, hash);
+    const RootType *rt = e != nullptr ? root_type_of(e->type_id) : nullptr;
+    CmdPayload c;
+    c.type_id = e != nullptr ? e->type_id : 0;
+    c.value = 0;
+    c.entity_hash = hash;
+    if (rt == nullptr || rt->command == nullptr || !rt->command(topic, cmd.second, *e, c)) {
+      ESP_LOGW(TAG, "Command '%s' on %s rejected", cmd.second.c_str(), cmd.first.c_str());
+      continue;
+    }
+    {
+      LockGuard guard(this->owner_lock_);
+      auto o = this->node_owners_.find(m);
+      if (o != this->node_owners_.end() && !o->second.root.empty() && o->second.root != this->root_hex_)
+        continue;  // Lo inoltra il Root che serve il nodo
+    }
+    uint8_t mac[6];
+    parse_hex(m, mac, 6);
+    MeshHeader h;
+    this->fill_header(h, PKT_CMD, mac, MESH_DEFAULT_TTL, PRIO_CONTROL);
+    h.seq = this->group_seq_++;
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(&c);
+    std::vector<uint8_t> pl(p, p + sizeof(c));
+    this->auth_sign(h, pl);
+    this->route_packet(&h, pl.data(), pl.size());
+  }
+}
+
+// mesh_gw/<MAC>/groups, payload "1,5,7" (vuoto = nessun gruppo)
+void EspMesh::on_group_assign(const std::string &topic, const std::string &payload) {
+  uint8_t mac[6];
+  if (topic.size() != strlen("mesh_gw/") + 12 + strlen("/groups") || !parse_hex(topic.c_str() + 8, mac, 6))
+    return;
+  GroupSet gs;
+  gs.groups = 0;
+  const char *p = payload.c_str();
+  while (*p) {
+    char *end;
+    unsigned long g = strtoul(p, &end, 10);
+    if (end == p)
+      break;
+    if (g >= 1 && g <= MESH_GROUPS)
+      gs.groups |= 1u << (g - 1);
+    p = *end ? end + 1 : end;
+  }
+  MeshHeader h;
+  this->fill_header(h, PKT_GROUP_SET, mac, MESH_DEFAULT_TTL, PRIO_CONTROL);
+  const uint8_t *gp = reinterpret_cast<const uint8_t *>(&gs);
+  LockGuard guard(this->ctrl_lock_);
+  this->ctrl_pending_.emplace_back(h, std::vector<uint8_t>(gp, gp + sizeof(gs)));
+}
+
+// Il canale del Root è quello del suo AP. Se cambia, i nodi sul vecchio
+// canale non possono più sentirlo: si annuncia subito sul nuovo, così chi
+// scansiona lo trova al primo passaggio, e il primo nodo che si riaggancia
+// avvisa gli altri sul vecchio canale. Con una migrazione pianificata
+// (mesh_gw/channel/set) la mesh è già sul canale nuovo.
+void EspMesh::check_channel(uint32_t now) {
+  if (now - this->last_channel_check_ >= MIGRATE_POLL_MS) {
+    this->last_channel_check_ = now;
+    uint8_t primary;
+    wifi_second_chan_t second;
+    if (esp_wifi_get_channel(&primary, &second) == ESP_OK && primary != this->root_channel_) {
+      if (this->root_channel_ != 0) {
+        ESP_LOGW(TAG, "AP channel changed %u -> %u", this->root_channel_, primary);
+        this->stats_.channel_moves++;
+        this->next_announce_ = now;
+      }
+      this->root_channel_ = primary;
+      char ch[4];
+      snprintf(ch, sizeof(ch), "%u", primary);
+      this->queue_publish("mesh_gw/channel", ch, 0, true, true);
+    }
+  }
+
+  std::vector<uint8_t> frame;
+  {
+    LockGuard guard(this->ctrl_lock_);
+    if (this->migrate_left_ == 0 || static_cast<int32_t>(now - this->migrate_next_) < 0)
+      return;
+    this->migrate_left_--;
+    this->migrate_next_ = now + MIGRATE_REPEAT_MS;
+    frame = this->migrate_frame_;
+  }
+  // Stessa seq a ogni copia: i nodi che l'hanno già ricevuta la scartano
+  auto *h = reinterpret_cast<MeshHeader *>(frame.data());
+  this->route_packet(h, frame.data() + sizeof(MeshHeader), frame.size() - sizeof(MeshHeader));
+}
+
+void EspMesh::on_channel_set(const std::string &payload) {
+  unsigned ch, delay_s = MIGRATE_DELAY_MS / 1000;
+  if (sscanf(payload.c_str(), "%u %u", &ch, &delay_s) < 1 || ch < 1 || ch > 13) {
+    ESP_LOGW(TAG, "Invalid channel migration '%s'", payload.c_str());
+    return;
+  }
+  uint8_t bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+  MeshHeader h;
+  this->fill_header(h, PKT_MIGRATE, bcast, MESH_DEFAULT_TTL, PRIO_CONTROL | MESH_FLAG_FLOOD);
+  MigratePayload m{static_cast<uint8_t>(ch), this->mesh_time() + std::max(delay_s, 1u) * 1000};
+  h.seq = this->group_seq_++;
+  // Una sola firma: le copie ripetute hanno lo stesso contatore e i nodi
+  // che ne hanno già accettata una scartano le altre
+  const uint8_t *p = reinterpret_cast<const uint8_t *>(&m);
+  std::vector<uint8_t> pl(p, p + sizeof(m));
+  this->auth_sign(h, pl);
+  LockGuard guard(this->ctrl_lock_);
+  this->migrate_frame_.resize(sizeof(h) + pl.size());
+  memcpy(this->migrate_frame_.data(), &h, sizeof(h));
+  memcpy(this->migrate_frame_.data() + sizeof(h), pl.data(), pl.size());
+  this->migrate_left_ = MIGRATE_REPEAT;
+  this->migrate_next_ = millis();
+  ESP_LOGI(TAG, "Planned migration to channel %u in %u s", ch, delay_s);
+}
+
+bool EspMesh::decode_text(const MeshHeader *h, RegEntity &e, const uint8_t *payload, int len, std::string &out) {
+  if (len < 1)
+    return false;
+  uint8_t tag = payload[0];
+  if (tag == DICT_LITERAL) {
+    out.assign(reinterpret_cast<const char *>(payload + 1), len - 1);
+    return true;
+  }
+  if (tag == DICT_LEARN) {
+    if (len < 2 || payload[1] >= DICT_MAX_CODES)
+      return false;
+    out.assign(reinterpret_cast<const char *>(payload + 2), len - 2);
+    if (e.dict.size() <= payload[1])
+      e.dict.resize(payload[1] + 1);
+    e.dict[payload[1]] = out;
+    return true;
+  }
+  // Le voci vuote sono slot mai insegnati (il nodo non impara stringhe vuote)
+  if (tag < e.dict.size() && !e.dict[tag].empty()) {
+    out = e.dict[tag];
+    return true;
+  }
+  DictMiss m;
+  m.index = &e - this->registry_[mac_hex(h->src)].entities.data();
+  m.code = tag;
+  MeshHeader r;
+  this->fill_header(r, PKT_DICT_MISS, h->src, MESH_DEFAULT_TTL, PRIO_CONTROL);
+  this->route_packet(&r, reinterpret_cast<uint8_t *>(&m), sizeof(m));
+  return false;
+}
+
+// Mesh time d'origine accanto allo stato (ms dell'orologio del Root)
+void EspMesh::publish_origin_ts(const std::string &uid, uint32_t origin_ts, bool coalesce) {
+  if (origin_ts == 0)
+    return;
+  this->queue_publish("mesh_gw/" + uid + "/ts", to_string(origin_ts), 0, false, coalesce);
+}
+
+// --- GRAFO DI TOPOLOGIA ---
+// Snapshot retained su mesh_gw/topology/<root>; poi solo diff su .../diff
+// quando cambia un arco. Le variazioni di RSSI restano nel prossimo snapshot.
+void EspMesh::handle_topo(const uint8_t *origin, const uint8_t *payload, int len) {
+  if (len < (int) sizeof(TopoPayload))
+    return;
+  TopoPayload t;
+  memcpy(&t, payload, sizeof(t));
+  if (len < (int) (sizeof(TopoPayload) + t.n_neighbors * sizeof(TopoNeighbor)))
+    return;
+
+  std::string id = mac_hex(origin);
+  auto it = this->topo_.find(id);
+  bool fresh = it == this->topo_.end();
+  TopoNode &n = this->topo_[id];
+  std::string parent = mac_hex(t.parent);
+  bool edge_changed = fresh || n.parent != parent || n.hop != t.hop || n.children != t.children;
+
+  n.parent = parent;
+  n.hop = t.hop;
+  n.path_cost = t.path_cost;
+  n.children = t.children;
+  n.last_report = millis();
+  n.neighbors.clear();
+  for (uint8_t i = 0; i < t.n_neighbors; i++) {
+    TopoNeighbor tn;
+    memcpy(&tn, payload + sizeof(TopoPayload) + i * sizeof(TopoNeighbor), sizeof(tn));
+    n.neighbors.emplace_back(mac_hex(tn.mac), tn.rssi);
+  }
+  this->topo_dirty_ = true;
+
+  // Manifest diverso dal registro (entità aggiunte o tolte, registrazioni
+  // perse): la tabella del nodo si ricostruisce da capo
+  auto rit = this->registry_.find(id);
+  if (rit != this->registry_.end() && t.manifest != this->reg_manifest(rit->second)) {
+    uint32_t now = millis();
+    if (rit->second.last_resync == 0 || now - rit->second.last_resync >= REG_RESYNC_MS) {
+      ESP_LOGI(TAG, "Manifest of %s changed, requesting re-registration", id.c_str());
+      rit->second.entities.clear();
+      rit->second.overflow.clear();
+      rit->second.dirty = true;
+      this->request_resync(origin, rit->second);
+    }
+  }
+
+  if (edge_changed && this->topo_snapshot_sent_)
+    this->queue_publish("mesh_gw/topology/" + this->root_hex_ + "/diff", this->topo_node_json(id, n), 0, false,
+                        false);
+}
+
+std::string EspMesh::topo_node_json(const std::string &id, const TopoNode &n) {
+  std::string j = "{\"id\":\"" + id + "\",\"parent\":\"" + n.parent + "\",\"hop\":" + to_string(n.hop) +
+                  ",\"cost\":" + to_string(n.path_cost) + ",\"children\":" + to_string(n.children) + ",\"nbr\":[";
+  for (size_t i = 0; i < n.neighbors.size(); i++) {
+    if (i)
+      j += ",";
+    j += "{\"id\":\"" + n.neighbors[i].first + "\",\"rssi\":" + to_string(n.neighbors[i].second) + "}";
+  }
+  return j + "]}";
+}
+
+void EspMesh::check_topology(uint32_t now) {
+  for (auto it = this->topo_.begin(); it != this->topo_.end();) {
+    if (now - it->second.last_report > TOPO_EXPIRE_MS) {
+      if (this->topo_snapshot_sent_)
+        this->queue_publish("mesh_gw/topology/" + this->root_hex_ + "/diff",
+                            "{\"id\":\"" + it->first + "\",\"removed\":true}", 0, false, false);
+      it = this->topo_.erase(it);
+      this->topo_dirty_ = true;
+    } else {
+      ++it;
+    }
+  }
+
+  if (!this->mqtt_ || !this->mqtt_->is_connected())
+    return;
+  bool due = this->topo_dirty_ && now - this->last_topo_snapshot_ > TOPO_SNAPSHOT_MS;
+  if (this->topo_snapshot_sent_ && !due)
+    return;
+
+  std::string j = "{\"root\":\"" + this->root_hex_ + "\",\"nodes\":[";
+  bool first = true;
+  for (auto &kv : this->topo_) {
+    if (!first)
+      j += ",";
+    first = false;
+    j += this->topo_node_json(kv.first, kv.second);
+  }
+  this->queue_publish("mesh_gw/topology/" + this->root_hex_, j + "]}", 0, true, true);
+  this->topo_snapshot_sent_ = true;
+  this->topo_dirty_ = false;
+  this->last_topo_snapshot_ = now;
+}
+
+// --- ROLLOUT OTA (ROOT) ---
+// mesh_gw/ota/start: "<nodo|*> <byte> <sha256 hex>" oppure "stop". Il Root
+// chiede i blocchi all'uploader su mesh_gw/ota/fetch ("<offset> <len>") e li
+// riceve su mesh_gw/ota/data/<offset>. Con "*" i blocchi vanno in broadcast.
+void EspMesh::on_ota_start(const std::string &payload) {
+  LockGuard guard(this->ota_lock_);
+  if (payload == "stop") {
+    ESP_LOGI(TAG, "OTA rollout stopped");
+    this->ota_ = OtaSession{};
+    return;
+  }
+
+  char target[16], sha[65];
+  unsigned size;
+  if (sscanf(payload.c_str(), "%15s %u %64s", target, &size, sha) != 3 || strlen(sha) != 64 || size == 0) {
+    ESP_LOGW(TAG, "Invalid OTA start command");
+    return;
+  }
+
+  OtaSession s;
+  if (!parse_hex(sha, s.sha256, 32))
+    return;
+  s.multicast = strcmp(target, "*") == 0;
+  if (s.multicast) {
+    // Tutti i nodi serviti da questo Root
+    LockGuard owners(this->owner_lock_);
+    for (auto &kv : this->node_owners_) {
+      uint8_t mac[6];
+      if (kv.second.root == this->root_hex_ && parse_hex(kv.first.c_str(), mac, 6))
+        s.nodes[std::string(reinterpret_cast<const char *>(mac), 6)];
+    }
+  } else {
+    uint8_t mac[6];
+    if (strlen(target) != 12 || !parse_hex(target, mac, 6))
+      return;
+    s.nodes[std::string(reinterpret_cast<const char *>(mac), 6)];
+  }
+
+  s.active = true;
+  s.id = random_uint32() & 0xFFFF;
+  s.size = size;
+  s.count = (size + OTA_BLOCK - 1) / OTA_BLOCK;
+  s.started = millis();
+  s.bytes_sent = 0;
+  this->ota_ = std::move(s);
+  ESP_LOGI(TAG, "OTA rollout of %u bytes to %u node(s)", size, (unsigned) this->ota_.nodes.size());
+}
+
+void EspMesh::on_ota_data(const std::string &topic, const std::string &payload) {
+  uint32_t offset = strtoul(topic.c_str() + topic.rfind('/') + 1, nullptr, 10);
+  LockGuard guard(this->ota_lock_);
+  OtaSession &s = this->ota_;
+  if (!s.active || offset % OTA_BLOCK != 0)
+    return;
+  uint32_t first = offset / OTA_BLOCK;
+  s.fetching.erase(first);
+  for (uint32_t i = 0; i * OTA_BLOCK < payload.size() && first + i < s.count; i++) {
+    if (s.cache.size() >= OTA_ROOT_CACHE)
+      break;
+    s.cache[first + i].data = payload.substr(i * OTA_BLOCK, OTA_BLOCK);
+  }
+
+  // I nodi in attesa di questi blocchi non devono aspettare il loro timeout
+  uint32_t now = millis();
+  for (auto &kv : s.nodes) {
+    if (kv.second.started && kv.second.finished == 0)
+      this->serve_ota(kv.first, kv.second, now);
+  }
+}
+
+void EspMesh::handle_ota_req(const uint8_t *origin, const uint8_t *payload, int len) {
+  if (len < (int) sizeof(OtaReq))
+    return;
+  OtaReq r;
+  memcpy(&r, payload, sizeof(r));
+  std::string key(reinterpret_cast<const char *>(origin), 6);
+  uint32_t now = millis();
+
+  LockGuard guard(this->ota_lock_);
+  OtaSession &s = this->ota_;
+  auto it = s.nodes.find(key);
+  if (!s.active || it == s.nodes.end())
+    return;
+  OtaProgress &p = it->second;
+  if (r.session != s.id) {
+    this->send_ota_offer(key, now);  // Sessione vecchia: il nodo riprende con la nuova
+    return;
+  }
+
+  if (!p.started) {
+    p.started = true;
+    p.first_req = now;
+  }
+  p.last_seen = now;
+  bool moved = r.base != p.base || r.status != p.status;
+  p.base = r.base;
+  p.missing = r.missing;
+  p.status = r.status;
+
+  if (r.status != OTA_ST_RUNNING) {
+    if (p.finished == 0) {
+      p.finished = now;
+      uint32_t ms = std::max<uint32_t>(now - p.first_req, 1);
+      ESP_LOGI(TAG, "OTA %s on %s after %u ms (%u B/s)", r.status == OTA_ST_DONE ? "done" : "failed",
+               mac_hex(origin).c_str(), ms, (uint32_t) ((uint64_t) s.size * 1000 / ms));
+      this->publish_ota_status(key, p);
+    }
+    return;
+  }
+  if (moved)
+    this->publish_ota_status(key, p);
+  this->serve_ota(key, p, now);
+}
+
+// Blocchi chiesti dal nodo che sono in cache; gli altri, e la finestra
+// successiva in anticipo, si chiedono all'uploader
+void EspMesh::serve_ota(const std::string &node, OtaProgress &p, uint32_t now) {
+  OtaSession &s = this->ota_;
+  for (uint8_t i = 0; i < OTA_WINDOW; i++) {
+    if (!(p.missing & (1 << i)))
+      continue;
+    uint32_t b = p.base + i;
+    auto it = s.cache.find(b);
+    if (it == s.cache.end()) {
+      this->fetch_ota(b, now);
+      continue;
+    }
+    this->send_ota_block(s.multicast ? nullptr : reinterpret_cast<const uint8_t *>(node.data()), b, it->second,
+                         now);
+    p.missing &= ~(1 << i);
+  }
+  for (uint32_t b = p.base + OTA_WINDOW; b < p.base + 2 * OTA_WINDOW; b += OTA_FETCH_BLOCKS)
+    this->fetch_ota(b, now);
+}
+
+void EspMesh::fetch_ota(uint32_t block, uint32_t now) {
+  OtaSession &s = this->ota_;
+  uint32_t first = block - block % OTA_FETCH_BLOCKS;
+  if (first >= s.count || s.cache.count(first))
+    return;
+  auto f = s.fetching.find(first);
+  if (f != s.fetching.end() && now - f->second < OTA_FETCH_TIMEOUT_MS)
+    return;
+  if (s.cache.size() + OTA_FETCH_BLOCKS > OTA_ROOT_CACHE)
+    return;
+  s.fetching[first] = now;
+  uint32_t offset = first * OTA_BLOCK;
+  uint32_t bytes = std::min<uint32_t>(OTA_FETCH_BLOCKS * OTA_BLOCK, s.size - offset);
+  this->queue_publish("mesh_gw/ota/fetch", to_string(offset) + " " + to_string(bytes), 0, false, false);
+}
+
+void EspMesh::send_ota_block(const uint8_t *dst, uint32_t block, OtaBlock &b, uint32_t now) {
+  static const uint8_t bcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+  // In multicast più nodi chiedono la stessa finestra: un solo broadcast li serve tutti
+  if (dst == nullptr && b.last_sent != 0 && now - b.last_sent < OTA_REBCAST_MS)
+    return;
+  b.last_sent = now;
+
+  uint8_t buf[sizeof(OtaData) + OTA_BLOCK];
+  OtaData d{this->ota_.id, block};
+  memcpy(buf, &d, sizeof(d));
+  memcpy(buf + sizeof(d), b.data.data(), b.data.size());
+  MeshHeader h;
+  this->fill_header(h, PKT_OTA_DATA, dst ? dst : bcast, MESH_DEFAULT_TTL, PRIO_BULK);
+  this->route_packet(&h, buf, sizeof(d) + b.data.size());
+  this->ota_.bytes_sent += b.data.size();
+}
+
+// L'offerta porta l'hash: viaggia solo unicast, quindi cifrata
+void EspMesh::send_ota_offer(const std::string &node, uint32_t now) {
+  OtaSession &s = this->ota_;
+  OtaOffer o;
+  o.session = s.id;
+  o.size = s.size;
+  memcpy(o.sha256, s.sha256, 32);
+  o.multicast = s.multicast;
+  MeshHeader h;
+  this->fill_header(h, PKT_OTA_OFFER, reinterpret_cast<const uint8_t *>(node.data()), MESH_DEFAULT_TTL,
+                    PRIO_CONTROL);
+  this->route_packet(&h, reinterpret_cast<uint8_t *>(&o), sizeof(o));
+  s.nodes[node].last_offer = now;
+}
+
+void EspMesh::publish_ota_status(const std::string &node, const OtaProgress &p) {
+  static const char *const names[] = {"running", "done", "hash_fail", "error"};
+  std::string id = mac_hex(reinterpret_cast<const uint8_t *>(node.data()));
+  std::string j = "{\"block\":" + to_string(p.base) + ",\"of\":" + to_string(this->ota_.count) + ",\"status\":\"" +
+                  names[std::min<uint8_t>(p.status, OTA_ST_ERROR)] + "\"";
+  if (p.finished)
+    j += ",\"ms\":" + to_string(p.finished - p.first_req);
+  this->queue_publish("mesh_gw/ota/status/" + id, j + "}", 0, true, true);
+}
+
+// Offerte ai nodi che non hanno ancora risposto, timeout, pulizia della
+// cache e riepilogo del rollout (tempo totale, throughput)
+void EspMesh::check_ota(uint32_t now) {
+  LockGuard guard(this->ota_lock_);
+  OtaSession &s = this->ota_;
+  if (!s.active)
+    return;
+
+  bool all_done = true;
+  uint32_t min_base = s.count;
+  for (auto &kv : s.nodes) {
+    OtaProgress &p = kv.second;
+    if (p.finished)
+      continue;
+    uint32_t idle_since = p.started ? p.last_seen : s.started;
+    if (now - idle_since > OTA_NODE_TIMEOUT_MS) {
+      p.finished = now;
+      p.status = OTA_ST_ERROR;
+      ESP_LOGW(TAG, "OTA gave up on %s at block %u",
+               mac_hex(reinterpret_cast<const uint8_t *>(kv.first.data())).c_str(), p.base);
+      this->publish_ota_status(kv.first, p);
+      continue;
+    }
+    all_done = false;
+    if (!p.started && now - p.last_offer > OTA_OFFER_INTERVAL_MS)
+      this->send_ota_offer(kv.first, now);
+    min_base = std::min(min_base, p.base);
+  }
+
+  // Un blocco già scritto da tutti non serve più
+  for (auto it = s.cache.begin(); it != s.cache.end() && it->first < min_base;)
+    it = s.cache.erase(it);
+
+  if (!all_done)
+    return;
+  uint32_t done = 0;
+  for (auto &kv : s.nodes)
+    done += kv.second.status == OTA_ST_DONE;
+  uint32_t ms = std::max<uint32_t>(now - s.started, 1);
+  ESP_LOGI(TAG, "OTA rollout finished: %u/%u nodes in %u ms, %u bytes on air (%u B/s)", done,
+           (unsigned) s.nodes.size(), ms, s.bytes_sent, (uint32_t) ((uint64_t) s.bytes_sent * 1000 / ms));
+  this->queue_publish("mesh_gw/ota/result",
+                      "{\"nodes\":" + to_string(s.nodes.size()) + ",\"done\":" + to_string(done) +
+                          ",\"ms\":" + to_string(ms) + ",\"bytes\":" + to_string(s.bytes_sent) + "}",
+                      0, false, false);
+  this->ota_ = OtaSession{};
+}
+
+// --- CODA DI PUBBLICAZIONE ---
+// Il percorso dei pacchetti non tocca mai il broker: accoda e torna subito.
+void EspMesh::queue_publish(const std::string &topic, const std::string &payload, uint8_t qos, bool retain,
+                            bool coalesce) {
+  LockGuard guard(this->pub_lock_);
+  if (coalesce) {
+    for (auto &p : this->pub_queue_) {
+      if (p.coalesce && p.topic == topic) {
+        p.payload = payload;
+        this->stats_.pub_coalesced++;
+        return;
+      }
+    }
+  }
+
+  if (this->pub_queue_.size() >= PUB_QUEUE_DEPTH) {
+    // Si sacrifica lo stato più vecchio; discovery ed eventi non si perdono
+    // per primi, i messaggi di controllo mai
+    auto victim = std::find_if(this->pub_queue_.begin(), this->pub_queue_.end(),
+                               [](const PendingPublish &p) { return p.coalesce; });
+    this->stats_.pub_dropped++;
+    if (victim == this->pub_queue_.end())
+      return;
+    this->pub_queue_.erase(victim);
+  }
+  this->pub_queue_.push_back(PendingPublish{topic, payload, qos, retain, coalesce, false});
+}
+
+// Rivendicazioni e disponibilità: una rivendicazione persa lascerebbe il nodo a
+// un altro Root, quindi entrano sempre, anche oltre PUB_QUEUE_DEPTH. Sono
+// retained: una più recente sullo stesso topic prende il posto di quella in coda.
+void EspMesh::queue_control(const std::string &topic, const std::string &payload) {
+  LockGuard guard(this->pub_lock_);
+  for (auto &p : this->pub_queue_) {
+    if (p.control && p.topic == topic) {
+      p.payload = payload;
+      return;
+    }
+  }
+  this->pub_queue_.push_back(PendingPublish{topic, payload, 1, true, false, true});
+}
+
+// Token bucket a publish_rate_ messaggi/s, burst massimo di un secondo
+void EspMesh::drain_publish_queue(uint32_t now) {
+  float elapsed = (now - this->last_pub_drain_) / 1000.0f;
+  this->last_pub_drain_ = now;
+  if (!this->mqtt_ || !this->mqtt_->is_connected()) {
+    // Durante i buchi WiFi la coda coalesce e aspetta; i token no, o alla
+    // riconnessione partirebbe una raffica
+    this->pub_tokens_ = 0;
+    return;
+  }
+  this->pub_tokens_ = std::min<float>(this->pub_tokens_ + elapsed * this->publish_rate_, this->publish_rate_);
+
+  while (this->pub_tokens_ >= 1.0f) {
+    PendingPublish p;
+    {
+      LockGuard guard(this->pub_lock_);
+      if (this->pub_queue_.empty())
+        return;
+      p = std::move(this->pub_queue_.front());
+      this->pub_queue_.pop_front();
+    }
+    this->pub_tokens_ -= 1.0f;
+    this->mqtt_->publish(p.topic, p.payload, p.qos, p.retain);
+    this->stats_.pub_sent++;
+    this->publish_count_++;
+  }
 }
 #endif
 
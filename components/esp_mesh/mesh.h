@@ -2,10 +2,23 @@
 #include "esphome/core/component.h"
 #include "esphome/core/application.h"
 #include "esphome/core/entity_base.h"
+#include "esphome/core/preferences.h"
 #include <vector>
 #include <map>
 #include <string>
 #include <list>
+#include <deque>
+#include <cstddef>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <esp_cpu.h>
+
+#include <mbedtls/sha256.h>
+
+#ifdef IS_NODE
+#include <esp_ota_ops.h>
+#endif
 
 #ifdef USE_BINARY_SENSOR
 #include "esphome/components/binary_sensor/binary_sensor.h"
@@ -66,12 +79,195 @@ namespace esp_mesh {
 // Limite di sicurezza peer cifrati (Max HW è 17, teniamo margine)
 #define MAX_PEERS 6 
 
+// Limiti di trama ESP-NOW
+#define MESH_MAX_FRAME 250
+#define MESH_DEFAULT_TTL 10
+
+// Frammentazione: messaggi logici oltre un frame vengono spezzati
+#define FRAG_MAX_COUNT 8         // Frammenti per messaggio (bitmask a 8 bit)
+#define FRAG_MAX_SLOTS 4         // Buffer di riassemblaggio contemporanei sul Root
+#define FRAG_TX_CACHE 2          // Messaggi frammentati tenuti dal nodo per ritrasmissione
+#define FRAG_NACK_DELAY_MS 300   // Silenzio prima di chiedere i frammenti mancanti
+#define FRAG_MAX_NACKS 3
+#define FRAG_TIMEOUT_MS 3000
+
+// Code di trasmissione per classe di priorità
+#define TX_QUEUE_DEPTH 8         // Frame per classe
+#define TX_BUSY_TIMEOUT_MS 50    // Frame in volo senza send callback
+
+// Scheduler: periodi con jitter, ascolto dei vicini, slot opzionali
+#define ANNOUNCE_INTERVAL_MS 5000
+#define ANNOUNCE_JITTER_MS 500   // ±10% sul periodo degli annunci
+#define ANNOUNCE_GUARD_MS 30     // Annuncio di un vicino così recente: si rimanda
+#define TX_JITTER_MS 20          // Ritardo casuale massimo dei frame propri non di controllo
+#define MAX_TX_SLOTS 64
+#define STATS_INTERVAL_MS 60000
+
+// ACK end-to-end (Root -> originatore)
+#define ACK_WINDOW 32            // Sequenze coperte da un singolo ACK
+#define RTX_BUFFER 8             // Frame affidabili in attesa di ACK sul nodo
+#define RTX_MAX_RETRIES 4
+#define RTO_INIT_PER_HOP_MS 150  // RTO iniziale, prima di avere misure RTT
+#define RTO_MIN_MS 50
+#define RTO_MAX_MS 4000
+#define RTT_HOP_BUCKETS 8        // Stimatori RTT indicizzati per hop count
+#define RELIABLE_REG_BIT 0       // Bit della reliable mask per PKT_REG (gli altri = EntityType)
+
+// Selezione del parent / multi-root
+#define LINK_COST_BASE 16        // Costo di un hop con buon segnale
+#define LINK_RSSI_GOOD -70       // Sotto questa soglia ogni dB costa 1
+#define LOAD_COST_SHIFT 3        // Penalità di carico = root_load >> 3 (max 31)
+#define PARENT_HYSTERESIS 8      // Miglioramento minimo per cambiare parent
+#define ROOT_LOAD_INTERVAL_MS 10000
+#define OWNER_LEASE_MS 60000     // Validità della rivendicazione MQTT di un nodo
+#define AVAIL_PINGS 3            // Ping senza risposta prima di dichiarare offline
+#define AVAIL_PING_INTERVAL_MS 5000
+#define AVAIL_BATCH_MS 1000      // Cambi di disponibilità pubblicati insieme, al massimo così
+#define MESH_GROUP_PREFIX 0xFE   // dst = {0xFE, 0, 0, 0, 0, gruppo}: multicast lungo l'albero
+#define MESH_GROUPS 32           // Gruppi 1..32, bit (g - 1) delle maschere
+#define AUTH_TAG_LEN 8           // Byte di HMAC-SHA256 (chiave PMK) in coda ai frame autenticati
+#define AUTH_BLOCK 256           // Contatori di firma riservati in NVS a ogni salvataggio
+#define AUTH_SOURCES 8           // Sorgenti autenticate ricordate contro i replay
+#define AUTH_WINDOW 32           // Contatori fuori ordine accettati per sorgente
+#define AUTH_SAVE_MS 60000       // Node: intervallo minimo tra due salvataggi NVS delle finestre
+#define MIGRATE_POLL_MS 1000     // Root: controllo del canale imposto dall'AP
+#define MIGRATE_DELAY_MS 3000    // Root: anticipo di default di una migrazione pianificata
+#define MIGRATE_REPEAT 3         // Root: copie dell'annuncio di migrazione (stessa seq)
+#define MIGRATE_REPEAT_MS 500
+#define MIGRATE_GRACE_MS 50      // Node: tempo per rilanciare l'avviso prima di cambiare canale
+#define MIGRATE_DWELL_MS 2000    // Node: permanenza sul canale annunciato prima di tornare a scansionare
+#define MIGRATE_VISIT_MS 30      // Node: visita al vecchio canale per avvisare chi è rimasto indietro
+#define PARENT_LOSS_ANNOUNCES 3  // Annunci del parent persi prima di dichiararlo morto
+#define PARENT_MAX_FAILS 3       // Invii consecutivi al parent senza ACK MAC
+#define PARENT_CANDIDATE_TTL_MS 12000  // Vicino valido come riserva se sentito da così poco
+
+// Multipath: parent alternativi a costo (quasi) pari, scelti per flusso
+#define MULTIPATH_MAX 3          // Parent upstream contemporanei, primario incluso
+#define MULTIPATH_COST_SLACK 4   // Costo extra tollerato rispetto al primario
+#define QUEUE_COST_PER_FRAME 2   // Penalità annunciata per frame in coda (picco tra due annunci)
+#define AGG_HOLD_MS 20           // Repeater: attesa massima per unire dati di più originatori
+#define TEST_REPORT_MS 10000     // Root: finestra del riepilogo del traffico di test
+#define TEST_MAX_BURST 4         // Node: frame di test recuperati per giro se in ritardo
+
+// Orologio di mesh (riferimento = millis() del Root)
+#define TIME_HOP_DELAY_MS 1      // Volo + elaborazione di un hop, oltre alla coda
+#define CLOCK_STEP_MS 1000       // Errori maggiori: si riallinea senza stimare il drift
+#define CLOCK_DRIFT_GAIN 0.5f
+#define CLOCK_DRIFT_MAX 0.0005f  // ±500 ppm
+
+// Coda di pubblicazione MQTT (Root)
+#define PUB_QUEUE_DEPTH 32
+
+// OTA via mesh: blocchi a finestra confermati, cache nei repeater
+#define OTA_WINDOW 8             // Blocchi richiesti per volta (= profondità della coda bulk)
+#define OTA_REQ_TIMEOUT_MS 400   // Nessun blocco nuovo: si richiedono i mancanti
+#define OTA_OFFER_INTERVAL_MS 5000
+#define OTA_REPEATER_CACHE 16    // Blocchi tenuti da un repeater per il suo sottoalbero
+#define OTA_ROOT_CACHE 64        // Blocchi scaricati dal Root e non ancora serviti a tutti
+#define OTA_FETCH_BLOCKS 4       // Blocchi per richiesta MQTT all'uploader
+#define OTA_FETCH_TIMEOUT_MS 2000
+#define OTA_REBCAST_MS 100       // Multicast: lo stesso blocco non riparte prima di così
+#define OTA_NODE_TIMEOUT_MS 300000  // Root: nodo muto così a lungo, rollout chiuso per lui
+#define OTA_REBOOT_DELAY_MS 2000
+
+// Profilazione dei percorsi caldi sul dispositivo; le regressioni si
+// misurano con il benchmark host (bench/) contro la sua baseline
+#ifndef CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ
+#define CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ 240
+#endif
+
+// Task dedicato alla mesh (opzionale)
+#define MESH_TASK_STACK 8192
+#define MESH_EVENT_QUEUE 16      // Eventi RX / TX-complete / invii locali in attesa
+#define MESH_TASK_TICK_MS 10     // Risveglio massimo per i timer senza eventi
+
+// Scadenza delle rotte: timer wheel a hash (tick x slot = un giro)
+#define ROUTE_WHEEL_TICK_MS 1000
+#define ROUTE_WHEEL_SLOTS 64
+#define ROUTE_MAX_FAILS 2        // Invii consecutivi falliti verso un next hop: rotte invalidate
+
+// Topologia: report compatti dei nodi, grafo sul Root
+#define TOPO_NEIGHBORS 3             // Vicini più forti inclusi nel report
+#define TOPO_MAX_TRACKED 8           // Vicini seguiti dal nodo
+#define TOPO_NEIGHBOR_TTL_MS 30000   // Vicino non più sentito: escluso
+#define TOPO_MIN_INTERVAL_MS 10000   // Report su cambiamento, non più spesso di così
+#define TOPO_REFRESH_MS 300000       // Report comunque, anche senza cambiamenti
+#define TOPO_EXPIRE_MS 900000        // Root: nodo senza report rimosso dal grafo
+#define TOPO_SNAPSHOT_MS 300000      // Root: snapshot retained rinfrescato al massimo così
+
 enum PktType : uint8_t {
     PKT_PROBE   = 0x01, 
     PKT_ANNOUNCE= 0x02, 
     PKT_REG     = 0x10, 
+    PKT_REG_ACK = 0x11,
+    PKT_DICT_MISS = 0x12,
     PKT_DATA    = 0x20, 
-    PKT_CMD     = 0x30  
+    PKT_AGG     = 0x21,
+    PKT_TEST    = 0x22,   // Traffico sintetico della modalità di test
+    PKT_CMD     = 0x30,
+    PKT_GROUP_SET = 0x31,
+    PKT_FRAG    = 0x40,
+    PKT_FRAG_NACK = 0x41,
+    PKT_ACK     = 0x50,
+    PKT_TOPO    = 0x60,
+    PKT_PING    = 0x61,   // Root -> nodo silenzioso: basta un qualsiasi frame in risposta
+    PKT_PONG    = 0x62,
+    PKT_MIGRATE = 0x63,   // Flooding: tutta la mesh passa a un altro canale
+    PKT_OTA_OFFER = 0x70,
+    PKT_OTA_REQ = 0x71,
+    PKT_OTA_DATA = 0x72
+};
+
+// Classi di priorità (0 = più urgente), portate nei bit bassi di MeshHeader::flags
+enum PktPrio : uint8_t {
+    PRIO_CONTROL = 0,    // Comandi, allarmi, controllo mesh
+    PRIO_STATE   = 1,    // Cambi di stato
+    PRIO_BULK    = 2,    // Telemetria e registrazioni
+    PRIO_CLASSES = 3
+};
+
+#define MESH_FLAG_PRIO_MASK 0x03
+#define MESH_FLAG_ACK_REQ   0x04   // Il Root deve confermare (seq valido)
+#define MESH_FLAG_TIMESTAMP 0x08   // PKT_DATA preceduto da uint32 mesh time d'origine
+#define MESH_FLAG_INDEX     0x10   // PKT_DATA identifica l'entità con l'indice (1 byte) invece dell'hash
+#define MESH_FLAG_DELTA     0x20   // Valore come [tag base][int8 delta] rispetto all'ultimo assoluto confermato
+#define MESH_FLAG_FLOOD     0x40   // Gruppo: rilancio da ogni nodo (con soppressione duplicati), non solo lungo l'albero
+
+#define ENTITY_INDEX_MAX 255       // Indici 0..254: oltre, l'entità resta sull'hash
+#define REG_RESYNC_MS 10000        // Indice sconosciuto al Root: ri-registrazione al massimo così
+#define REG_PACE_MS 50             // Node: una registrazione per passo della scansione
+#define REG_PREBUILT_MAX 200       // Registrazione serializzata da __init__.py, byte massimi
+#define REG_PERSIST_NODES 32       // Root: nodi salvati in NVS (short ID = slot)
+#define REG_PERSIST_ENTITIES 24    // Root: entità salvate per nodo
+#define REG_SAVE_MS 60000          // Root: salvataggio dei nodi modificati al massimo così
+#define REG_REFRESH_MS 21600000    // Root: salvataggio completo (inattività aggiornata)
+#define REG_EXPIRE_S 604800        // Root: nodo non sentito da una settimana dimenticato
+#define DELTA_REFRESH 16           // Dopo tanti delta si rimanda un assoluto (nuova base)
+#define DICT_LEARNED 16            // Stringhe apprese per entità (oltre le opzioni statiche)
+#define DICT_MAX_CODES 0xF0        // Codici per entità, opzioni comprese
+#define DICT_MAX_LEN 32            // Stringhe più lunghe viaggiano sempre letterali
+#define DICT_LEARN 0xFE            // Record testuale: [DICT_LEARN][codice][stringa]
+#define DICT_LITERAL 0xFF          // Record testuale: [DICT_LITERAL][stringa]
+
+// Stato di una voce del dizionario lato nodo: una voce si usa come codice
+// solo dopo l'ACK del frame che l'ha insegnata
+enum DictState : uint8_t {
+  DICT_ST_UNKNOWN = 0,   // Il Root non ha la voce
+  DICT_ST_TEACHING = 1,  // Insegnamento in volo, in attesa di ACK
+  DICT_ST_KNOWN = 2,     // Il Root ha confermato la voce
+};
+
+// Codifica del valore numerico di un record, negoziata alla registrazione.
+// Le forme a virgola fissa valgono valore * 10^decimals; il minimo del tipo
+// (-128 / -32768) è un escape seguito dal float32 completo.
+enum ValueCodec : uint8_t {
+    CODEC_F32   = 0,   // float32 grezzo
+    CODEC_I8    = 1,   // int8 a virgola fissa
+    CODEC_I16   = 2,   // int16 a virgola fissa
+    CODEC_F16   = 3,   // half-float IEEE 754
+    CODEC_DICT  = 4,   // Stato testuale: codice di dizionario, o letterale (DICT_*)
+    CODEC_MASK  = 0x0F,
+    CODEC_DELTA = 0x80 // In aggiunta a CODEC_I16: delta rispetto alla base confermata (solo con ACK)
 };
 
 enum EntityType : uint8_t { 
@@ -100,33 +296,585 @@ struct __attribute__((packed)) MeshHeader {
     uint8_t dst[6];      // Final Destination
     uint8_t next_hop[6]; // Immediate Receiver (Routing)
     uint8_t ttl;         // Time To Live
+    uint8_t flags;       // Bit 0-1: PktPrio, MESH_FLAG_*
+    uint16_t seq;        // Sequenza affidabile dell'originatore (con MESH_FLAG_ACK_REQ)
 };
 
+#define MESH_MAX_PAYLOAD (MESH_MAX_FRAME - sizeof(MeshHeader))
+
+// Header fisso della registrazione, seguito da name, unit e dev_class
+// come stringhe NUL-terminate di lunghezza libera.
 struct __attribute__((packed)) RegPayload {
     uint32_t entity_hash;
     char type_id;
-    char name[24];
-    char unit[8];
-    char dev_class[16];
+    uint8_t index;       // Indice locale proposto dal nodo (ENTITY_INDEX_MAX = nessuno)
+    uint8_t codec;       // ValueCodec del valore numerico
+    int8_t decimals;     // Cifre decimali delle forme a virgola fissa
+};
+
+enum RegAckStatus : uint8_t {
+    REG_ACK_OK      = 0,  // Indice associato: i dati possono usarlo
+    REG_ACK_UNKNOWN = 1   // Indice mai visto (Root riavviato): ri-registrarsi
+};
+
+enum CmdAction : uint8_t {
+    CMD_OFF    = 0,   // Spegni / chiudi / sblocca
+    CMD_ON     = 1,   // Accendi / apri / blocca
+    CMD_TOGGLE = 2,
+    CMD_PRESS  = 3,
+    CMD_SET    = 4,   // value: luminosità, posizione, valore del number, target o indice dell'opzione
+    CMD_MODE   = 5    // value: modalità del climate o stato d'allarme (indice come nello stato)
+};
+
+// PKT_CMD: azione sulle entità di un tipo (o su una sola, per hash)
+struct __attribute__((packed)) CmdPayload {
+    char type_id;          // Come in registrazione ('W', 'L', 'F', ...)
+    uint8_t action;
+    float value;
+    uint32_t entity_hash;  // 0 = tutte le entità del tipo
+};
+
+// Coda dei frame di controllo in broadcast: contatore della sorgente,
+// monotono anche tra i riavvii, e HMAC troncato di header e payload
+struct __attribute__((packed)) AuthTrailer {
+    uint32_t counter;
+    uint8_t tag[AUTH_TAG_LEN];
+};
+
+// Nodo: ultimo contatore accettato per sorgente, con la finestra dei precedenti
+struct AuthSource {
+    uint8_t mac[6] = {0};
+    uint32_t last = 0;
+    uint32_t seen = 0;      // Bit i = contatore last - i già accettato; 0 = slot libero
+    uint32_t used = 0;      // Per l'LRU quando le sorgenti sono troppe
+};
+
+struct AuthTable {
+    AuthSource src[AUTH_SOURCES];
+    bool dirty = false;     // Da salvare in NVS dal loop principale
+    uint32_t last_save = 0;
+    ESPPreferenceObject pref;  // Creata una volta in restore_auth()
+};
+
+struct __attribute__((packed)) AuthTableRecord {
+    uint8_t mac[AUTH_SOURCES][6];
+    uint32_t last[AUTH_SOURCES];
+};
+
+// PKT_MIGRATE: canale di destinazione e istante del cambio
+struct __attribute__((packed)) MigratePayload {
+    uint8_t channel;
+    uint32_t switch_at;  // Tempo di mesh, 0 = subito (dopo il rilancio)
+};
+
+// PKT_TEST: intestazione del dato sintetico, poi riempimento fino alla dimensione scelta
+struct __attribute__((packed)) TestPayload {
+    uint32_t seq;      // Consecutivo per sorgente: i buchi sono perdite
+    uint32_t sent_at;  // Tempo di mesh all'invio, 0 = orologio non agganciato
+};
+
+// Root: contatori di una sorgente nella finestra corrente
+struct TestStats {
+    uint32_t base_seq = 0;  // Prima sequenza attesa nella finestra
+    uint32_t max_seq = 0;
+    bool any = false;       // Almeno un frame nella finestra
+    bool started = false;
+    uint32_t rx = 0;
+    uint32_t dup = 0;
+    uint32_t bytes = 0;
+    uint32_t lat_samples = 0;
+    uint32_t lat_sum_ms = 0;
+    uint32_t lat_max_ms = 0;
+};
+
+// Root -> nodo: gruppi assegnati (sostituiscono quelli del YAML)
+struct __attribute__((packed)) GroupSet {
+    uint32_t groups;
+};
+
+// Root -> nodo: codice di dizionario sconosciuto, va reinsegnato
+struct __attribute__((packed)) DictMiss {
+    uint8_t index;
+    uint8_t code;
+};
+
+// Root -> nodo: conferma dell'associazione indice -> entità
+struct __attribute__((packed)) RegAck {
+    uint32_t entity_hash;
+    uint8_t index;
+    uint8_t status;
+};
+
+// Root: entità di un nodo, in posizione pari al suo indice
+struct RegEntity {
+    uint32_t hash = 0;
+    char type_id = 0;
+    uint8_t codec = CODEC_F32;
+    int8_t decimals = 0;
+    int32_t base[2] = {0, 0};      // Ultimi due assoluti (virgola fissa), per i delta
+    int16_t base_tag[2] = {-1, -1};
+    std::vector<std::string> dict;  // Codice -> stringa (opzioni della select, poi apprese)
+    std::string uid;  // Vuoto = slot libero
+    bool migrated = false;  // Vecchia discovery come sensor già tolta
+};
+
+// Root: registro di un nodo, ripristinato da NVS dopo un riavvio
+struct RegNode {
+    std::vector<RegEntity> entities;  // Per indice (solo entità con indice confermato)
+    std::map<uint32_t, RegEntity> overflow;  // Entità senza indice (oltre ENTITY_INDEX_MAX), per hash
+    uint8_t slot = 0xFF;              // Short ID = record NVS (0xFF = non salvato)
+    uint32_t last_seen = 0;
+    uint32_t idle_base_s = 0;         // Inattività ereditata da NVS, azzerata al primo frame
+    uint32_t last_resync = 0;
+    bool dirty = false;
+    int8_t avail = -1;                // -1 = non ancora pubblicata, 0 = offline, 1 = online
+    uint8_t pings = 0;                // Ping inviati dall'ultimo frame ricevuto
+    uint32_t last_ping = 0;
+};
+
+class EspMesh;
+struct RootType;
+
+// Root: stato di un'entità da pubblicare, passato al decoder del suo tipo
+struct StateContext {
+    const MeshHeader *h;
+    RegEntity *ent;
+    const RootType *rt;
+    const uint8_t *payload;  // Dopo indice o hash
+    int len;
+    std::string stat;        // mesh_gw/<uid>/state
+    bool coalesce;
+};
+
+// Root: topic di comando di un'entità, mesh_gw/<uid>/<suffisso>
+enum CmdTopic : uint8_t {
+    CMD_TOPIC_SET   = 0,  // set: stato, valore o opzione
+    CMD_TOPIC_LEVEL = 1,  // set_level: luminosità, velocità o posizione in %
+    CMD_TOPIC_MODE  = 2   // set_mode: modalità del climate
+};
+
+// Root: cosa sa del tipo di un'entità, dai RootTraits in mesh.cpp
+struct RootType {
+    char id;
+    const char *component;           // Componente della discovery di Home Assistant
+    bool occurrence;                 // Pulsanti ed eventi: ogni stato va pubblicato
+    const char *const *names;        // Nomi degli stati enum (nullptr = nessuno)
+    uint8_t name_count;
+    bool (EspMesh::*decode)(StateContext &c);
+    // Chiavi della discovery oltre a nome, id, disponibilità e dispositivo
+    void (*discovery)(std::string &j, const std::string &base, const std::vector<std::string> &fields);
+    // Payload MQTT -> comando per il nodo; nullptr = tipo in sola lettura
+    bool (*command)(uint8_t topic, const std::string &payload, const RegEntity &e, CmdPayload &c);
+};
+
+struct __attribute__((packed)) RegEntityRecord {
+    uint32_t hash;
+    char type_id;
+    uint8_t codec;
+    int8_t decimals;
+    uint8_t index;       // ENTITY_INDEX_MAX = senza indice
+    uint8_t migrated;
+};
+
+struct __attribute__((packed)) RegNodeRecord {
+    uint8_t mac[6];
+    uint32_t idle_s;
+    uint8_t count;
+    RegEntityRecord entities[REG_PERSIST_ENTITIES];
+};
+
+struct __attribute__((packed)) RegIndexRecord {
+    uint16_t epoch;
+    uint8_t used[REG_PERSIST_NODES];  // Slot occupati
+};
+
+// Nodo: stato del codec di un'entità
+struct CodecState {
+    uint8_t codec = CODEC_F32;
+    int8_t decimals = 0;
+    bool base_valid = false;  // Base confermata dal Root corrente
+    uint16_t base_seq = 0;    // Seq del record assoluto che l'ha fissata
+    int32_t base = 0;
+    uint8_t deltas = 0;       // Delta inviati sulla base attuale
+    std::vector<std::string> dict;   // Codice -> stringa
+    std::vector<uint32_t> dict_used; // Ultimo uso (per l'LRU delle voci apprese)
+    std::vector<uint8_t> dict_state; // DictState per voce
+    uint8_t dict_fixed = 0;          // Voci statiche in testa (opzioni della select)
+    uint8_t last_code = DICT_LITERAL;
+    char type_id = 0;
+};
+
+// PKT_AGG: sequenza di record PKT_DATA di originatori diversi, ognuno con
+// i campi dell'header che servono al Root (ACK, latenza, rotta inversa)
+struct __attribute__((packed)) AggRecord {
+    uint8_t src[6];
+    uint8_t ttl;
+    uint8_t flags;
+    uint16_t seq;
+    uint8_t len;         // Byte di payload che seguono
+};
+
+// Ogni frammento porta il tipo del messaggio originale
+struct __attribute__((packed)) FragHeader {
+    uint8_t msg_id;
+    uint8_t index;
+    uint8_t count;
+    uint8_t inner_type;
+};
+
+#define FRAG_CHUNK (MESH_MAX_PAYLOAD - sizeof(FragHeader))
+
+// Richiesta di ritrasmissione selettiva (Root -> Nodo)
+struct __attribute__((packed)) FragNack {
+    uint8_t msg_id;
+    uint8_t missing;     // Bitmask dei frammenti mancanti
+};
+
+// Buffer di riassemblaggio (Root)
+struct FragSlot {
+    bool in_use = false;
+    uint8_t src[6];
+    uint8_t msg_id;
+    uint8_t inner_type;
+    uint8_t count;
+    uint8_t received;    // Bitmask dei frammenti arrivati
+    uint8_t nacks;
+    uint16_t len;
+    uint32_t first_rx;
+    uint32_t last_rx;
+    std::vector<uint8_t> data;
+};
+
+// Messaggio frammentato già inviato (Nodo)
+struct FragTx {
+    uint8_t msg_id;
+    uint8_t inner_type;
+    uint8_t flags;
+    std::vector<uint8_t> data;
+};
+
+// Annuncio periodico di Root e Repeater
+struct __attribute__((packed)) AnnouncePayload {
+    uint8_t hop;
+    uint8_t root_id[6];  // Root a cui porta questo ramo
+    uint8_t root_load;   // Carico dichiarato dal Root (0-255)
+    uint16_t path_cost;  // Costo cumulato fino al Root
+    uint8_t parent[6];   // Parent dell'annunciante (anti-loop)
+    uint32_t mesh_time;  // Orologio di mesh al momento della trasmissione
+    uint16_t reg_epoch;  // Epoca del registro del Root: se cambia, i nodi si ri-registrano
+    uint32_t groups;     // Gruppi dell'annunciante e del suo sottoalbero
 };
 
-// Routing Entry
+// Report di topologia (nodo -> Root), seguito da n_neighbors TopoNeighbor
+struct __attribute__((packed)) TopoPayload {
+    uint8_t parent[6];
+    uint8_t hop;
+    uint16_t path_cost;
+    uint8_t children;
+    uint8_t n_neighbors;
+    uint32_t manifest;   // XOR delle entità registrate: il Root verifica il suo registro
+};
+
+struct __attribute__((packed)) TopoNeighbor {
+    uint8_t mac[6];
+    int8_t rssi;
+};
+
+// Vicino sentito dagli annunci (nodo)
+struct NeighborInfo {
+    int8_t rssi;
+    bool is_child;
+    uint32_t last_seen;
+    // Candidato parent: costo fino al Root passando da lui (0xFFFF = inutilizzabile)
+    uint8_t hop;
+    uint16_t cost;
+    uint16_t adv_cost;   // Costo annunciato da lui (condizione di fattibilità anti-loop)
+    uint8_t root_id[6];
+    uint8_t root_load;
+    uint32_t groups;     // Gruppi del suo sottoalbero (conta solo per i figli)
+};
+
+// Nodo nel grafo di topologia (Root)
+struct TopoNode {
+    std::string parent;
+    uint8_t hop;
+    uint16_t path_cost;
+    uint8_t children;
+    std::vector<std::pair<std::string, int8_t>> neighbors;
+    uint32_t last_report;
+};
+
+// Offerta di firmware (Root -> nodo, sempre unicast cifrato)
+struct __attribute__((packed)) OtaOffer {
+    uint16_t session;
+    uint32_t size;
+    uint8_t sha256[32];
+    uint8_t multicast;   // 1 = blocchi in broadcast, ritrasmessi dai repeater
+};
+
+enum OtaStatus : uint8_t {
+    OTA_ST_RUNNING = 0,
+    OTA_ST_DONE,
+    OTA_ST_HASH_FAIL,
+    OTA_ST_ERROR,
+};
+
+// Richiesta/conferma (nodo -> Root): tutto prima di base è scritto in flash
+struct __attribute__((packed)) OtaReq {
+    uint16_t session;
+    uint32_t base;
+    uint8_t missing;     // Bit i = blocco base+i mancante
+    uint8_t status;
+};
+
+// Blocco di firmware, seguito dai dati
+struct __attribute__((packed)) OtaData {
+    uint16_t session;
+    uint32_t block;
+};
+
+#define OTA_BLOCK (MESH_MAX_PAYLOAD - sizeof(OtaData))
+
+// Blocco tenuto da un repeater per servire il sottoalbero
+struct OtaCacheEntry {
+    uint16_t session;
+    uint32_t block;
+    uint8_t len;
+    uint8_t data[OTA_BLOCK];
+};
+
+#ifdef IS_NODE
+// Ricezione in corso sul nodo; sopravvive a cambi di parent e riavvii del Root
+struct OtaRx {
+    bool active = false;
+    uint16_t session;
+    bool multicast;
+    uint32_t size;
+    uint32_t count;
+    uint32_t base;           // Prossimo blocco da scrivere
+    uint8_t have;            // Blocchi ricevuti in [base, base + OTA_WINDOW)
+    uint8_t sha256[32];
+    uint8_t buf[OTA_WINDOW][OTA_BLOCK];
+    uint32_t req_hi;         // Blocchi prima di questo già richiesti
+    uint32_t last_req;
+    uint32_t last_rx;
+    esp_ota_handle_t handle;
+    const esp_partition_t *part;
+    mbedtls_sha256_context sha;
+    uint8_t status;
+    uint32_t reboot_at;
+};
+#endif
+
+// Avanzamento di un nodo nel rollout (Root)
+// Hash dell'ultima immagine installata via mesh (NVS)
+struct OtaInstalled {
+    uint8_t sha256[32];
+};
+
+struct OtaProgress {
+    uint32_t base = 0;
+    uint8_t missing = 0;
+    uint8_t status = OTA_ST_RUNNING;
+    bool started = false;
+    uint32_t first_req = 0;
+    uint32_t last_seen = 0;
+    uint32_t last_offer = 0;
+    uint32_t finished = 0;
+};
+
+struct OtaBlock {
+    std::string data;
+    uint32_t last_sent = 0;
+};
+
+// Rollout in corso sul Root; i blocchi arrivano dall'uploader via MQTT
+struct OtaSession {
+    bool active = false;
+    uint16_t id;
+    bool multicast;
+    uint32_t size;
+    uint32_t count;
+    uint8_t sha256[32];
+    uint32_t started;
+    uint32_t bytes_sent;
+    std::map<std::string, OtaProgress> nodes;     // MAC (6 byte) -> avanzamento
+    std::map<uint32_t, OtaBlock> cache;           // Indice -> blocco
+    std::map<uint32_t, uint32_t> fetching;        // Primo blocco del range -> richiesto a
+};
+
+enum ProfPath : uint8_t {
+    PROF_ON_PACKET = 0,
+    PROF_ROUTE,          // route_packet + accodamento
+    PROF_PEER_SLOT,
+    PROF_HANDLE_REG,
+    PROF_HANDLE_DATA,
+    PROF_SUBMIT_STATE,   // Nodo: callback di stato -> record in coda
+    PROF_PATHS,
+};
+
+struct ProfCounter {
+    uint32_t calls;
+    uint64_t cycles;
+    uint32_t max_cycles;
+    uint32_t bytes;      // Byte copiati (memcpy di frame) nel percorso
+};
+
+// Misura in cicli CPU dalla costruzione alla distruzione; nullptr = spenta
+class ProfScope {
+ public:
+  explicit ProfScope(ProfCounter *c) : c_(c), start_(c ? esp_cpu_get_cycle_count() : 0) {}
+  ~ProfScope() {
+    if (c_ == nullptr)
+      return;
+    uint32_t d = esp_cpu_get_cycle_count() - start_;
+    c_->calls++;
+    c_->cycles += d;
+    if (d > c_->max_cycles)
+      c_->max_cycles = d;
+  }
+
+ protected:
+  ProfCounter *c_;
+  uint32_t start_;
+};
+
+// Evento consegnato al contesto della mesh (task dedicato o loop)
+enum MeshEventType : uint8_t {
+    MESH_EV_RX = 0,      // Frame ricevuto (callback WiFi)
+    MESH_EV_SENT,        // Esito di un invio (callback WiFi)
+    MESH_EV_LOCAL,       // Dato di un'entità da inviare al Root
+};
+
+struct MeshEvent {
+    uint8_t type;
+    uint8_t mac[6];
+    int8_t rssi;             // RX
+    bool ok;                 // SENT
+    uint8_t pkt_type;        // LOCAL
+    uint8_t flags;           // LOCAL
+    std::vector<uint8_t> *local;  // LOCAL: payload allocato da submit(), liberato dal task
+    int len;                 // RX
+    uint8_t data[MESH_MAX_FRAME];
+};
+
+// Rivendicazione MQTT di un nodo tra più Root
+struct NodeOwner {
+    std::string root;
+    uint32_t refreshed = 0;
+};
+
+// Messaggio MQTT in attesa; coalesce = si tiene solo l'ultimo valore per topic,
+// control = rivendicazioni e disponibilità, mai sacrificate a coda piena
+struct PendingPublish {
+    std::string topic;
+    std::string payload;
+    uint8_t qos;
+    bool retain;
+    bool coalesce;
+    bool control;
+};
+
+// ACK selettivo: bit i di window = sequenza (seq - i) ricevuta
+struct __attribute__((packed)) AckPayload {
+    uint16_t seq;        // Sequenza più alta ricevuta
+    uint32_t window;
+};
+
+// Frame affidabile in attesa di ACK (Nodo)
+struct RtxEntry {
+    uint16_t seq;
+    uint8_t type;
+    uint8_t flags;
+    uint8_t retries;
+    uint32_t first_sent;
+    uint32_t last_sent;
+    uint32_t rto;
+    std::vector<uint8_t> payload;
+};
+
+struct RttEstimator {
+    uint32_t srtt = 0;
+    uint32_t rttvar = 0;
+};
+
+// Finestra anti-duplicato per originatore (Root)
+struct AckWindow {
+    bool valid = false;
+    uint16_t highest = 0;
+    uint32_t window = 0;
+};
+
+// Frame in attesa di trasmissione
+struct TxFrame {
+    uint8_t next_hop[6];
+    uint8_t len;
+    uint8_t data[MESH_MAX_FRAME];
+    uint32_t enqueued_us;
+    uint32_t not_before_us;  // Jitter: il frame non parte prima
+};
+
+// Contatori per classe, azzerati a ogni report
+struct MeshStats {
+    uint32_t tx_sent[PRIO_CLASSES];
+    uint32_t tx_dropped[PRIO_CLASSES];
+    uint32_t queue_delay_max_us[PRIO_CLASSES];
+    uint64_t queue_delay_sum_us[PRIO_CLASSES];
+    uint32_t tx_fail;
+    uint32_t rtx_sent;
+    uint32_t rtx_dropped;
+    uint32_t pub_sent;
+    uint32_t pub_coalesced;
+    uint32_t pub_dropped;
+    uint32_t announce_deferred;  // Annunci rimandati per un vicino appena sentito
+    uint32_t parent_failovers;   // Nodo: cambi di parent per perdita del precedente
+    uint32_t outage_max_ms;      // Nodo: dalla perdita al primo frame confermato dal nuovo parent
+    uint32_t agg_frames;         // Repeater: PKT_AGG inviati
+    uint32_t agg_records;        // Repeater: record PKT_DATA uniti nei PKT_AGG
+    uint32_t channel_moves;      // Cambi di canale (Root: dell'AP; Nodo: migrazioni seguite)
+    uint32_t sync_samples;       // Nodo: errore dell'orologio a ogni annuncio del parent
+    uint32_t sync_err_sum_ms;
+    uint32_t sync_err_max_ms;
+    uint32_t lat_samples;        // Root: latenza end-to-end dei dati con timestamp
+    uint32_t lat_sum_ms;
+    uint32_t lat_max_ms;
+    uint32_t lat_hops;
+    uint32_t auth_rejected;      // Nodo: frame di controllo con firma non valida
+};
+
+// Routing Entry, agganciata a uno slot della timer wheel
 struct RouteInfo {
     uint8_t next_hop[6];
     uint32_t last_seen;
+    uint16_t rounds;                          // Giri della wheel prima di valutare la scadenza
+    uint8_t slot;
+    std::list<std::string>::iterator wheel_it;
+};
+
+// Voce del manifest generato da __init__.py (tabella constexpr in main.cpp)
+struct ManifestEntry {
+    EntityType type;
+    uint32_t hash;       // fnv1 dell'object_id calcolato in Python, verificato all'avvio
+    const uint8_t *reg;  // RegPayload + stringhe già pronti, nullptr = da costruire a runtime
+    uint16_t reg_len;
 };
 
 // Device Component
 struct __attribute__((packed)) EntityInfo {
     EntityBase *entity;
     EntityType type;
+    const ManifestEntry *meta;  // nullptr se l'hash non corrisponde
 };
 
 class EspMesh : public Component {
+  friend struct MeshBench;  // Benchmark host (bench/bench.cpp)
+  template<char ID> friend struct RootTraits;  // Decoder dello stato per tipo (Root)
+
  public:
   void setup() override;
   void loop() override;
   void dump_config() override;
+  void on_shutdown() override;
   float get_setup_priority() const override;
 
   // --- SETTERS (L'interfaccia per Python) ---
@@ -134,6 +882,23 @@ class EspMesh : public Component {
   void set_mesh_id(const std::string &id);
   void set_pmk(const std::string &pmk);
   void set_channel(uint8_t channel); // Solo per Node
+  void set_reliable_mask(uint32_t mask);
+  void set_publish_rate(uint16_t rate); // Solo per Root, messaggi/s
+  void set_availability_timeout(uint32_t ms); // Solo per Root, 0 = disattivata
+  void set_groups(uint32_t mask);       // Solo per Node, bit (g - 1)
+  void set_manifest(const ManifestEntry *entries, size_t count);  // Solo per Node
+  void add_entity(EntityBase *entity, size_t index);              // Solo per Node, voce del manifest
+  void set_timestamps(bool enabled);    // Solo per Node
+  void set_tx_slots(uint8_t slots);     // 0 = solo jitter
+  void set_route_timeout(uint32_t ms);
+  void set_multipath(bool enabled);     // Solo per Node
+  void set_aggregate(uint32_t hold_ms); // Solo per Node, 0 = disattivato
+  void set_test_traffic(uint32_t interval_ms, uint8_t size, uint8_t prio, bool reliable);  // Solo per Node
+  void set_task(uint8_t core, uint8_t priority);
+  void set_profile(bool enabled);
+  uint32_t mesh_time();
+  // Invio al Root sicuro da qualsiasi contesto (callback delle entità)
+  void submit(uint8_t type, const uint8_t *payload, size_t len, uint8_t flags);
   
 #ifdef IS_ROOT
   void set_mqtt(mqtt::MQTTClient *m) { mqtt_ = m; }
@@ -147,38 +912,340 @@ class EspMesh : public Component {
   // Routing State
   uint8_t parent_mac_[6];
   uint8_t hop_count_ = 0xFF;
+  uint16_t path_cost_ = 0xFFFF;
+  uint8_t root_id_[6];
+  uint8_t root_load_ = 0;
+  uint16_t reg_epoch_ = 0;  // Root: epoca del registro; Node: epoca con cui ci siamo registrati
   std::map<std::string, RouteInfo> routes_;
+  Mutex route_lock_;
+  std::list<std::string> route_wheel_[ROUTE_WHEEL_SLOTS];
+  uint8_t wheel_pos_ = 0;
+  uint32_t last_wheel_tick_ = 0;
+  uint32_t route_timeout_ = 120000;
+  std::map<std::string, uint8_t> hop_fails_;  // Next hop -> invii falliti consecutivi
+  uint8_t queue_peak_ = 0;                    // Frame in coda, massimo dall'ultimo annuncio
+  // Firma dei frame di controllo in broadcast: il contatore non torna mai
+  // indietro, nemmeno dopo un riavvio (blocchi riservati in NVS)
+  uint32_t auth_counter_ = 0;
+  uint32_t auth_reserved_ = 0;
+  bool auth_reserve_dirty_ = false;
+  ESPPreferenceObject auth_pref_;  // Preferenze create una volta: ogni make_preference alloca
+  Mutex auth_lock_;
+  void auth_tag(const MeshHeader *h, const uint8_t *payload, size_t len, uint32_t counter, uint8_t *tag);
+  void auth_sign(const MeshHeader &h, std::vector<uint8_t> &payload);
+  void save_auth(bool force);
+#ifdef IS_NODE
+  AuthTable group_auth_;    // Comandi di gruppo
+  AuthTable migrate_auth_;  // Avvisi di migrazione, separati: non si contendono gli slot
+  bool auth_check(AuthTable &t, const MeshHeader *h, const uint8_t *payload, int &len);
+  void restore_auth(AuthTable &t, const char *key);
+  void save_auth_table(AuthTable &t, bool force);
+#endif
+  void handle_group(const uint8_t *mac, const MeshHeader *h, const uint8_t *data, int len);
+  void handle_migrate(const MeshHeader *h, const uint8_t *data, int len);
   
   // Peer Management (LRU)
   std::list<std::string> peer_lru_; 
+  uint8_t current_scan_ch_ = 1;
+
+  // Code di trasmissione: un solo frame in volo, si svuota dalla classe più urgente
+  std::deque<TxFrame> tx_queue_[PRIO_CLASSES];
+  Mutex tx_lock_;
+  bool tx_busy_ = false;
+  uint32_t tx_started_ = 0;
+  MeshStats stats_{};
+  uint32_t last_stats_ = 0;
+  uint32_t reliable_mask_ = 0;
+  uint16_t publish_rate_ = 20;
+  bool timestamps_ = false;
+
+  // Scheduler degli annunci
+  uint32_t next_announce_ = 0;
+  uint32_t last_heard_announce_ = 0;
+  uint8_t tx_slots_ = 0;
+
+  // Profilazione dei percorsi caldi
+  bool profile_ = false;
+  ProfCounter prof_[PROF_PATHS]{};
+  ProfCounter *prof(ProfPath p) { return this->profile_ ? &this->prof_[p] : nullptr; }
+  void prof_bytes(ProfPath p, uint32_t n) {
+    if (this->profile_)
+      this->prof_[p].bytes += n;
+  }
+  void log_profile();
+
+  // Task dedicato: se attivo possiede tutto lo stato della mesh
+  bool use_task_ = false;
+  uint8_t task_core_ = 1;
+  uint8_t task_priority_ = 5;
+  QueueHandle_t events_{nullptr};
+  uint32_t last_housekeeping_ = 0;
 
 #ifdef IS_NODE
   bool scanning_ = true;
-  uint8_t current_scan_ch_ = 1;
   uint32_t last_scan_step_ = 0;
-  uint32_t last_announce_sent_ = 0;
   std::vector<EntityInfo> local_entities_{};
+  bool entities_attached_ = false;
+
+  // Orologio di mesh: millis() + offset, corretto per il drift
+  bool clock_synced_ = false;
+  int32_t clock_offset_ = 0;
+  float clock_drift_ = 0;
+  uint32_t last_sync_local_ = 0;
+
+  // Vicini e ultimo report di topologia inviato
+  std::map<std::string, NeighborInfo> neighbors_;
+  TopoPayload topo_sent_{};
+  uint32_t last_topo_sent_ = 0;
+
+  // Salute del parent e failover
+  uint32_t parent_alive_ = 0;  // Ultimo annuncio o ACK MAC dal parent
+  uint8_t parent_fails_ = 0;
+  bool parent_lost_ = false;
+  bool outage_pending_ = false;
+  uint32_t outage_start_ = 0;
+  uint32_t last_outage_ms_ = 0;
+
+  // OTA: ricezione propria e cache per il sottoalbero
+  OtaRx ota_;
+  std::deque<OtaCacheEntry> ota_cache_;
+
+  // Gruppi: propri (YAML o assegnati dal Root) e comandi da eseguire nel loop
+  uint32_t groups_ = 0;
+  bool groups_dirty_ = false;
+  ESPPreferenceObject groups_pref_;
+  std::vector<CmdPayload> pending_cmds_;
+  bool rescan_pending_ = false;  // Scansione chiesta dal contesto mesh, eseguita nel loop
+  bool scan_active_ = false;
+  size_t scan_pos_ = 0;          // Prossima entità da registrare
+  size_t attached_count_ = 0;    // Entità già agganciate allo stato (prima scansione)
+  uint32_t last_reg_step_ = 0;
+  Mutex cmd_lock_;
+  uint32_t children_groups();
+  void apply_command(const CmdPayload &c);
+  template<typename E> void export_entity(E *e, bool prebuilt, bool attach, uint8_t flags);
+  void submit_state(uint32_t hash, const uint8_t *value, size_t len, uint8_t flags);
+
+  // Migrazione di canale: annunciata dal Root o scoperta da un vicino
+  uint8_t op_channel_ = 0;        // Canale dell'ultimo aggancio
+  uint8_t migrate_ch_ = 0;        // Ultima migrazione annunciata, 0 = nessuna
+  bool migrate_pending_ = false;
+  uint32_t migrate_due_ = 0;
+  uint32_t scan_hold_until_ = 0;  // Scansione ferma sul canale annunciato
+  uint8_t visit_ch_ = 0;          // Vecchio canale in visita, 0 = nessuna visita
+  uint8_t visit_left_ = 0;
+  uint32_t visit_until_ = 0;
+  uint16_t migrate_seq_ = 0;
+  std::vector<uint8_t> visit_frame_;
+  void check_migration(uint32_t now);
+
+  // Parent upstream: [0] = primario, poi le alternative a costo pari
+  bool multipath_ = true;
+  uint8_t upstream_[MULTIPATH_MAX][6];
+  uint8_t upstream_count_ = 0;
+  std::map<std::string, uint32_t> upstream_tx_;  // Frame inoltrati per parent, azzerati a ogni report
+
+  // Aggregazione dei dati dei figli diretti al Root
+  uint32_t agg_hold_ms_ = AGG_HOLD_MS;
+  std::vector<uint8_t> agg_buf_;
+  uint8_t agg_count_ = 0;
+  uint8_t agg_prio_ = PRIO_BULK;
+  uint32_t agg_started_ = 0;
+
+  // Modalità di test: dati sintetici a ritmo, dimensione e priorità fissi
+  uint32_t test_interval_ms_ = 0;  // 0 = disattivata
+  uint8_t test_size_ = sizeof(TestPayload);
+  uint8_t test_flags_ = PRIO_BULK;
+  uint32_t test_seq_ = 0;
+  uint32_t next_test_ = 0;
+  void send_test_traffic(uint32_t now);
+
+  uint8_t frag_msg_id_ = 0;
+  std::deque<FragTx> frag_tx_;
+  uint16_t tx_seq_ = 0;
+  std::deque<RtxEntry> rtx_;
+  RttEstimator rtt_[RTT_HOP_BUCKETS];
 
   void setup_bare_metal();
   void send_probe();
+  void handle_announce(const MeshHeader *h, const AnnouncePayload *a, int8_t rssi);
+  void adopt_parent(const uint8_t *mac, uint8_t hop, uint16_t cost, const uint8_t *root_id, uint8_t root_load);
+  void check_parent(uint32_t now);
+  void refresh_upstream(uint32_t now);
+  void handle_ota_offer(const OtaOffer *o);
+  void handle_ota_data(const MeshHeader *h, const uint8_t *payload, int len);
+  void send_ota_req(bool retry);
+  void check_ota(uint32_t now);
+  void finish_ota();
+  bool has_children();
+  void ota_cache_put(uint16_t session, uint32_t block, const uint8_t *data, uint8_t len);
+  const OtaCacheEntry *ota_cache_get(uint16_t session, uint32_t block);
+  bool ota_serve_cached(const MeshHeader *h, OtaReq *r);
+  void pick_upstream(const MeshHeader *h, const uint8_t *payload, int len, uint8_t *next_hop);
+  bool aggregate(const uint8_t *mac, const MeshHeader *h, const uint8_t *payload, int len);
+  void agg_add(const AggRecord &r, const uint8_t *payload);
+  void flush_agg();
+  void sync_clock(uint32_t ref);
+  void track_neighbor(const uint8_t *mac, const AnnouncePayload *a, int8_t rssi);
+  void send_topology(uint32_t now);
+  void send_to_root(uint8_t type, const uint8_t *payload, size_t len, uint8_t flags);
+  void send_registration(uint32_t hash, char type_id, const char *name, const char *unit, const char *dev_class,
+                         uint8_t codec = CODEC_F32, int8_t decimals = 0,
+                         const std::vector<std::string> *options = nullptr);
+  void send_registration(const ManifestEntry &m);
+  void send_local(uint8_t type, const uint8_t *payload, size_t len, uint8_t flags);
+  uint8_t prepare_registration(const uint8_t *reg, size_t len);
+  size_t encode_record(uint8_t index, const uint8_t *payload, size_t len, uint8_t *out, uint8_t &flags);
+  size_t encode_text(CodecState &st, const uint8_t *text, size_t len, uint8_t *out, uint8_t &flags);
+  void handle_dict_miss(const DictMiss *m);
+  uint32_t dict_clock_ = 0;
+  uint16_t root_epoch_ = 0;  // Ultima epoca annunciata dal parent
+  uint32_t manifest();
+  void codec_acked(const RtxEntry &e);
+  void codec_lost(const RtxEntry &e);
+  CodecState *codec_by_index(uint8_t index, uint32_t *hash);
+  void handle_reg_ack(const RegAck *a);
+  void send_fragment(const FragTx &msg, uint8_t index);
+  void handle_frag_nack(const FragNack *n);
+  uint8_t entity_flags(EntityType type);
+  void track_reliable(const MeshHeader &h, const uint8_t *payload, size_t len);
+  void check_retransmit(uint32_t now);
+  void handle_ack(const AckPayload *a);
+  void update_rtt(uint32_t sample);
+  uint32_t current_rto();
   void scan_local_entities();
-  std::vector<EntityInfo> get_local_entities();    
-  template<typename T>
-    void add_entities_to_local_list(const T& entities, EntityType type);
+  void request_rescan();
+  std::map<uint32_t, uint8_t> entity_index_;  // hash -> indice, stabile tra le scansioni
+  std::vector<bool> index_acked_;             // Indici confermati dal Root corrente
+  std::map<uint32_t, CodecState> codecs_;     // hash -> codec negoziato
+  uint32_t last_reg_resync_ = 0;
+  const std::vector<EntityInfo> &get_local_entities() { return this->local_entities_; }
+  const ManifestEntry *manifest_ = nullptr;
+  size_t manifest_count_ = 0;
 #endif
 
 #ifdef IS_ROOT
   mqtt::MQTTClient *mqtt_{nullptr};
-  uint32_t last_announce_ = 0;
-  void handle_reg(const uint8_t *origin, const RegPayload *p);
-  void handle_data(const uint8_t *origin, const uint8_t *payload);
+  FragSlot frag_slots_[FRAG_MAX_SLOTS];
+  std::map<std::string, AckWindow> ack_windows_;
+  std::map<std::string, NodeOwner> node_owners_;
+  Mutex owner_lock_;  // Scritto dalla callback MQTT, letto dal percorso dei pacchetti
+  std::string root_hex_;
+  uint32_t publish_count_ = 0;
+  uint32_t last_load_update_ = 0;
+  std::deque<PendingPublish> pub_queue_;
+  Mutex pub_lock_;
+  float pub_tokens_ = 0;
+  uint32_t last_pub_drain_ = 0;
+  std::map<std::string, TopoNode> topo_;  // nodo -> ultimo report
+  bool topo_snapshot_sent_ = false;
+  bool topo_dirty_ = false;
+  uint32_t last_topo_snapshot_ = 0;
+  OtaSession ota_;
+  Mutex ota_lock_;  // Comandi e blocchi MQTT (loop) contro richieste dei nodi (mesh)
+
+  void handle_reg(const uint8_t *origin, const uint8_t *payload, int len);
+  void handle_data(const MeshHeader *h, const uint8_t *payload, int len, uint32_t origin_ts);
+  void send_reg_ack(const uint8_t *node, uint32_t hash, uint8_t index, uint8_t status);
+  bool decode_text(const MeshHeader *h, RegEntity &e, const uint8_t *payload, int len, std::string &out);
+  bool publish_bool(StateContext &c);
+  bool publish_level(StateContext &c);
+  bool publish_enum(StateContext &c);
+  bool publish_press(StateContext &c);
+  bool publish_text(StateContext &c);
+  bool publish_event(StateContext &c);
+  bool publish_value(StateContext &c);
+  bool publish_climate(StateContext &c);
+  int publish_number(StateContext &c);
+  bool read_text(StateContext &c, std::string &out);
+  void handle_frag(const MeshHeader *h, const uint8_t *payload, int len);
+  void handle_agg(const uint8_t *mac, const MeshHeader *h, const uint8_t *payload, int len);
+  void deliver(const MeshHeader *h, uint8_t type, const uint8_t *payload, int len);
+  void check_reassembly(uint32_t now);
+  bool ack_reliable(const MeshHeader *h);
+  bool claim_node(const std::string &node, bool force);
+  RegNode &reg_node(const std::string &id);
+  uint32_t reg_manifest(const RegNode &n);
+  RegEntity *find_entity(RegNode &n, uint32_t hash);
+  void request_resync(const uint8_t *node, RegNode &n);
+  void restore_registry();
+  void check_registry(uint32_t now);
+  void save_registry();
+  std::map<std::string, RegNode> registry_;  // nodo -> entità per indice
+  Mutex reg_lock_;  // Record preparati nel contesto mesh, scritti in NVS dal loop
+  std::vector<std::pair<uint8_t, RegNodeRecord>> reg_pending_;
+  bool reg_index_dirty_ = false;
+  RegIndexRecord reg_index_rec_{};
+  bool reg_index_pending_ = false;
+  ESPPreferenceObject reg_index_pref_;  // Create una volta in restore_registry()
+  ESPPreferenceObject reg_prefs_[REG_PERSIST_NODES];
+  bool resync_requested_ = false;  // Comando MQTT, eseguito nel contesto mesh
+  uint32_t last_reg_save_ = 0;
+  uint32_t last_reg_refresh_ = 0;
+  void mark_alive(const uint8_t *node);
+  void on_group_command(const std::string &topic, const std::string &payload);
+  void on_group_assign(const std::string &topic, const std::string &payload);
+  void on_entity_command(const std::string &topic, const std::string &payload);
+  void send_entity_commands();
+  std::vector<std::pair<std::string, std::string>> entity_cmds_;  // Topic e payload, sotto ctrl_lock_
+  void on_channel_set(const std::string &payload);
+  void check_channel(uint32_t now);
+  uint8_t root_channel_ = 0;
+  uint32_t last_channel_check_ = 0;
+  std::vector<uint8_t> migrate_frame_;  // Annuncio pianificato, ripetuto MIGRATE_REPEAT volte
+  uint8_t migrate_left_ = 0;
+  uint32_t migrate_next_ = 0;
+  std::map<std::string, TestStats> test_stats_;  // Sorgente -> finestra di misura
+  uint32_t last_test_report_ = 0;
+  void handle_test(const MeshHeader *h, const uint8_t *payload, int len);
+  void report_test(uint32_t now);
+  std::vector<std::pair<MeshHeader, std::vector<uint8_t>>> ctrl_pending_;  // Dai comandi MQTT
+  Mutex ctrl_lock_;
+  uint16_t group_seq_ = 0;
+  void check_availability(uint32_t now);
+  uint32_t avail_timeout_ = 90000;
+  std::map<std::string, bool> avail_changes_;  // Da pubblicare nel prossimo batch
+  uint32_t last_avail_check_ = 0;
+  uint32_t last_avail_batch_ = 0;
+  void on_owner_message(const std::string &topic, const std::string &payload);
+  void queue_publish(const std::string &topic, const std::string &payload, uint8_t qos, bool retain,
+                     bool coalesce);
+  void queue_control(const std::string &topic, const std::string &payload);
+  void drain_publish_queue(uint32_t now);
+  void publish_origin_ts(const std::string &uid, uint32_t origin_ts, bool coalesce);
+  void handle_topo(const uint8_t *origin, const uint8_t *payload, int len);
+  void check_topology(uint32_t now);
+  std::string topo_node_json(const std::string &id, const TopoNode &n);
+  void on_ota_start(const std::string &payload);
+  void on_ota_data(const std::string &topic, const std::string &payload);
+  void handle_ota_req(const uint8_t *origin, const uint8_t *payload, int len);
+  void serve_ota(const std::string &node, OtaProgress &p, uint32_t now);
+  void send_ota_block(const uint8_t *dst, uint32_t block, OtaBlock &b, uint32_t now);
+  void send_ota_offer(const std::string &node, uint32_t now);
+  void fetch_ota(uint32_t block, uint32_t now);
+  void publish_ota_status(const std::string &node, const OtaProgress &p);
+  void check_ota(uint32_t now);
 #endif
 
   // Core Networking
+  void run_mesh(uint32_t now);
+  static void task_main(void *arg);
+  void handle_event(MeshEvent &ev);
   void on_packet(const uint8_t *mac, const uint8_t *data, int len, int8_t rssi);
   void route_packet(MeshHeader *h, const uint8_t *payload, int len);
+  void learn_route(const uint8_t *dst, const uint8_t *next_hop);
+  void schedule_route(const std::string &key, RouteInfo &r, uint32_t delay_ms);
+  void advance_route_wheel(uint32_t now);
+  void invalidate_routes_via(const uint8_t *next_hop);
   
   // Low Level Helpers
+  void send_announce();
+  void schedule_announce(uint32_t now);
+  void fill_header(MeshHeader &h, uint8_t type, const uint8_t *dst, uint8_t ttl, uint8_t flags);
+  void enqueue_tx(const uint8_t *next_hop, const uint8_t *data, int len);
+  void pump_tx();
+  void on_sent(const uint8_t *mac, bool ok);
+  void log_stats();
   void send_raw(const uint8_t *next_hop, const uint8_t *data, int len);
   void ensure_peer_slot(const uint8_t *mac);
   void derive_lmk(const uint8_t *mac, uint8_t *lmk);